@@ -0,0 +1,437 @@
+// Benchmark harness: runs warm-up plus timed queries through each engine
+// on identical inputs and prints one JSON document on stdout (progress
+// goes to stderr, so `make bench > out.json` is machine-readable).
+//
+// Per-query engines report QPS and p50/p95/p99 latency over every timed
+// query. Batch engines (scan-batch, gemm) are timed per pass over the
+// query set and report QPS only. scan-mixed times single queries while
+// a batch search of the whole query set runs continuously on another
+// thread, to show how much a long batch delays short queries (compare
+// with and without --work-stealing).
+//
+// "allocations_per_query" counts operator new calls per query on the
+// allocation-free scan path (brute_force_search into a reused
+// SearchScratch and output buffer) after warm-up. It must be 0 on any
+// thread count: when it is not, the report is still printed but the
+// harness exits with status 1 (`make check` relies on this).
+//
+// GB/s is the database bytes each query has to stream divided by the
+// time per query, compared against a measured single-stream read
+// bandwidth (or --peak-gbs).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "distance.h"
+#include "gemm_search.h"
+#include "groundtruth.h"
+#include "hnsw_index.h"
+#include "ivf_index.h"
+#include "numa.h"
+#include "pq_index.h"
+#include "quantized_store.h"
+#include "scheduler.h"
+#include "search.h"
+#include "vector_store.h"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+// Every heap allocation made through operator new in this process.
+// GCC flags the free() below as mismatched with the library's allocations
+// it inlines; both sides are the replacements defined here.
+static atomic<size_t> g_allocations(0);
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t size) {
+    g_allocations.fetch_add(1, memory_order_relaxed);
+    if (void* p = malloc(size == 0 ? 1 : size)) return p;
+    throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+#pragma GCC diagnostic pop
+
+// Heap allocations per query of the scratch-based scan once warmed up.
+static double scan_allocations_per_query(const VectorStore& queries, const VectorStore& database, int k,
+                                         const SearchParams& params) {
+    SearchScratch scratch;
+    vector<SearchResult> out(static_cast<size_t>(k));
+    for (size_t q = 0; q < min<size_t>(queries.size(), 3); q++) {
+        brute_force_search(queries.row(q), database, k, out.data(), scratch, params);
+    }
+    const size_t before = g_allocations.load();
+    for (size_t q = 0; q < queries.size(); q++) {
+        brute_force_search(queries.row(q), database, k, out.data(), scratch, params);
+    }
+    return static_cast<double>(g_allocations.load() - before) / queries.size();
+}
+
+static double elapsed_ms(Clock::time_point start) {
+    return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+// Nearest-rank percentile of sorted samples.
+static double percentile(const vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    size_t rank = static_cast<size_t>(p / 100.0 * sorted.size() + 0.5);
+    return sorted[min(sorted.size() - 1, rank == 0 ? 0 : rank - 1)];
+}
+
+// Read bandwidth of the active distance kernel streaming a buffer far
+// larger than the caches: the realistic ceiling for a scan.
+static double measure_peak_gbs() {
+    const size_t dim = 1024;
+    const size_t rows = (256u << 20) / (dim * sizeof(float));
+    VectorStore buffer(dim, rows);
+    vector<float> zero(dim, 0.0f);
+    for (size_t i = 0; i < rows; i++) fill(buffer.row(i), buffer.row(i) + dim, 1.0f);
+
+    const DistanceFn dist_fn = active_kernel().distance;
+    double best_ms = 1e30;
+    volatile float sink = 0.0f;
+    for (int pass = 0; pass < 3; pass++) {
+        auto start = Clock::now();
+        float sum = 0.0f;
+        for (size_t i = 0; i < rows; i++) sum += dist_fn(zero.data(), buffer.row(i), dim);
+        best_ms = min(best_ms, elapsed_ms(start));
+        sink = sink + sum;
+    }
+    return rows * dim * sizeof(float) / (best_ms * 1e6);
+}
+
+static string json_number(double v) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.6g", v);
+    return buf;
+}
+
+static string json_string(const string& s) {
+    string out = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '"' || s[i] == '\\') out += '\\';
+        out += s[i];
+    }
+    return out + "\"";
+}
+
+// One engine under test. Exactly one of search_one / search_all is set.
+struct BenchEngine {
+    string name;
+    string kernel;
+    double build_ms = 0.0;
+    double bytes_per_query = 0.0;      // 0 when access is not a stream (HNSW)
+    function<vector<SearchResult>(size_t)> search_one;
+    function<vector<vector<SearchResult>>()> search_all;
+    function<void()> background;       // run repeatedly on another thread while search_one is timed
+};
+
+int main(int argc, char* argv[]) {
+    int num_vectors = 100000;
+    int num_queries = 200;
+    int warmup = 10;
+    int repeat = 3;
+    const int K = 10;
+    string engine_list = "scan,scan-batch,u8,f16,gemm,ivf,hnsw,pq";
+    string base_file = "sift_base.fvecs";
+    string query_file = "sift_query.fvecs";
+    string groundtruth_file = "sift_groundtruth.ivecs";
+    double peak_gbs = 0.0;
+    IvfParams ivf_params;
+    size_t nprobe = 8;
+    HnswParams hnsw_params;
+    size_t ef_search = 64;
+    PqParams pq_params;
+    size_t rerank = 0;
+    SearchParams params;
+    bool work_stealing = false;
+    bool generic_kernel = false;
+    Metric metric = kMetricL2;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--engines" && has_value) engine_list = argv[++i];
+        else if (arg == "--queries" && has_value) num_queries = max(0, atoi(argv[++i]));
+        else if (arg == "--warmup" && has_value) warmup = max(0, atoi(argv[++i]));
+        else if (arg == "--repeat" && has_value) repeat = max(1, atoi(argv[++i]));
+        else if (arg == "--threads" && has_value) params.num_threads = max(0, atoi(argv[++i]));
+        else if (arg == "--work-stealing") work_stealing = true;
+        else if (arg == "--generic-kernel") generic_kernel = true;
+        else if (arg == "--metric" && has_value && parse_metric(argv[i + 1], metric)) i++;
+        else if (arg == "--base" && has_value) base_file = argv[++i];
+        else if (arg == "--query-file" && has_value) query_file = argv[++i];
+        else if (arg == "--groundtruth" && has_value) groundtruth_file = argv[++i];
+        else if (arg == "--peak-gbs" && has_value) peak_gbs = atof(argv[++i]);
+        else if (arg == "--nlist" && has_value) ivf_params.nlist = max(1, atoi(argv[++i]));
+        else if (arg == "--nprobe" && has_value) nprobe = max(1, atoi(argv[++i]));
+        else if (arg == "--M" && has_value) hnsw_params.M = max(2, atoi(argv[++i]));
+        else if (arg == "--ef-construction" && has_value) hnsw_params.ef_construction = max(1, atoi(argv[++i]));
+        else if (arg == "--ef-search" && has_value) ef_search = max(1, atoi(argv[++i]));
+        else if (arg == "--pq-m" && has_value) pq_params.m = max(1, atoi(argv[++i]));
+        else if (arg == "--rerank" && has_value) rerank = max(0, atoi(argv[++i]));
+        else if (arg[0] == '-') {
+            cerr << "Error: Unknown option " << arg << endl;
+            cerr << "Usage: " << argv[0] << " [num_vectors (0 = all)] [--engines LIST] [--queries N]"
+                 << " [--warmup N] [--repeat N] [--threads N] [--work-stealing] [--generic-kernel] [--metric l2|ip|cosine]"
+                 << " [--base FILE] [--query-file FILE]"
+                 << " [--groundtruth FILE] [--peak-gbs X] [--nlist N] [--nprobe N] [--M N]"
+                 << " [--ef-construction N] [--ef-search N] [--pq-m N] [--rerank N]" << endl;
+            cerr << "LIST is comma separated from scan, scan-batch, scan-mixed, scan-numa, u8, f16, gemm, ivf, hnsw, pq;"
+                 << " append :KERNEL to scan (e.g. scan:avx2) to pin the distance kernel" << endl;
+            return 1;
+        }
+        else num_vectors = atoi(arg.c_str());
+    }
+
+    auto database = read_vecs(base_file, num_vectors > 0 ? num_vectors : -1);
+    auto queries = read_vecs(query_file, num_queries > 0 ? num_queries : -1);
+    if (database.empty() || queries.empty() || queries.dim() != database.dim()) {
+        cerr << "Failed to load " << base_file << " / " << query_file << endl;
+        return 1;
+    }
+    const size_t n = database.size();
+    const size_t dim = database.dim();
+    const size_t nq = queries.size();
+    cerr << "Loaded " << n << " x " << dim << " base vectors and " << nq << " queries" << endl;
+
+    set_metric(metric);
+    if (metric == kMetricCosine) {
+        normalize_rows(database);
+        normalize_rows(queries);
+    }
+    if (!generic_kernel) specialize_kernels(dim);
+    const string default_kernel = active_kernel().name;
+    string peak_source = "user";
+    if (peak_gbs <= 0.0) {
+        peak_gbs = measure_peak_gbs();
+        peak_source = "measured";
+    }
+
+    IdTable truth = read_ivecs(groundtruth_file, static_cast<int>(nq));
+    string truth_source = groundtruth_file;
+    if (metric != kMetricL2 || truth.size() < nq || !groundtruth_covers(truth, K, n)) {
+        cerr << "Computing exact groundtruth by brute force" << endl;
+        truth = exact_groundtruth(queries, database, K, params);
+        truth_source = "brute force";
+    }
+
+    // Callers take one core each on top of the workers.
+    unique_ptr<TaskScheduler> scheduler;
+    if (work_stealing) {
+        scheduler.reset(new TaskScheduler(static_cast<size_t>(max(1, resolve_thread_count(params.num_threads) - 1))));
+        params.scheduler = scheduler.get();
+    }
+
+    // Built lazily by the engines that need them, kept alive for the run.
+    unique_ptr<NumaShardedStore> numa_store;
+    unique_ptr<Uint8Store> u8_store;
+    unique_ptr<Float16Store> f16_store;
+    unique_ptr<GemmSearchEngine> gemm;
+    unique_ptr<IvfIndex> ivf;
+    unique_ptr<HnswIndex> hnsw;
+    unique_ptr<PqIndex> pq;
+    const double f32_bytes = static_cast<double>(n) * dim * sizeof(float);
+
+    vector<string> runs;
+    stringstream list(engine_list);
+    for (string item; getline(list, item, ',');) {
+        if (!item.empty()) runs.push_back(item);
+    }
+
+    ostringstream json;
+    json << "{\n"
+         << "  \"dataset\": {\"base\": " << json_string(base_file) << ", \"vectors\": " << n
+         << ", \"dim\": " << dim << ", \"queries\": " << nq << "},\n"
+         << "  \"config\": {\"k\": " << K << ", \"threads\": " << resolve_thread_count(params.num_threads)
+         << ", \"metric\": " << json_string(metric_name(metric))
+         << ", \"work_stealing\": " << (work_stealing ? "true" : "false")
+         << ", \"warmup\": " << warmup << ", \"repeat\": " << repeat << ", \"default_kernel\": "
+         << json_string(default_kernel) << "},\n"
+         << "  \"peak_gbs\": " << json_number(peak_gbs) << ", \"peak_source\": " << json_string(peak_source)
+         << ", \"groundtruth\": " << json_string(truth_source) << ",\n"
+         << "  \"results\": [";
+
+    bool first = true;
+    for (size_t r = 0; r < runs.size(); r++) {
+        string name = runs[r];
+        string kernel = default_kernel;
+        size_t colon = name.find(':');
+        if (colon != string::npos) {
+            kernel = name.substr(colon + 1);
+            name = name.substr(0, colon);
+        }
+        if (!set_kernel(kernel)) {
+            cerr << "Skipping " << runs[r] << ": kernel not available on this CPU" << endl;
+            continue;
+        }
+
+        BenchEngine engine;
+        engine.name = runs[r];
+        engine.kernel = kernel;
+        if (active_kernel().fixed_dim) engine.kernel += "/dim" + to_string(active_kernel().fixed_dim);
+        auto build_start = Clock::now();
+        if (name == "scan") {
+            engine.bytes_per_query = f32_bytes;
+            engine.search_one = [&](size_t q) { return brute_force_search(queries.row(q), database, K, params); };
+        }
+        else if (name == "scan-batch") {
+            engine.bytes_per_query = f32_bytes;
+            engine.search_all = [&]() { return batch_search(queries, database, K, params); };
+        }
+        else if (name == "scan-mixed") {
+            engine.bytes_per_query = f32_bytes;
+            engine.search_one = [&](size_t q) { return brute_force_search(queries.row(q), database, K, params); };
+            engine.background = [&]() { batch_search(queries, database, K, params); };
+        }
+        else if (name == "scan-numa") {
+            numa_store.reset(new NumaShardedStore(NumaShardedStore::from(database)));
+            engine.kernel += " x" + to_string(numa_store->shards().size()) + " nodes";
+            engine.bytes_per_query = f32_bytes;
+            engine.search_one = [&](size_t q) { return brute_force_search(queries.row(q), *numa_store, K, params); };
+        }
+        else if ((name == "u8" || name == "f16") && metric != kMetricL2) {
+            cerr << "Skipping " << runs[r] << ": the quantized kernels compute L2 only" << endl;
+            continue;
+        }
+        else if (name == "u8") {
+            u8_store.reset(new Uint8Store(Uint8Store::from(database)));
+            engine.kernel = quantized_kernels().u8_name;
+            engine.bytes_per_query = static_cast<double>(u8_store->codes.bytes());
+            engine.search_one = [&](size_t q) { return brute_force_search(queries.row(q), *u8_store, K, params); };
+        }
+        else if (name == "f16") {
+            f16_store.reset(new Float16Store(Float16Store::from(database)));
+            engine.kernel = quantized_kernels().f16_name;
+            engine.bytes_per_query = static_cast<double>(f16_store->codes.bytes());
+            engine.search_one = [&](size_t q) { return brute_force_search(queries.row(q), *f16_store, K, params); };
+        }
+        else if (name == "gemm") {
+            gemm.reset(new GemmSearchEngine(database));
+            engine.kernel = gemm->backend();
+            engine.bytes_per_query = f32_bytes;
+            engine.search_all = [&]() { return gemm->search(queries, K, params); };
+        }
+        else if (name == "ivf") {
+            ivf_params.kmeans.num_threads = params.num_threads;
+            ivf.reset(new IvfIndex());
+            ivf->build(database, ivf_params);
+            double probed = 0.0;
+            for (size_t q = 0; q < nq; q++) {
+                vector<SearchResult> lists = ivf->probe_lists(queries.row(q), nprobe);
+                for (size_t l = 0; l < lists.size(); l++) probed += ivf->list_size(lists[l].index);
+            }
+            engine.bytes_per_query = probed / nq * dim * sizeof(float);
+            engine.search_one = [&](size_t q) { return ivf->search(queries.row(q), K, nprobe, params); };
+        }
+        else if (name == "hnsw") {
+            hnsw_params.num_threads = params.num_threads;
+            hnsw.reset(new HnswIndex());
+            hnsw->build(database, hnsw_params);
+            engine.search_one = [&](size_t q) { return hnsw->search(queries.row(q), K, ef_search, params); };
+        }
+        else if (name == "pq") {
+            pq_params.kmeans.num_threads = params.num_threads;
+            pq.reset(new PqIndex());
+            if (!pq->build(database, pq_params)) continue;
+            engine.bytes_per_query = static_cast<double>(n) * pq->code_size();
+            engine.search_one = [&](size_t q) { return pq->search(queries.row(q), K, rerank, params); };
+        }
+        else {
+            cerr << "Skipping unknown engine " << runs[r] << endl;
+            continue;
+        }
+        engine.build_ms = elapsed_ms(build_start);
+        cerr << "Running " << engine.name << " (" << engine.kernel << ")" << endl;
+
+        vector<vector<SearchResult>> results(nq);
+        vector<double> latencies;
+        double total_ms = 0.0;
+        size_t timed = 0;
+        atomic<bool> background_stop(false);
+        thread background;
+        if (engine.background) {
+            background = thread([&] {
+                while (!background_stop.load()) engine.background();
+            });
+        }
+        if (engine.search_one) {
+            for (int w = 0; w < warmup; w++) engine.search_one(static_cast<size_t>(w) % nq);
+            for (int pass = 0; pass < repeat; pass++) {
+                for (size_t q = 0; q < nq; q++) {
+                    auto start = Clock::now();
+                    results[q] = engine.search_one(q);
+                    latencies.push_back(elapsed_ms(start));
+                }
+            }
+            for (size_t i = 0; i < latencies.size(); i++) total_ms += latencies[i];
+            timed = latencies.size();
+        }
+        else {
+            if (warmup > 0) engine.search_all();
+            for (int pass = 0; pass < repeat; pass++) {
+                auto start = Clock::now();
+                results = engine.search_all();
+                total_ms += elapsed_ms(start);
+            }
+            timed = nq * repeat;
+        }
+        background_stop = true;
+        if (background.joinable()) background.join();
+        sort(latencies.begin(), latencies.end());
+
+        const double ms_per_query = total_ms / timed;
+        const double gbs = engine.bytes_per_query / (ms_per_query * 1e6);
+        json << (first ? "\n" : ",\n") << "    {\"engine\": " << json_string(engine.name)
+             << ", \"kernel\": " << json_string(engine.kernel)
+             << ", \"build_ms\": " << json_number(engine.build_ms)
+             << ", \"timed_queries\": " << timed
+             << ", \"qps\": " << json_number(timed * 1000.0 / total_ms);
+        if (latencies.empty()) {
+            json << ", \"p50_ms\": null, \"p95_ms\": null, \"p99_ms\": null";
+        }
+        else {
+            json << ", \"p50_ms\": " << json_number(percentile(latencies, 50))
+                 << ", \"p95_ms\": " << json_number(percentile(latencies, 95))
+                 << ", \"p99_ms\": " << json_number(percentile(latencies, 99));
+        }
+        if (engine.bytes_per_query > 0.0) {
+            json << ", \"bytes_per_query\": " << json_number(engine.bytes_per_query)
+                 << ", \"gbs\": " << json_number(gbs)
+                 << ", \"peak_fraction\": " << json_number(gbs / peak_gbs);
+        }
+        else {
+            json << ", \"bytes_per_query\": null, \"gbs\": null, \"peak_fraction\": null";
+        }
+        json << ", \"recall\": " << json_number(recall_at_k(results, truth, K)) << "}";
+        first = false;
+    }
+    set_kernel(default_kernel);
+
+    const double allocations = scan_allocations_per_query(queries, database, K, params);
+    json << "\n  ],\n  \"allocations_per_query\": " << json_number(allocations) << "\n}\n";
+    cout << json.str();
+    if (allocations > 0.0) {
+        cerr << "Error: the allocation-free scan path made " << allocations
+             << " heap allocation(s) per query after warm-up" << endl;
+        return 1;
+    }
+    return 0;
+}
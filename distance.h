@@ -0,0 +1,654 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <string>
+
+#include "profile.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SEARCH_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define SEARCH_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Squared L2 distance kernels: sum of (a[i] - b[i])^2 over dim elements.
+// The scalar kernel is the reference; the SIMD kernels are compiled with
+// per-function target attributes so one binary runs on any CPU of the
+// architecture, and the best supported kernel is chosen at startup. The
+// inner-product kernels further down share the signature.
+typedef float (*DistanceFn)(const float* a, const float* b, size_t dim);
+
+// Early-abandon variants: identical result when the distance is below
+// bound, otherwise they may stop at the first block of dimensions whose
+// partial sum already reaches bound and return that partial sum (which is
+// still >= bound, so the caller rejects it either way).
+typedef float (*BoundedDistanceFn)(const float* a, const float* b, size_t dim, float bound);
+
+// Dimensions summed between early-abandon checks.
+const size_t kAbandonBlock = 32;
+
+// Dimension-specialized kernels: l2_sqr_<isa>_dim<D> is the plain kernel
+// with the dimension fixed at compile time, so the loop is fully unrolled
+// into four register accumulators with no tail. Each one still takes dim
+// and hands any other dimension to the generic kernel (PQ sub-vectors,
+// k-means on slices), so a specialized kernel is always safe to call.
+// The unroll pragma is spelled out because -O2 does not fully unroll the
+// long (768+) loops by itself.
+#define SEARCH_UNROLL _Pragma("GCC unroll 128")
+
+// One specialization of a kernel for a fixed dimension, with its own
+// early-abandon form when it has one (null: the generic bounded kernel).
+struct FixedDimKernel {
+    size_t dim;
+    DistanceFn fn;
+    BoundedDistanceFn bounded;
+};
+
+inline float l2_sqr_scalar(const float* a, const float* b, size_t dim) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < dim; i++) {
+        float diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+inline float l2_sqr_bounded_scalar(const float* a, const float* b, size_t dim, float bound) {
+    float sum = 0.0f;
+    size_t i = 0;
+    for (; i + kAbandonBlock <= dim; i += kAbandonBlock) {
+        for (size_t j = i; j < i + kAbandonBlock; j++) {
+            float diff = a[j] - b[j];
+            sum += diff * diff;
+        }
+        if (sum >= bound) {
+            SEARCH_PROFILE_COUNT(kCountEarlyAbandons, 1);
+            return sum;
+        }
+    }
+    return sum + l2_sqr_scalar(a + i, b + i, dim - i);
+}
+
+#ifdef SEARCH_X86
+__attribute__((target("avx2,fma")))
+inline float hsum_avx(__m256 v) {
+    __m128 lo = _mm256_castps256_ps128(v);
+    __m128 hi = _mm256_extractf128_ps(v, 1);
+    lo = _mm_add_ps(lo, hi);
+    lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+    lo = _mm_add_ss(lo, _mm_movehdup_ps(lo));
+    return _mm_cvtss_f32(lo);
+}
+
+// Two independent accumulators hide the FMA latency.
+__attribute__((target("avx2,fma")))
+inline float l2_sqr_avx2(const float* a, const float* b, size_t dim) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    if (i + 8 <= dim) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        i += 8;
+    }
+    float sum = hsum_avx(_mm256_add_ps(acc0, acc1));
+    for (; i < dim; i++) {
+        float diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+inline float l2_sqr_bounded_avx2(const float* a, const float* b, size_t dim, float bound) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + kAbandonBlock <= dim; i += kAbandonBlock) {
+        for (size_t j = i; j < i + kAbandonBlock; j += 16) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + j), _mm256_loadu_ps(b + j));
+            __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + j + 8), _mm256_loadu_ps(b + j + 8));
+            acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+            acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+        }
+        // The last full block needs no check; the tail below finishes the sum.
+        if (i + kAbandonBlock < dim) {
+            float partial = hsum_avx(_mm256_add_ps(acc0, acc1));
+            if (partial >= bound) {
+                SEARCH_PROFILE_COUNT(kCountEarlyAbandons, 1);
+                return partial;
+            }
+        }
+    }
+    return hsum_avx(_mm256_add_ps(acc0, acc1)) + l2_sqr_avx2(a + i, b + i, dim - i);
+}
+
+template <size_t D>
+__attribute__((target("avx2,fma")))
+inline float l2_sqr_avx2_dim(const float* a, const float* b, size_t dim) {
+    static_assert(D % 8 == 0, "AVX2 specializations take whole 8-float registers");
+    if (dim != D) return l2_sqr_avx2(a, b, dim);
+    __m256 acc[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+    SEARCH_UNROLL
+    for (size_t i = 0; i < D; i += 8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc[(i / 8) % 4] = _mm256_fmadd_ps(d, d, acc[(i / 8) % 4]);
+    }
+    return hsum_avx(_mm256_add_ps(_mm256_add_ps(acc[0], acc[1]), _mm256_add_ps(acc[2], acc[3])));
+}
+
+// Early-abandon form of l2_sqr_avx2_dim: one register per accumulator in
+// each kAbandonBlock, with the bound checked between blocks.
+template <size_t D>
+__attribute__((target("avx2,fma")))
+inline float l2_sqr_bounded_avx2_dim(const float* a, const float* b, size_t dim, float bound) {
+    static_assert(D % kAbandonBlock == 0, "bounded specializations take whole abandon blocks");
+    if (dim != D) return l2_sqr_bounded_avx2(a, b, dim, bound);
+    __m256 acc[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+    for (size_t i = 0; i < D; i += kAbandonBlock) {
+        SEARCH_UNROLL
+        for (size_t j = 0; j < kAbandonBlock; j += 8) {
+            __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i + j), _mm256_loadu_ps(b + i + j));
+            acc[j / 8] = _mm256_fmadd_ps(d, d, acc[j / 8]);
+        }
+        if (i + kAbandonBlock < D) {
+            float partial = hsum_avx(_mm256_add_ps(_mm256_add_ps(acc[0], acc[1]), _mm256_add_ps(acc[2], acc[3])));
+            if (partial >= bound) {
+                SEARCH_PROFILE_COUNT(kCountEarlyAbandons, 1);
+                return partial;
+            }
+        }
+    }
+    return hsum_avx(_mm256_add_ps(_mm256_add_ps(acc[0], acc[1]), _mm256_add_ps(acc[2], acc[3])));
+}
+
+// GCC 12 reports its own _mm256_undefined_* placeholders as uninitialized
+// when AVX-512 reductions are inlined into a target-attribute function.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+// The tail is handled with a masked load, so there is no scalar loop.
+__attribute__((target("avx512f")))
+inline float l2_sqr_avx512(const float* a, const float* b, size_t dim) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 16 <= dim; i += 16) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+    }
+    if (i < dim) {
+        __mmask16 mask = static_cast<__mmask16>((1u << (dim - i)) - 1);
+        __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i),
+                                  _mm512_maskz_loadu_ps(mask, b + i));
+        acc1 = _mm512_fmadd_ps(d0, d0, acc1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f")))
+inline float l2_sqr_bounded_avx512(const float* a, const float* b, size_t dim, float bound) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+        if (i + 32 < dim) {
+            float partial = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+            if (partial >= bound) {
+                SEARCH_PROFILE_COUNT(kCountEarlyAbandons, 1);
+                return partial;
+            }
+        }
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1)) + l2_sqr_avx512(a + i, b + i, dim - i);
+}
+
+template <size_t D>
+__attribute__((target("avx512f")))
+inline float l2_sqr_avx512_dim(const float* a, const float* b, size_t dim) {
+    static_assert(D % 16 == 0, "AVX-512 specializations take whole 16-float registers");
+    if (dim != D) return l2_sqr_avx512(a, b, dim);
+    __m512 acc[4] = {_mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps()};
+    SEARCH_UNROLL
+    for (size_t i = 0; i < D; i += 16) {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc[(i / 16) % 4] = _mm512_fmadd_ps(d, d, acc[(i / 16) % 4]);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(acc[0], acc[1]), _mm512_add_ps(acc[2], acc[3])));
+}
+
+template <size_t D>
+__attribute__((target("avx512f")))
+inline float l2_sqr_bounded_avx512_dim(const float* a, const float* b, size_t dim, float bound) {
+    static_assert(D % kAbandonBlock == 0, "bounded specializations take whole abandon blocks");
+    if (dim != D) return l2_sqr_bounded_avx512(a, b, dim, bound);
+    __m512 acc[2] = {_mm512_setzero_ps(), _mm512_setzero_ps()};
+    for (size_t i = 0; i < D; i += kAbandonBlock) {
+        SEARCH_UNROLL
+        for (size_t j = 0; j < kAbandonBlock; j += 16) {
+            __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i + j), _mm512_loadu_ps(b + i + j));
+            acc[j / 16] = _mm512_fmadd_ps(d, d, acc[j / 16]);
+        }
+        if (i + kAbandonBlock < D) {
+            float partial = _mm512_reduce_add_ps(_mm512_add_ps(acc[0], acc[1]));
+            if (partial >= bound) {
+                SEARCH_PROFILE_COUNT(kCountEarlyAbandons, 1);
+                return partial;
+            }
+        }
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc[0], acc[1]));
+}
+#pragma GCC diagnostic pop
+#endif
+
+#ifdef SEARCH_NEON
+// NEON is part of the AArch64 baseline, so no runtime check is needed.
+inline float l2_sqr_neon(const float* a, const float* b, size_t dim) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        float32x4_t d0 = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+        float32x4_t d1 = vsubq_f32(vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        acc0 = vfmaq_f32(acc0, d0, d0);
+        acc1 = vfmaq_f32(acc1, d1, d1);
+    }
+    float sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; i < dim; i++) {
+        float diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+inline float l2_sqr_bounded_neon(const float* a, const float* b, size_t dim, float bound) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    size_t i = 0;
+    for (; i + kAbandonBlock <= dim; i += kAbandonBlock) {
+        for (size_t j = i; j < i + kAbandonBlock; j += 8) {
+            float32x4_t d0 = vsubq_f32(vld1q_f32(a + j), vld1q_f32(b + j));
+            float32x4_t d1 = vsubq_f32(vld1q_f32(a + j + 4), vld1q_f32(b + j + 4));
+            acc0 = vfmaq_f32(acc0, d0, d0);
+            acc1 = vfmaq_f32(acc1, d1, d1);
+        }
+        if (i + kAbandonBlock < dim) {
+            float partial = vaddvq_f32(vaddq_f32(acc0, acc1));
+            if (partial >= bound) {
+                SEARCH_PROFILE_COUNT(kCountEarlyAbandons, 1);
+                return partial;
+            }
+        }
+    }
+    return vaddvq_f32(vaddq_f32(acc0, acc1)) + l2_sqr_neon(a + i, b + i, dim - i);
+}
+
+template <size_t D>
+inline float l2_sqr_neon_dim(const float* a, const float* b, size_t dim) {
+    static_assert(D % 4 == 0, "NEON specializations take whole 4-float registers");
+    if (dim != D) return l2_sqr_neon(a, b, dim);
+    float32x4_t acc[4] = {vdupq_n_f32(0.0f), vdupq_n_f32(0.0f), vdupq_n_f32(0.0f), vdupq_n_f32(0.0f)};
+    SEARCH_UNROLL
+    for (size_t i = 0; i < D; i += 4) {
+        float32x4_t d = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+        acc[(i / 4) % 4] = vfmaq_f32(acc[(i / 4) % 4], d, d);
+    }
+    return vaddvq_f32(vaddq_f32(vaddq_f32(acc[0], acc[1]), vaddq_f32(acc[2], acc[3])));
+}
+
+template <size_t D>
+inline float l2_sqr_bounded_neon_dim(const float* a, const float* b, size_t dim, float bound) {
+    static_assert(D % kAbandonBlock == 0, "bounded specializations take whole abandon blocks");
+    if (dim != D) return l2_sqr_bounded_neon(a, b, dim, bound);
+    float32x4_t acc[4] = {vdupq_n_f32(0.0f), vdupq_n_f32(0.0f), vdupq_n_f32(0.0f), vdupq_n_f32(0.0f)};
+    for (size_t i = 0; i < D; i += kAbandonBlock) {
+        SEARCH_UNROLL
+        for (size_t j = 0; j < kAbandonBlock; j += 4) {
+            float32x4_t d = vsubq_f32(vld1q_f32(a + i + j), vld1q_f32(b + i + j));
+            acc[(j / 4) % 4] = vfmaq_f32(acc[(j / 4) % 4], d, d);
+        }
+        if (i + kAbandonBlock < D) {
+            float partial = vaddvq_f32(vaddq_f32(vaddq_f32(acc[0], acc[1]), vaddq_f32(acc[2], acc[3])));
+            if (partial >= bound) {
+                SEARCH_PROFILE_COUNT(kCountEarlyAbandons, 1);
+                return partial;
+            }
+        }
+    }
+    return vaddvq_f32(vaddq_f32(vaddq_f32(acc[0], acc[1]), vaddq_f32(acc[2], acc[3])));
+}
+#endif
+
+// Inner-product metrics. The kernels return the negated dot product, so a
+// larger similarity is a smaller "distance" and every scan, TopK and index
+// keeps minimizing exactly as it does for L2; finalize_distances() flips
+// the sign of the final k back. Cosine is the inner product of vectors
+// normalized once at load time (normalize_rows), so its hot loop is the
+// same pure dot product.
+enum Metric { kMetricL2, kMetricInnerProduct, kMetricCosine };
+
+inline const char* metric_name(Metric metric) {
+    return metric == kMetricCosine ? "cosine" : metric == kMetricInnerProduct ? "ip" : "l2";
+}
+
+// "l2", "ip" or "cosine". False for anything else.
+inline bool parse_metric(const std::string& name, Metric& metric) {
+    if (name == "l2") metric = kMetricL2;
+    else if (name == "ip") metric = kMetricInnerProduct;
+    else if (name == "cosine") metric = kMetricCosine;
+    else return false;
+    return true;
+}
+
+inline float neg_dot_scalar(const float* a, const float* b, size_t dim) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < dim; i++) sum += a[i] * b[i];
+    return -sum;
+}
+
+#ifdef SEARCH_X86
+__attribute__((target("avx2,fma")))
+inline float neg_dot_avx2(const float* a, const float* b, size_t dim) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    if (i + 8 <= dim) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        i += 8;
+    }
+    float sum = hsum_avx(_mm256_add_ps(acc0, acc1));
+    for (; i < dim; i++) sum += a[i] * b[i];
+    return -sum;
+}
+
+// Fixed-dimension forms of the dot-product kernels, unrolled the same way
+// as l2_sqr_<isa>_dim<D>.
+template <size_t D>
+__attribute__((target("avx2,fma")))
+inline float neg_dot_avx2_dim(const float* a, const float* b, size_t dim) {
+    static_assert(D % 8 == 0, "AVX2 specializations take whole 8-float registers");
+    if (dim != D) return neg_dot_avx2(a, b, dim);
+    __m256 acc[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+    SEARCH_UNROLL
+    for (size_t i = 0; i < D; i += 8) {
+        acc[(i / 8) % 4] = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc[(i / 8) % 4]);
+    }
+    return -hsum_avx(_mm256_add_ps(_mm256_add_ps(acc[0], acc[1]), _mm256_add_ps(acc[2], acc[3])));
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+inline float neg_dot_avx512(const float* a, const float* b, size_t dim) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i + 16 <= dim; i += 16) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    }
+    if (i < dim) {
+        __mmask16 mask = static_cast<__mmask16>((1u << (dim - i)) - 1);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), acc1);
+    }
+    return -_mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+template <size_t D>
+__attribute__((target("avx512f")))
+inline float neg_dot_avx512_dim(const float* a, const float* b, size_t dim) {
+    static_assert(D % 16 == 0, "AVX-512 specializations take whole 16-float registers");
+    if (dim != D) return neg_dot_avx512(a, b, dim);
+    __m512 acc[4] = {_mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps()};
+    SEARCH_UNROLL
+    for (size_t i = 0; i < D; i += 16) {
+        acc[(i / 16) % 4] = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc[(i / 16) % 4]);
+    }
+    return -_mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(acc[0], acc[1]), _mm512_add_ps(acc[2], acc[3])));
+}
+#pragma GCC diagnostic pop
+#endif
+
+#ifdef SEARCH_NEON
+inline float neg_dot_neon(const float* a, const float* b, size_t dim) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    float sum = vaddvq_f32(vaddq_f32(acc0, acc1));
+    for (; i < dim; i++) sum += a[i] * b[i];
+    return -sum;
+}
+
+template <size_t D>
+inline float neg_dot_neon_dim(const float* a, const float* b, size_t dim) {
+    static_assert(D % 4 == 0, "NEON specializations take whole 4-float registers");
+    if (dim != D) return neg_dot_neon(a, b, dim);
+    float32x4_t acc[4] = {vdupq_n_f32(0.0f), vdupq_n_f32(0.0f), vdupq_n_f32(0.0f), vdupq_n_f32(0.0f)};
+    SEARCH_UNROLL
+    for (size_t i = 0; i < D; i += 4) {
+        acc[(i / 4) % 4] = vfmaq_f32(acc[(i / 4) % 4], vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    return -vaddvq_f32(vaddq_f32(vaddq_f32(acc[0], acc[1]), vaddq_f32(acc[2], acc[3])));
+}
+#endif
+
+// A dot product can still grow after any prefix, so there is nothing to
+// abandon early: the bounded entry point of an inner-product kernel is the
+// full kernel.
+template <DistanceFn F>
+inline float ignore_bound(const float* a, const float* b, size_t dim, float) {
+    return F(a, b, dim);
+}
+
+// The kernels of one instruction set for the active metric: distance is
+// the ranking value every scan minimizes (squared L2, or the negated dot
+// product for the inner-product metrics), bounded its early-abandon form.
+struct DistanceKernel {
+    const char* name;
+    DistanceFn distance;
+    BoundedDistanceFn bounded;
+    size_t fixed_dim;   // dimension distance is specialized for, 0 if generic
+    DistanceFn l2;      // squared L2 on the same instruction set, whatever the metric
+};
+
+// Dimension the kernels are specialized for (0: none). Set once the data
+// is loaded, through specialize_kernels().
+inline size_t& kernel_dim() {
+    static size_t dim = 0;
+    return dim;
+}
+
+// Metric the kernels compute. Set once before searching, through
+// set_metric().
+inline Metric& active_metric() {
+    static Metric metric = kMetricL2;
+    return metric;
+}
+
+// Dispatch tables of the specialized dimensions, per instruction set and
+// metric. A dot product has nothing to abandon, so its bounded form is
+// the specialized kernel itself.
+#define SEARCH_L2_DIM(isa, D) {D, l2_sqr_##isa##_dim<D>, l2_sqr_bounded_##isa##_dim<D>}
+#define SEARCH_NEG_DOT_DIM(isa, D) {D, neg_dot_##isa##_dim<D>, ignore_bound<neg_dot_##isa##_dim<D> >}
+#ifdef SEARCH_X86
+static const FixedDimKernel kAvx512FixedDims[] = {
+    SEARCH_L2_DIM(avx512, 96), SEARCH_L2_DIM(avx512, 128), SEARCH_L2_DIM(avx512, 256),
+    SEARCH_L2_DIM(avx512, 768), SEARCH_L2_DIM(avx512, 960), SEARCH_L2_DIM(avx512, 1536),
+};
+static const FixedDimKernel kAvx2FixedDims[] = {
+    SEARCH_L2_DIM(avx2, 96), SEARCH_L2_DIM(avx2, 128), SEARCH_L2_DIM(avx2, 256),
+    SEARCH_L2_DIM(avx2, 768), SEARCH_L2_DIM(avx2, 960), SEARCH_L2_DIM(avx2, 1536),
+};
+static const FixedDimKernel kAvx512NegDotFixedDims[] = {
+    SEARCH_NEG_DOT_DIM(avx512, 96), SEARCH_NEG_DOT_DIM(avx512, 128), SEARCH_NEG_DOT_DIM(avx512, 256),
+    SEARCH_NEG_DOT_DIM(avx512, 768), SEARCH_NEG_DOT_DIM(avx512, 960), SEARCH_NEG_DOT_DIM(avx512, 1536),
+};
+static const FixedDimKernel kAvx2NegDotFixedDims[] = {
+    SEARCH_NEG_DOT_DIM(avx2, 96), SEARCH_NEG_DOT_DIM(avx2, 128), SEARCH_NEG_DOT_DIM(avx2, 256),
+    SEARCH_NEG_DOT_DIM(avx2, 768), SEARCH_NEG_DOT_DIM(avx2, 960), SEARCH_NEG_DOT_DIM(avx2, 1536),
+};
+#endif
+#ifdef SEARCH_NEON
+static const FixedDimKernel kNeonFixedDims[] = {
+    SEARCH_L2_DIM(neon, 96), SEARCH_L2_DIM(neon, 128), SEARCH_L2_DIM(neon, 256),
+    SEARCH_L2_DIM(neon, 768), SEARCH_L2_DIM(neon, 960), SEARCH_L2_DIM(neon, 1536),
+};
+static const FixedDimKernel kNeonNegDotFixedDims[] = {
+    SEARCH_NEG_DOT_DIM(neon, 96), SEARCH_NEG_DOT_DIM(neon, 128), SEARCH_NEG_DOT_DIM(neon, 256),
+    SEARCH_NEG_DOT_DIM(neon, 768), SEARCH_NEG_DOT_DIM(neon, 960), SEARCH_NEG_DOT_DIM(neon, 1536),
+};
+#endif
+#undef SEARCH_L2_DIM
+#undef SEARCH_NEG_DOT_DIM
+
+// table's entry for dim, or null when that dimension has no specialization.
+template <size_t N>
+inline const FixedDimKernel* find_fixed_dim(const FixedDimKernel (&table)[N], size_t dim) {
+    for (size_t i = 0; i < N; i++) {
+        if (table[i].dim == dim) return &table[i];
+    }
+    return nullptr;
+}
+
+// The instruction set's kernels for kernel_dim(): the metric's distance
+// (generic / bounded, or their entry in table) and the squared L2 (l2, or
+// its entry in l2_table), each generic when that dimension has no
+// specialization.
+template <size_t N, size_t M>
+inline DistanceKernel make_kernel(const char* name, DistanceFn generic, BoundedDistanceFn bounded,
+                                  const FixedDimKernel (&table)[N], DistanceFn l2,
+                                  const FixedDimKernel (&l2_table)[M]) {
+    const size_t dim = kernel_dim();
+    const FixedDimKernel* fixed = find_fixed_dim(table, dim);
+    const FixedDimKernel* fixed_l2 = find_fixed_dim(l2_table, dim);
+    if (!fixed) return {name, generic, bounded, 0, fixed_l2 ? fixed_l2->fn : l2};
+    return {name, fixed->fn, fixed->bounded ? fixed->bounded : bounded, dim, fixed_l2 ? fixed_l2->fn : l2};
+}
+
+// Kernels usable on this CPU, best first. The scalar kernel is always last.
+// With an inner-product metric these are the negated-dot kernels of the
+// same instruction sets.
+inline size_t available_kernels(DistanceKernel* out) {
+    size_t n = 0;
+    if (active_metric() != kMetricL2) {
+#ifdef SEARCH_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            out[n++] = make_kernel("avx512", neg_dot_avx512, ignore_bound<neg_dot_avx512>, kAvx512NegDotFixedDims,
+                                   l2_sqr_avx512, kAvx512FixedDims);
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            out[n++] = make_kernel("avx2", neg_dot_avx2, ignore_bound<neg_dot_avx2>, kAvx2NegDotFixedDims,
+                                   l2_sqr_avx2, kAvx2FixedDims);
+        }
+#endif
+#ifdef SEARCH_NEON
+        out[n++] = make_kernel("neon", neg_dot_neon, ignore_bound<neg_dot_neon>, kNeonNegDotFixedDims,
+                               l2_sqr_neon, kNeonFixedDims);
+#endif
+        out[n++] = {"scalar", neg_dot_scalar, ignore_bound<neg_dot_scalar>, 0, l2_sqr_scalar};
+        return n;
+    }
+#ifdef SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        out[n++] = make_kernel("avx512", l2_sqr_avx512, l2_sqr_bounded_avx512, kAvx512FixedDims,
+                               l2_sqr_avx512, kAvx512FixedDims);
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        out[n++] = make_kernel("avx2", l2_sqr_avx2, l2_sqr_bounded_avx2, kAvx2FixedDims,
+                               l2_sqr_avx2, kAvx2FixedDims);
+    }
+#endif
+#ifdef SEARCH_NEON
+    out[n++] = make_kernel("neon", l2_sqr_neon, l2_sqr_bounded_neon, kNeonFixedDims, l2_sqr_neon, kNeonFixedDims);
+#endif
+    out[n++] = {"scalar", l2_sqr_scalar, l2_sqr_bounded_scalar, 0, l2_sqr_scalar};
+    return n;
+}
+
+// Process-wide active kernel, chosen from cpuid on first use.
+inline DistanceKernel& active_kernel() {
+    static DistanceKernel kernel = [] {
+        DistanceKernel kernels[4];
+        available_kernels(kernels);
+        return kernels[0];
+    }();
+    return kernel;
+}
+
+// Force a specific kernel by name (e.g. "scalar" to compare against the
+// reference). Returns false if it is not available on this CPU.
+inline bool set_kernel(const std::string& name) {
+    DistanceKernel kernels[4];
+    size_t n = available_kernels(kernels);
+    for (size_t i = 0; i < n; i++) {
+        if (name == kernels[i].name) {
+            active_kernel() = kernels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+// Switch the kernels to their specialization for dim, keeping the active
+// instruction set, and return whether one exists. dim = 0 goes back to
+// the generic kernels. Call once after loading, before searching.
+inline bool specialize_kernels(size_t dim) {
+    kernel_dim() = dim;
+    set_kernel(active_kernel().name);
+    return active_kernel().fixed_dim != 0;
+}
+
+// Switch every search to metric, keeping the active instruction set.
+// Call once before loading indexes or searching.
+inline void set_metric(Metric metric) {
+    active_metric() = metric;
+    set_kernel(active_kernel().name);
+}
+
+// Squared L2 distance on the active instruction set, whatever the metric.
+inline float l2_sqr(const float* a, const float* b, size_t dim) {
+    return active_kernel().l2(a, b, dim);
+}
+
+// Compute L2 (Euclidean) distance between two vectors
+// Formula: sqrt(sum of (a[i] - b[i])^2)
+// Both vectors must have dim elements (e.g. two rows of the same VectorStore)
+inline float l2_distance(const float* a, const float* b, size_t dim) {
+    return std::sqrt(l2_sqr(a, b, dim));
+}
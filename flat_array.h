@@ -0,0 +1,82 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Flat array of trivially copyable elements that either owns its storage
+// (built in memory) or views memory it does not allocate, e.g. a section
+// of a mapped snapshot. Like a VectorStore view, a viewing array keeps its
+// backing alive through owner_ and is never resized; assign() and resize()
+// turn it back into an owning array.
+template <class T>
+class FlatArray {
+public:
+    FlatArray() : data_(nullptr), size_(0) {}
+    explicit FlatArray(size_t n, const T& value = T()) : owned_(n, value), data_(owned_.data()), size_(n) {}
+
+    FlatArray(const FlatArray&) = delete;
+    FlatArray& operator=(const FlatArray&) = delete;
+
+    FlatArray(FlatArray&& other) noexcept { take(other); }
+    FlatArray& operator=(FlatArray&& other) noexcept {
+        if (this != &other) take(other);
+        return *this;
+    }
+
+    static FlatArray view(T* data, size_t n, std::shared_ptr<void> owner) {
+        FlatArray array;
+        array.data_ = data;
+        array.size_ = n;
+        array.owner_ = std::move(owner);
+        return array;
+    }
+
+    bool is_view() const { return data_ != nullptr && owned_.empty(); }
+
+    void assign(size_t n, const T& value) {
+        owner_.reset();
+        owned_.assign(n, value);
+        data_ = owned_.data();
+        size_ = n;
+    }
+
+    void resize(size_t n) {
+        if (is_view()) {
+            std::vector<T> copy(data_, data_ + std::min(n, size_));
+            owned_.swap(copy);
+            owner_.reset();
+        }
+        owned_.resize(n);
+        data_ = owned_.data();
+        size_ = n;
+    }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    T* data() { return data_; }
+    const T* data() const { return data_; }
+    T& operator[](size_t i) { return data_[i]; }
+    const T& operator[](size_t i) const { return data_[i]; }
+    T* begin() { return data_; }
+    T* end() { return data_ + size_; }
+    const T* begin() const { return data_; }
+    const T* end() const { return data_ + size_; }
+
+private:
+    void take(FlatArray& other) {
+        owned_.swap(other.owned_);
+        owner_ = std::move(other.owner_);
+        data_ = other.data_;
+        size_ = other.size_;
+        std::vector<T>().swap(other.owned_);
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+
+    std::vector<T> owned_;
+    std::shared_ptr<void> owner_;
+    T* data_;
+    size_t size_;
+};
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "distance.h"
+#include "flat_array.h"
+#include "search.h"
+#include "snapshot.h"
+#include "vector_store.h"
+
+#ifdef SEARCH_USE_BLAS
+#include <cblas.h>
+#endif
+
+// Inner-product tile: out[i * ld + j] = dot(q_i, x_j) for nq query rows and
+// nx database rows. Each micro-kernel computes an MR x NR block with all
+// accumulators in registers, so every load of a query or database chunk
+// feeds NR or MR multiply-adds instead of one.
+typedef void (*IpTileFn)(const float* q, size_t q_stride, size_t nq,
+                         const float* x, size_t x_stride, size_t nx,
+                         size_t dim, float* out, size_t ld);
+
+template <int MR, int NR>
+inline void ip_block_scalar(const float* q, size_t q_stride, const float* x, size_t x_stride,
+                            size_t dim, float* out, size_t ld) {
+    float acc[MR][NR] = {};
+    for (size_t d = 0; d < dim; d++) {
+        for (int r = 0; r < MR; r++) {
+            float qv = q[r * q_stride + d];
+            for (int c = 0; c < NR; c++) {
+                acc[r][c] += qv * x[c * x_stride + d];
+            }
+        }
+    }
+    for (int r = 0; r < MR; r++) {
+        for (int c = 0; c < NR; c++) out[r * ld + c] = acc[r][c];
+    }
+}
+
+// 3 x 4 blocking uses 12 accumulators + 3 query registers + 1 streaming
+// database register, exactly the 16 ymm registers of AVX2.
+template <int MR, int NR>
+__attribute__((target("avx2,fma")))
+inline void ip_block_avx2(const float* q, size_t q_stride, const float* x, size_t x_stride,
+                          size_t dim, float* out, size_t ld) {
+    __m256 acc[MR][NR];
+    for (int r = 0; r < MR; r++) {
+        for (int c = 0; c < NR; c++) acc[r][c] = _mm256_setzero_ps();
+    }
+    size_t d = 0;
+    for (; d + 8 <= dim; d += 8) {
+        __m256 qv[MR];
+        for (int r = 0; r < MR; r++) qv[r] = _mm256_loadu_ps(q + r * q_stride + d);
+        for (int c = 0; c < NR; c++) {
+            __m256 xv = _mm256_loadu_ps(x + c * x_stride + d);
+            for (int r = 0; r < MR; r++) acc[r][c] = _mm256_fmadd_ps(qv[r], xv, acc[r][c]);
+        }
+    }
+    for (int r = 0; r < MR; r++) {
+        for (int c = 0; c < NR; c++) {
+            float sum = hsum_avx(acc[r][c]);
+            for (size_t t = d; t < dim; t++) sum += q[r * q_stride + t] * x[c * x_stride + t];
+            out[r * ld + c] = sum;
+        }
+    }
+}
+
+#define SEARCH_DEFINE_IP_TILE(NAME, BLOCK)                                           \
+    inline void NAME(const float* q, size_t q_stride, size_t nq,                     \
+                     const float* x, size_t x_stride, size_t nx,                     \
+                     size_t dim, float* out, size_t ld) {                            \
+        size_t i = 0;                                                                \
+        for (; i + 3 <= nq; i += 3) {                                                \
+            size_t j = 0;                                                            \
+            for (; j + 4 <= nx; j += 4) {                                            \
+                BLOCK<3, 4>(q + i * q_stride, q_stride, x + j * x_stride, x_stride,  \
+                            dim, out + i * ld + j, ld);                              \
+            }                                                                        \
+            for (; j < nx; j++) {                                                    \
+                BLOCK<3, 1>(q + i * q_stride, q_stride, x + j * x_stride, x_stride,  \
+                            dim, out + i * ld + j, ld);                              \
+            }                                                                        \
+        }                                                                            \
+        for (; i < nq; i++) {                                                        \
+            size_t j = 0;                                                            \
+            for (; j + 4 <= nx; j += 4) {                                            \
+                BLOCK<1, 4>(q + i * q_stride, q_stride, x + j * x_stride, x_stride,  \
+                            dim, out + i * ld + j, ld);                              \
+            }                                                                        \
+            for (; j < nx; j++) {                                                    \
+                BLOCK<1, 1>(q + i * q_stride, q_stride, x + j * x_stride, x_stride,  \
+                            dim, out + i * ld + j, ld);                              \
+            }                                                                        \
+        }                                                                            \
+    }
+
+SEARCH_DEFINE_IP_TILE(ip_tile_scalar, ip_block_scalar)
+#ifdef SEARCH_X86
+SEARCH_DEFINE_IP_TILE(ip_tile_avx2, ip_block_avx2)
+#endif
+#undef SEARCH_DEFINE_IP_TILE
+
+#ifdef SEARCH_USE_BLAS
+inline void ip_tile_blas(const float* q, size_t q_stride, size_t nq,
+                         const float* x, size_t x_stride, size_t nx,
+                         size_t dim, float* out, size_t ld) {
+    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                static_cast<int>(nq), static_cast<int>(nx), static_cast<int>(dim),
+                1.0f, q, static_cast<int>(q_stride), x, static_cast<int>(x_stride),
+                0.0f, out, static_cast<int>(ld));
+}
+#endif
+
+inline IpTileFn select_ip_tile(const char** name) {
+#ifdef SEARCH_USE_BLAS
+    *name = "blas";
+    return ip_tile_blas;
+#else
+#ifdef SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        *name = "avx2 micro-kernel";
+        return ip_tile_avx2;
+    }
+#endif
+    *name = "scalar micro-kernel";
+    return ip_tile_scalar;
+#endif
+}
+
+// Exact batched k-NN through the expansion
+//     ||x - q||^2 = ||x||^2 - 2 x.q + ||q||^2
+// Database norms are computed once at construction. Queries and database are
+// processed in tiles; the inner products of each tile come from one GEMM
+// call (BLAS when built with SEARCH_USE_BLAS, otherwise the register-blocked
+// micro-kernels above) and are turned into distances and pushed into the
+// per-query TopK while the tile is still in cache.
+//
+// The expansion cancels large terms in float, so distances carry an absolute
+// error around ||x||^2 * 1e-7; near-ties may rank differently than the
+// per-pair scan in brute_force_search.
+//
+// With an inner-product metric (active when the engine is built) the same
+// tile loop ranks by -x.q: the norm terms are scaled by zero and the clamp
+// at zero is lifted, so the metric costs no branch per candidate.
+class GemmSearchEngine {
+public:
+    // Rows per database tile and queries per query tile.
+    static const size_t kDbTile = 256;
+    static const size_t kQueryTile = 64;
+
+    explicit GemmSearchEngine(const VectorStore& database)
+        : database_(database), norms_(database.size()) {
+        ip_tile_ = select_ip_tile(&backend_);
+        set_metric_terms();
+        norms_of(database, norms_.data());
+    }
+
+    // Reuse norms computed earlier (e.g. mapped from a snapshot); one per
+    // database row.
+    GemmSearchEngine(const VectorStore& database, FlatArray<float> norms)
+        : database_(database), norms_(std::move(norms)) {
+        ip_tile_ = select_ip_tile(&backend_);
+        set_metric_terms();
+    }
+
+    const char* backend() const { return backend_; }
+    const FlatArray<float>& norms() const { return norms_; }
+
+    void save(SnapshotWriter& writer) const {
+        writer.add_array("norms", norms_.data(), norms_.size());
+    }
+
+    std::vector<std::vector<SearchResult>> search(const VectorStore& queries, int k,
+                                                  const SearchParams& params = SearchParams()) const {
+        const size_t nq = queries.size();
+        std::vector<TopK> topk(nq, TopK(static_cast<size_t>(k)));
+        std::vector<float> query_norms(nq);
+        norms_of(queries, query_norms.data());
+
+        size_t num_tiles = (nq + kQueryTile - 1) / kQueryTile;
+        parallel_ranges(num_tiles, 1, params, [&](size_t, size_t begin, size_t end) {
+            search_tiles(queries, query_norms, begin, end, topk);
+        });
+
+        std::vector<std::vector<SearchResult>> results(nq);
+        for (size_t q = 0; q < nq; q++) {
+            results[q] = topk[q].take_sorted();
+            finalize_distances(results[q], params);
+        }
+        return results;
+    }
+
+private:
+    // dist = norm_scale * (||x||^2 + ||q||^2) - ip_scale * x.q, kept >= floor.
+    void set_metric_terms() {
+        const bool l2 = active_metric() == kMetricL2;
+        norm_scale_ = l2 ? 1.0f : 0.0f;
+        ip_scale_ = l2 ? 2.0f : 1.0f;
+        floor_ = l2 ? 0.0f : -std::numeric_limits<float>::infinity();
+    }
+
+    static void norms_of(const VectorStore& store, float* out) {
+        for (size_t i = 0; i < store.size(); i++) {
+            const float* v = store.row(i);
+            float sum = 0.0f;
+            for (size_t d = 0; d < store.dim(); d++) sum += v[d] * v[d];
+            out[i] = sum;
+        }
+    }
+
+    // Process query tiles [tile_begin, tile_end) against the whole database.
+    void search_tiles(const VectorStore& queries, const std::vector<float>& query_norms,
+                      size_t tile_begin, size_t tile_end, std::vector<TopK>& topk) const {
+        const size_t nq = queries.size();
+        const size_t n = database_.size();
+        const size_t dim = database_.dim();
+        std::vector<float> ip(kQueryTile * kDbTile);
+
+        for (size_t tile = tile_begin; tile < tile_end; tile++) {
+            size_t qb = tile * kQueryTile;
+            size_t qe = std::min(qb + kQueryTile, nq);
+            for (size_t b = 0; b < n; b += kDbTile) {
+                size_t be = std::min(b + kDbTile, n);
+                ip_tile_(queries.row(qb), queries.stride(), qe - qb,
+                         database_.row(b), database_.stride(), be - b,
+                         dim, ip.data(), kDbTile);
+
+                for (size_t q = qb; q < qe; q++) {
+                    const float* row = ip.data() + (q - qb) * kDbTile;
+                    float qn = norm_scale_ * query_norms[q];
+                    for (size_t j = b; j < be; j++) {
+                        float dist = norm_scale_ * norms_[j] - ip_scale_ * row[j - b] + qn;
+                        topk[q].push(static_cast<int>(j), std::max(dist, floor_));
+                    }
+                }
+            }
+        }
+    }
+
+    const VectorStore& database_;
+    FlatArray<float> norms_;
+    IpTileFn ip_tile_;
+    const char* backend_;
+    float norm_scale_;
+    float ip_scale_;
+    float floor_;
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+
+// Host interface of the CUDA engine in gpu_search.cu. Only plain types
+// cross it, so gpu_search.cu includes none of the CPU headers (nvcc and
+// their intrinsics do not mix) and main.cpp none of the CUDA ones. Use it
+// through GpuSearchEngine in gpu_search.h.
+
+// Largest k the warp-level selection keeps on the device.
+const int kGpuMaxK = 1024;
+
+// How an inner product from the GEMM becomes a ranking value:
+//     dist = max(norm_scale * (||x||^2 + ||q||^2) - ip_scale * x.q, floor)
+struct GpuMetricTerms {
+    float norm_scale;
+    float ip_scale;
+    float floor;
+};
+
+// A database split into one contiguous, device-resident shard per GPU.
+struct GpuDatabase;
+
+// Copy n rows of dim floats (stride floats apart) onto up to max_devices
+// devices (0 = all), an equal share each, and compute their norms there.
+// Null, with a message on stderr, if there is no device or a shard does
+// not fit.
+GpuDatabase* gpu_database_create(const float* rows, size_t n, size_t dim, size_t stride, int max_devices,
+                                 GpuMetricTerms terms);
+void gpu_database_destroy(GpuDatabase* db);
+
+int gpu_database_num_devices(const GpuDatabase* db);
+const char* gpu_database_device_name(const GpuDatabase* db, int shard);
+size_t gpu_database_shard_first(const GpuDatabase* db, int shard);
+size_t gpu_database_shard_rows(const GpuDatabase* db, int shard);
+
+// The k (<= kGpuMaxK) smallest ranking values of every query (nq rows of
+// the database dimension, stride floats apart) over all shards, closest
+// first, as nq x k entries of out_dist / out_ids; ids are -1 past the end
+// of a short database. False, with a message on stderr, on a CUDA error.
+bool gpu_database_search(GpuDatabase* db, const float* queries, size_t nq, size_t stride, int k,
+                         float* out_dist, int* out_ids);
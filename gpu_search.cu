@@ -0,0 +1,439 @@
+// CUDA side of GpuSearchEngine (see gpu_search.h and gpu_device.h); built
+// by `make cuda` only.
+//
+// Every device holds a contiguous shard of the database, row-major with no
+// padding, and the squared norm of each row. A batch of queries goes
+// through in chunks of kQueryChunk, alternating between two slots: each
+// slot has its own stream, device buffers and pinned host staging, so
+// while one chunk is being searched the next one is already copied in and
+// the results of the last one are merged on the host. Per chunk and shard:
+//
+//  1. copy the chunk in and compute its norms;
+//  2. for each tile of kDbTile shard rows, one SGEMM gives the tile x chunk
+//     inner products (column-major, one contiguous column per query);
+//  3. a warp per query turns its column into distances and keeps the best
+//     k in shared memory: the warp reads 32 candidates at a time, a ballot
+//     against the current k-th best drops all but the few that qualify,
+//     and each of those is inserted with the whole warp shifting the
+//     sorted list. The list lives in device memory between tiles;
+//  4. the chunk's lists are copied back, k per query and shard.
+//
+// The host then merges the shards' lists of each query.
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cublas_v2.h>
+#include <cuda_runtime.h>
+
+#include "gpu_device.h"
+
+namespace {
+
+const int kWarpSize = 32;
+const int kWarpsPerBlock = 4;
+const unsigned kFullMask = 0xffffffffu;
+
+// Queries per pipelined chunk and shard rows per SGEMM: the inner-product
+// buffer of a slot is kDbTile x kQueryChunk floats (64 MB).
+const size_t kQueryChunk = 1024;
+const size_t kDbTile = 16384;
+const int kSlots = 2;
+
+bool cuda_ok(cudaError_t err, const char* what) {
+    if (err == cudaSuccess) return true;
+    std::cerr << "Error: CUDA " << what << " failed: " << cudaGetErrorString(err) << std::endl;
+    return false;
+}
+
+bool cublas_ok(cublasStatus_t status, const char* what) {
+    if (status == CUBLAS_STATUS_SUCCESS) return true;
+    std::cerr << "Error: cuBLAS " << what << " failed (status " << static_cast<int>(status) << ")" << std::endl;
+    return false;
+}
+
+int grid_for(size_t n, int block) {
+    return static_cast<int>(std::min<size_t>((n + block - 1) / block, 65535));
+}
+
+__global__ void row_norms_kernel(const float* rows, size_t n, int dim, float* out) {
+    for (size_t i = blockIdx.x * static_cast<size_t>(blockDim.x) + threadIdx.x; i < n;
+         i += static_cast<size_t>(gridDim.x) * blockDim.x) {
+        const float* v = rows + i * dim;
+        float sum = 0.0f;
+        for (int d = 0; d < dim; d++) sum += v[d] * v[d];
+        out[i] = sum;
+    }
+}
+
+__global__ void reset_lists_kernel(float* dist, int* ids, size_t n) {
+    for (size_t i = blockIdx.x * static_cast<size_t>(blockDim.x) + threadIdx.x; i < n;
+         i += static_cast<size_t>(gridDim.x) * blockDim.x) {
+        dist[i] = __int_as_float(0x7f800000);  // +inf
+        ids[i] = -1;
+    }
+}
+
+// Insert (cd, cid) into the warp's sorted list of k, dropping the last
+// entry. Every lane takes part; ties go after the entries already there,
+// so the lower id (scanned first) stays ahead.
+__device__ void warp_insert(float* dist, int* ids, int k, float cd, int cid, int lane) {
+    int pos = 0;
+    for (int p0 = 0; p0 < k; p0 += kWarpSize) {
+        const int p = p0 + lane;
+        pos += __popc(__ballot_sync(kFullMask, p < k && dist[p] <= cd));
+    }
+    // Shift [pos, k - 1) up by one, from the top chunk down, so no entry
+    // is overwritten before it has moved.
+    for (int p0 = (k - 1) / kWarpSize * kWarpSize; p0 >= 0; p0 -= kWarpSize) {
+        const int p = p0 + lane;
+        const bool move = p >= pos && p < k - 1;
+        float vd = 0.0f;
+        int vi = 0;
+        if (move) {
+            vd = dist[p];
+            vi = ids[p];
+        }
+        __syncwarp();
+        if (move) {
+            dist[p + 1] = vd;
+            ids[p + 1] = vi;
+        }
+        __syncwarp();
+    }
+    if (lane == 0) {
+        dist[pos] = cd;
+        ids[pos] = cid;
+    }
+    __syncwarp();
+}
+
+// Merge one tile into the best-k lists of nq queries. ip is the tile's
+// column-major inner products (tile_rows used of ld per query column).
+__global__ void tile_topk_kernel(const float* ip, size_t ld, const float* row_norms, const float* query_norms,
+                                 int tile_rows, int nq, int k, int id_base, GpuMetricTerms terms,
+                                 float* best_dist, int* best_id) {
+    extern __shared__ unsigned char shared[];
+    const int warp = threadIdx.x / kWarpSize;
+    const int lane = threadIdx.x % kWarpSize;
+    const int q = blockIdx.x * kWarpsPerBlock + warp;
+    if (q >= nq) return;  // whole warps only; nothing below syncs the block
+
+    float* dist = reinterpret_cast<float*>(shared) + warp * k;
+    int* ids = reinterpret_cast<int*>(shared + kWarpsPerBlock * k * sizeof(float)) + warp * k;
+    float* q_dist = best_dist + static_cast<size_t>(q) * k;
+    int* q_ids = best_id + static_cast<size_t>(q) * k;
+    for (int p = lane; p < k; p += kWarpSize) {
+        dist[p] = q_dist[p];
+        ids[p] = q_ids[p];
+    }
+    __syncwarp();
+
+    float threshold = dist[k - 1];
+    const float qn = terms.norm_scale * query_norms[q];
+    const float* column = ip + static_cast<size_t>(q) * ld;
+    for (int base = 0; base < tile_rows; base += kWarpSize) {
+        const int j = base + lane;
+        float d = __int_as_float(0x7f800000);
+        if (j < tile_rows) {
+            d = fmaxf(terms.norm_scale * row_norms[j] - terms.ip_scale * column[j] + qn, terms.floor);
+        }
+        unsigned candidates = __ballot_sync(kFullMask, d < threshold);
+        while (candidates) {
+            const int src = __ffs(candidates) - 1;
+            candidates &= candidates - 1;
+            const float cd = __shfl_sync(kFullMask, d, src);
+            if (cd >= threshold) continue;  // the list tightened since the ballot
+            warp_insert(dist, ids, k, cd, id_base + base + src, lane);
+            threshold = dist[k - 1];
+        }
+    }
+
+    for (int p = lane; p < k; p += kWarpSize) {
+        q_dist[p] = dist[p];
+        q_ids[p] = ids[p];
+    }
+}
+
+// Per-chunk state of one shard: a stream of its own, with the device
+// buffers and pinned result lists it uses.
+struct Slot {
+    cudaStream_t stream = nullptr;
+    cublasHandle_t blas = nullptr;
+    float* queries = nullptr;
+    float* query_norms = nullptr;
+    float* ip = nullptr;
+    float* best_dist = nullptr;
+    int* best_id = nullptr;
+    float* host_dist = nullptr;
+    int* host_id = nullptr;
+};
+
+struct Shard {
+    int device = 0;
+    std::string name;
+    size_t first = 0;
+    size_t rows = 0;
+    float* data = nullptr;
+    float* norms = nullptr;
+    Slot slots[kSlots];
+};
+
+}  // namespace
+
+struct GpuDatabase {
+    size_t dim = 0;
+    GpuMetricTerms terms;
+    std::vector<Shard> shards;
+    float* host_queries[kSlots] = {nullptr, nullptr};  // pinned, shared by the shards
+    int slot_k = 0;                                      // k the list buffers are sized for
+};
+
+namespace {
+
+void free_lists(Slot& slot) {
+    cudaFree(slot.best_dist);
+    cudaFree(slot.best_id);
+    cudaFreeHost(slot.host_dist);
+    cudaFreeHost(slot.host_id);
+    slot.best_dist = nullptr;
+    slot.best_id = nullptr;
+    slot.host_dist = nullptr;
+    slot.host_id = nullptr;
+}
+
+// Size every slot's best-k lists for k, keeping them if they are already.
+bool reserve_lists(GpuDatabase& db, int k) {
+    if (db.slot_k == k) return true;
+    const size_t entries = kQueryChunk * static_cast<size_t>(k);
+    for (size_t s = 0; s < db.shards.size(); s++) {
+        Shard& shard = db.shards[s];
+        if (!cuda_ok(cudaSetDevice(shard.device), "selecting a device")) return false;
+        for (int i = 0; i < kSlots; i++) {
+            Slot& slot = shard.slots[i];
+            free_lists(slot);
+            if (!cuda_ok(cudaMalloc(&slot.best_dist, entries * sizeof(float)), "allocating top-k lists") ||
+                !cuda_ok(cudaMalloc(&slot.best_id, entries * sizeof(int)), "allocating top-k lists") ||
+                !cuda_ok(cudaMallocHost(&slot.host_dist, entries * sizeof(float)), "allocating pinned memory") ||
+                !cuda_ok(cudaMallocHost(&slot.host_id, entries * sizeof(int)), "allocating pinned memory")) {
+                db.slot_k = 0;
+                return false;
+            }
+        }
+    }
+    db.slot_k = k;
+    return true;
+}
+
+// Queue the search of chunk rows [0, nq) of host_queries on one slot of
+// shard: copy in, SGEMM and select tile by tile, copy the lists out.
+bool enqueue_chunk(const GpuDatabase& db, Shard& shard, int s, size_t nq, int k) {
+    Slot& slot = shard.slots[s];
+    const int dim = static_cast<int>(db.dim);
+    const float one = 1.0f;
+    const float zero = 0.0f;
+    const size_t entries = nq * static_cast<size_t>(k);
+    const size_t shared_bytes = kWarpsPerBlock * static_cast<size_t>(k) * (sizeof(float) + sizeof(int));
+    const int blocks = static_cast<int>((nq + kWarpsPerBlock - 1) / kWarpsPerBlock);
+
+    if (!cuda_ok(cudaSetDevice(shard.device), "selecting a device") ||
+        !cuda_ok(cudaMemcpyAsync(slot.queries, db.host_queries[s], nq * db.dim * sizeof(float),
+                                 cudaMemcpyHostToDevice, slot.stream), "copying queries")) {
+        return false;
+    }
+    row_norms_kernel<<<grid_for(nq, 256), 256, 0, slot.stream>>>(slot.queries, nq, dim, slot.query_norms);
+    reset_lists_kernel<<<grid_for(entries, 256), 256, 0, slot.stream>>>(slot.best_dist, slot.best_id, entries);
+    for (size_t b = 0; b < shard.rows; b += kDbTile) {
+        const size_t tile = std::min(kDbTile, shard.rows - b);
+        if (!cublas_ok(cublasSgemm(slot.blas, CUBLAS_OP_T, CUBLAS_OP_N, static_cast<int>(tile),
+                                   static_cast<int>(nq), dim, &one, shard.data + b * db.dim, dim,
+                                   slot.queries, dim, &zero, slot.ip, static_cast<int>(kDbTile)),
+                       "SGEMM")) {
+            return false;
+        }
+        tile_topk_kernel<<<blocks, kWarpsPerBlock * kWarpSize, shared_bytes, slot.stream>>>(
+            slot.ip, kDbTile, shard.norms + b, slot.query_norms, static_cast<int>(tile), static_cast<int>(nq), k,
+            static_cast<int>(shard.first + b), db.terms, slot.best_dist, slot.best_id);
+    }
+    return cuda_ok(cudaMemcpyAsync(slot.host_dist, slot.best_dist, entries * sizeof(float),
+                                   cudaMemcpyDeviceToHost, slot.stream), "copying results") &&
+           cuda_ok(cudaMemcpyAsync(slot.host_id, slot.best_id, entries * sizeof(int),
+                                   cudaMemcpyDeviceToHost, slot.stream), "copying results") &&
+           cuda_ok(cudaGetLastError(), "launching a kernel");
+}
+
+// Wait for chunk [q_begin, q_begin + nq) on slot s of every shard and
+// merge the shards' lists into the output.
+bool finish_chunk(GpuDatabase& db, int s, size_t q_begin, size_t nq, int k, float* out_dist, int* out_ids) {
+    for (size_t i = 0; i < db.shards.size(); i++) {
+        Shard& shard = db.shards[i];
+        if (!cuda_ok(cudaSetDevice(shard.device), "selecting a device") ||
+            !cuda_ok(cudaStreamSynchronize(shard.slots[s].stream), "searching")) {
+            return false;
+        }
+    }
+    const size_t kk = static_cast<size_t>(k);
+    std::vector<std::pair<float, int>> merged;
+    for (size_t q = 0; q < nq; q++) {
+        merged.clear();
+        for (size_t i = 0; i < db.shards.size(); i++) {
+            const Slot& slot = db.shards[i].slots[s];
+            for (size_t j = 0; j < kk && slot.host_id[q * kk + j] >= 0; j++) {
+                merged.push_back(std::make_pair(slot.host_dist[q * kk + j], slot.host_id[q * kk + j]));
+            }
+        }
+        const size_t keep = std::min(kk, merged.size());
+        std::partial_sort(merged.begin(), merged.begin() + keep, merged.end());
+        float* dist = out_dist + (q_begin + q) * kk;
+        int* ids = out_ids + (q_begin + q) * kk;
+        for (size_t j = 0; j < kk; j++) {
+            dist[j] = j < keep ? merged[j].first : 0.0f;
+            ids[j] = j < keep ? merged[j].second : -1;
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
+void gpu_database_destroy(GpuDatabase* db) {
+    for (size_t s = 0; s < db->shards.size(); s++) {
+        Shard& shard = db->shards[s];
+        cudaSetDevice(shard.device);
+        for (int i = 0; i < kSlots; i++) {
+            Slot& slot = shard.slots[i];
+            free_lists(slot);
+            cudaFree(slot.queries);
+            cudaFree(slot.query_norms);
+            cudaFree(slot.ip);
+            if (slot.blas) cublasDestroy(slot.blas);
+            if (slot.stream) cudaStreamDestroy(slot.stream);
+        }
+        cudaFree(shard.data);
+        cudaFree(shard.norms);
+    }
+    for (int i = 0; i < kSlots; i++) cudaFreeHost(db->host_queries[i]);
+    delete db;
+}
+
+GpuDatabase* gpu_database_create(const float* rows, size_t n, size_t dim, size_t stride, int max_devices,
+                                 GpuMetricTerms terms) {
+    int count = 0;
+    if (!cuda_ok(cudaGetDeviceCount(&count), "counting devices")) return nullptr;
+    if (count == 0) {
+        std::cerr << "Error: no CUDA device found" << std::endl;
+        return nullptr;
+    }
+    if (max_devices > 0) count = std::min(count, max_devices);
+    count = static_cast<int>(std::min<size_t>(static_cast<size_t>(count), n));
+
+    GpuDatabase* db = new GpuDatabase();
+    db->dim = dim;
+    db->terms = terms;
+    db->shards.resize(count);
+    const size_t per_shard = (n + count - 1) / count;
+    bool ok = true;
+    for (int i = 0; i < kSlots && ok; i++) {
+        // Portable, so every device can copy from it.
+        ok = cuda_ok(cudaHostAlloc(&db->host_queries[i], kQueryChunk * dim * sizeof(float), cudaHostAllocPortable),
+                     "allocating pinned memory");
+    }
+    for (int d = 0; d < count && ok; d++) {
+        Shard& shard = db->shards[d];
+        shard.device = d;
+        shard.first = d * per_shard;
+        shard.rows = std::min(per_shard, n - shard.first);
+        cudaDeviceProp props;
+        ok = cuda_ok(cudaSetDevice(d), "selecting a device") &&
+             cuda_ok(cudaGetDeviceProperties(&props, d), "querying a device");
+        if (!ok) break;
+        shard.name = props.name;
+
+        // The shard is stored packed (dim floats per row) for the SGEMM.
+        ok = cuda_ok(cudaMalloc(&shard.data, shard.rows * dim * sizeof(float)), "allocating the database shard") &&
+             cuda_ok(cudaMalloc(&shard.norms, shard.rows * sizeof(float)), "allocating the database shard") &&
+             cuda_ok(cudaMemcpy2D(shard.data, dim * sizeof(float), rows + shard.first * stride,
+                                  stride * sizeof(float), dim * sizeof(float), shard.rows, cudaMemcpyHostToDevice),
+                     "copying the database shard");
+        if (!ok) {
+            std::cerr << " (shard of " << shard.rows << " rows, "
+                      << shard.rows * dim * sizeof(float) / (1024.0 * 1024.0) << " MB, on " << shard.name << ")"
+                      << std::endl;
+            break;
+        }
+        row_norms_kernel<<<grid_for(shard.rows, 256), 256>>>(shard.data, shard.rows, static_cast<int>(dim),
+                                                             shard.norms);
+        for (int i = 0; i < kSlots && ok; i++) {
+            Slot& slot = shard.slots[i];
+            ok = cuda_ok(cudaStreamCreateWithFlags(&slot.stream, cudaStreamNonBlocking), "creating a stream") &&
+                 cublas_ok(cublasCreate(&slot.blas), "creating a handle") &&
+                 cublas_ok(cublasSetStream(slot.blas, slot.stream), "binding a stream") &&
+                 cuda_ok(cudaMalloc(&slot.queries, kQueryChunk * dim * sizeof(float)), "allocating query buffers") &&
+                 cuda_ok(cudaMalloc(&slot.query_norms, kQueryChunk * sizeof(float)), "allocating query buffers") &&
+                 cuda_ok(cudaMalloc(&slot.ip, kDbTile * kQueryChunk * sizeof(float)), "allocating query buffers");
+        }
+        ok = ok && cuda_ok(cudaDeviceSynchronize(), "computing database norms");
+    }
+    if (!ok) {
+        gpu_database_destroy(db);
+        return nullptr;
+    }
+    return db;
+}
+
+int gpu_database_num_devices(const GpuDatabase* db) {
+    return static_cast<int>(db->shards.size());
+}
+
+const char* gpu_database_device_name(const GpuDatabase* db, int shard) {
+    return db->shards[shard].name.c_str();
+}
+
+size_t gpu_database_shard_first(const GpuDatabase* db, int shard) {
+    return db->shards[shard].first;
+}
+
+size_t gpu_database_shard_rows(const GpuDatabase* db, int shard) {
+    return db->shards[shard].rows;
+}
+
+bool gpu_database_search(GpuDatabase* db, const float* queries, size_t nq, size_t stride, int k,
+                         float* out_dist, int* out_ids) {
+    if (k <= 0 || k > kGpuMaxK) {
+        std::cerr << "Error: k must be in [1, " << kGpuMaxK << "] on the GPU" << std::endl;
+        return false;
+    }
+    if (!reserve_lists(*db, k)) return false;
+
+    // Chunk c uses slot c % kSlots. Before its staging buffer is refilled,
+    // chunk c - kSlots (the last user of the slot) is waited for and
+    // merged, which overlaps with the devices working on chunk c - 1.
+    const size_t chunks = (nq + kQueryChunk - 1) / kQueryChunk;
+    for (size_t c = 0; c < chunks + kSlots; c++) {
+        const int s = static_cast<int>(c % kSlots);
+        if (c >= kSlots) {
+            const size_t done = c - kSlots;
+            if (done < chunks) {
+                const size_t begin = done * kQueryChunk;
+                if (!finish_chunk(*db, s, begin, std::min(kQueryChunk, nq - begin), k, out_dist, out_ids)) {
+                    return false;
+                }
+            }
+        }
+        if (c >= chunks) continue;
+
+        const size_t begin = c * kQueryChunk;
+        const size_t rows = std::min(kQueryChunk, nq - begin);
+        for (size_t q = 0; q < rows; q++) {
+            std::memcpy(db->host_queries[s] + q * db->dim, queries + (begin + q) * stride, db->dim * sizeof(float));
+        }
+        for (size_t i = 0; i < db->shards.size(); i++) {
+            if (!enqueue_chunk(*db, db->shards[i], s, rows, k)) return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "distance.h"
+#include "gpu_device.h"
+#include "search.h"
+#include "vector_store.h"
+
+#ifndef SEARCH_USE_CUDA
+// Without CUDA the engine exists but never gets a database.
+inline GpuDatabase* gpu_database_create(const float*, size_t, size_t, size_t, int, GpuMetricTerms) {
+    std::cerr << "Error: this binary was built without CUDA; build it with `make cuda`" << std::endl;
+    return nullptr;
+}
+inline void gpu_database_destroy(GpuDatabase*) {}
+inline int gpu_database_num_devices(const GpuDatabase*) { return 0; }
+inline const char* gpu_database_device_name(const GpuDatabase*, int) { return ""; }
+inline size_t gpu_database_shard_first(const GpuDatabase*, int) { return 0; }
+inline size_t gpu_database_shard_rows(const GpuDatabase*, int) { return 0; }
+inline bool gpu_database_search(GpuDatabase*, const float*, size_t, size_t, int, float*, int*) { return false; }
+#endif
+
+// Exact batched k-NN on CUDA devices, with the interface of
+// GemmSearchEngine. The database is copied once into device memory, split
+// into one shard per GPU, and stays there; queries go through in pipelined
+// chunks, so a batch of any size streams over the PCIe bus while the
+// previous chunk is being searched. Each shard computes the inner products
+// of a chunk against a tile of its rows with one cuBLAS SGEMM, turns them
+// into distances through the same norm expansion as GemmSearchEngine, and
+// keeps each query's best k with one warp per query; the shards' lists are
+// merged on the host.
+//
+// Built in only with `make cuda` (-DSEARCH_USE_CUDA, linking gpu_search.o);
+// otherwise the engine reports that it is unavailable and fails to build.
+class GpuSearchEngine {
+public:
+    explicit GpuSearchEngine(const VectorStore& database, int max_devices = 0)
+        : db_(database.empty() ? nullptr
+                               : gpu_database_create(database.data(), database.size(), database.dim(),
+                                                     database.stride(), max_devices, metric_terms())) {}
+
+    ~GpuSearchEngine() {
+        if (db_) gpu_database_destroy(db_);
+    }
+
+    GpuSearchEngine(const GpuSearchEngine&) = delete;
+    GpuSearchEngine& operator=(const GpuSearchEngine&) = delete;
+
+    // False if the database could not be placed on the devices.
+    bool ok() const { return db_ != nullptr; }
+
+    int num_devices() const { return db_ ? gpu_database_num_devices(db_) : 0; }
+
+    // "<device name> rows <first>-<end>" for one shard.
+    std::string shard_description(int shard) const {
+        const size_t first = gpu_database_shard_first(db_, shard);
+        return std::string(gpu_database_device_name(db_, shard)) + " rows " + std::to_string(first) + "-" +
+               std::to_string(first + gpu_database_shard_rows(db_, shard));
+    }
+
+    std::vector<std::vector<SearchResult>> search(const VectorStore& queries, int k,
+                                                  const SearchParams& params = SearchParams()) const {
+        const size_t nq = queries.size();
+        std::vector<std::vector<SearchResult>> results(nq);
+        if (!db_ || nq == 0 || k <= 0) return results;
+        if (k > kGpuMaxK) {
+            std::cerr << "Error: the GPU engine keeps at most " << kGpuMaxK << " neighbors per query" << std::endl;
+            return results;
+        }
+        const size_t kk = static_cast<size_t>(k);
+        std::vector<float> dist(nq * kk);
+        std::vector<int> ids(nq * kk);
+        if (!gpu_database_search(db_, queries.data(), nq, queries.stride(), k, dist.data(), ids.data())) {
+            return results;
+        }
+        for (size_t q = 0; q < nq; q++) {
+            results[q].reserve(kk);
+            for (size_t j = 0; j < kk && ids[q * kk + j] >= 0; j++) {
+                results[q].push_back({ids[q * kk + j], dist[q * kk + j]});
+            }
+            finalize_distances(results[q], params);
+        }
+        return results;
+    }
+
+private:
+    // The ranking of GemmSearchEngine: L2 through the norm expansion, -x.q
+    // for the inner-product metrics.
+    static GpuMetricTerms metric_terms() {
+        const bool l2 = active_metric() == kMetricL2;
+        GpuMetricTerms terms;
+        terms.norm_scale = l2 ? 1.0f : 0.0f;
+        terms.ip_scale = l2 ? 2.0f : 1.0f;
+        terms.floor = l2 ? 0.0f : -std::numeric_limits<float>::infinity();
+        return terms;
+    }
+
+    GpuDatabase* db_;
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "search.h"
+#include "topk.h"
+#include "vector_store.h"
+
+// Row-major table of int32 ids, one row per query (e.g. the true nearest
+// neighbors from sift_groundtruth.ivecs, 100 per query).
+struct IdTable {
+    size_t dim = 0;
+    std::vector<int> ids;
+
+    size_t size() const { return dim == 0 ? 0 : ids.size() / dim; }
+    bool empty() const { return ids.empty(); }
+    const int* row(size_t i) const { return ids.data() + i * dim; }
+    int* row(size_t i) { return ids.data() + i * dim; }
+};
+
+// Read ids from .ivecs binary file
+// Format: [dim (4 bytes)] [int32 values (dim × 4 bytes)] repeated
+inline IdTable read_ivecs(const std::string& filename, int max_vectors = -1) {
+    IdTable table;
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file) {
+        std::cerr << "Error: Cannot open file " << filename << std::endl;
+        return table;
+    }
+
+    std::streamoff file_size = file.tellg();
+    file.seekg(0);
+
+    int dim = 0;
+    file.read(reinterpret_cast<char*>(&dim), sizeof(int));
+    if (!file || dim <= 0) {
+        std::cerr << "Error: Invalid .ivecs header in " << filename << std::endl;
+        return table;
+    }
+    file.seekg(0);
+
+    size_t record_bytes = sizeof(int) + static_cast<size_t>(dim) * sizeof(int);
+    size_t count = static_cast<size_t>(file_size) / record_bytes;
+    if (max_vectors > 0 && static_cast<size_t>(max_vectors) < count) {
+        count = static_cast<size_t>(max_vectors);
+    }
+
+    table.dim = static_cast<size_t>(dim);
+    table.ids.resize(count * table.dim);
+    size_t loaded = 0;
+    for (; loaded < count; loaded++) {
+        int row_dim;
+        file.read(reinterpret_cast<char*>(&row_dim), sizeof(int));
+        if (!file) break;
+        if (row_dim != dim) {
+            std::cerr << "Error: Inconsistent dimension at vector " << loaded
+                      << " in " << filename << std::endl;
+            break;
+        }
+        file.read(reinterpret_cast<char*>(table.row(loaded)), dim * sizeof(int));
+        if (!file) break;
+    }
+
+    table.ids.resize(loaded * table.dim);
+    return table;
+}
+
+// True when every id in the first k columns refers to one of the first
+// db_size base vectors, i.e. the table is valid for a truncated database.
+inline bool groundtruth_covers(const IdTable& truth, size_t k, size_t db_size) {
+    const size_t cols = std::min(k, truth.dim);
+    for (size_t q = 0; q < truth.size(); q++) {
+        for (size_t j = 0; j < cols; j++) {
+            int id = truth.row(q)[j];
+            if (id < 0 || static_cast<size_t>(id) >= db_size) return false;
+        }
+    }
+    return true;
+}
+
+// Exact k nearest neighbors of every query by brute force, among the rows
+// filter allows when one is given.
+inline IdTable exact_groundtruth(const VectorStore& queries, const VectorStore& database, int k,
+                                 const SearchParams& params = SearchParams(), const IdFilter* filter = nullptr) {
+    std::vector<std::vector<SearchResult>> results = batch_search(queries, database, k, params, filter);
+    IdTable truth;
+    truth.dim = static_cast<size_t>(k);
+    truth.ids.assign(queries.size() * truth.dim, -1);
+    for (size_t q = 0; q < results.size(); q++) {
+        for (size_t j = 0; j < results[q].size(); j++) truth.row(q)[j] = results[q][j].index;
+    }
+    return truth;
+}
+
+// recall@k: the fraction of each query's true k nearest neighbors found
+// among its first k results, averaged over the queries that have both.
+inline double recall_at_k(const std::vector<std::vector<SearchResult>>& results,
+                          const IdTable& truth, size_t k) {
+    const size_t nq = std::min(results.size(), truth.size());
+    const size_t cols = std::min(k, truth.dim);
+    if (nq == 0 || cols == 0) return 0.0;
+
+    size_t found = 0;
+    std::vector<int> expected;
+    for (size_t q = 0; q < nq; q++) {
+        expected.assign(truth.row(q), truth.row(q) + cols);
+        std::sort(expected.begin(), expected.end());
+        const size_t returned = std::min(k, results[q].size());
+        for (size_t j = 0; j < returned; j++) {
+            if (std::binary_search(expected.begin(), expected.end(), results[q][j].index)) found++;
+        }
+    }
+    return static_cast<double>(found) / static_cast<double>(nq * cols);
+}
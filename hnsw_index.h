@@ -0,0 +1,474 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "distance.h"
+#include "flat_array.h"
+#include "id_filter.h"
+#include "search.h"
+#include "snapshot.h"
+#include "topk.h"
+#include "vector_store.h"
+
+struct HnswParams {
+    size_t M = 16;                  // links per node on upper layers (2M on layer 0)
+    size_t ef_construction = 200;   // candidate list size while inserting
+    unsigned seed = 100;
+    int num_threads = 1;            // parallel insertion
+};
+
+// Per-search "visited" marks. Each search bumps the epoch instead of
+// clearing n flags; the tags are only reset when the epoch wraps.
+class VisitedList {
+public:
+    explicit VisitedList(size_t n) : tags_(n, 0), epoch_(0) {}
+
+    void next_epoch() {
+        if (++epoch_ == 0) {
+            std::fill(tags_.begin(), tags_.end(), 0);
+            epoch_ = 1;
+        }
+    }
+    bool test_and_set(size_t i) {
+        if (tags_[i] == epoch_) return true;
+        tags_[i] = epoch_;
+        return false;
+    }
+
+private:
+    std::vector<uint32_t> tags_;
+    uint32_t epoch_;
+};
+
+// Hierarchical navigable small world graph (Malkov & Yashunin) over an
+// existing VectorStore, which must outlive the index. Vectors are not
+// copied; nodes are database row numbers, so results carry the same ids
+// as brute_force_search.
+//
+// Layer 0 neighbor lists sit in one flat array with a fixed stride of
+// 1 + 2M ints (count, then ids) so expanding a node touches one or two
+// cache lines. The few nodes that reach upper layers keep those lists in a
+// per-node array with stride 1 + M.
+//
+// In a snapshot, layer 0 and the levels are mapped in place; the upper
+// layer lists are stored back to back (their sizes follow from the levels)
+// and copied out on load.
+class HnswIndex {
+public:
+    HnswIndex() : M_(0), max_m0_(0), ef_construction_(0), level_mult_(0),
+                  entry_point_(-1), max_level_(-1), data_(nullptr) {}
+
+    void build(const VectorStore& data, const HnswParams& params = HnswParams()) {
+        data_ = &data;
+        M_ = std::max<size_t>(2, params.M);
+        max_m0_ = 2 * M_;
+        ef_construction_ = std::max(params.ef_construction, M_);
+        level_mult_ = 1.0 / std::log(static_cast<double>(M_));
+        entry_point_ = -1;
+        max_level_ = -1;
+
+        const size_t n = data.size();
+        links0_.assign(n * (1 + max_m0_), 0);
+        upper_.assign(n, std::vector<int>());
+        node_locks_.reset(new std::mutex[n]);
+        visited_pool_.clear();
+
+        // Levels are drawn up front so the graph does not depend on
+        // which thread inserts which node.
+        levels_.resize(n);
+        std::mt19937 rng(params.seed);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        for (size_t i = 0; i < n; i++) {
+            double u = std::max(uniform(rng), 1e-12);
+            levels_[i] = static_cast<int>(-std::log(u) * level_mult_);
+            if (levels_[i] > 0) upper_[i].assign(levels_[i] * (1 + M_), 0);
+        }
+
+        if (n == 0) return;
+        insert(0);
+        std::atomic<size_t> next(1);
+        size_t workers = parallel_thread_count(n, params.num_threads);
+        parallel_for(workers, static_cast<int>(workers), [&](size_t, size_t, size_t) {
+            VisitedList visited(n);
+            for (size_t i = next++; i < n; i = next++) insert(i, &visited);
+        });
+    }
+
+    size_t size() const { return data_ ? data_->size() : 0; }
+    int max_level() const { return max_level_; }
+
+    // Section "hnsw.graph" holds the shape: meta = {M, entry_point, max_level}.
+    void save(SnapshotWriter& writer) const {
+        writer.add("hnsw.graph", 0, [](std::ostream&) { return true; },
+                   M_, static_cast<uint64_t>(static_cast<int64_t>(entry_point_)),
+                   static_cast<uint64_t>(static_cast<int64_t>(max_level_)));
+        writer.add_array("hnsw.links0", links0_.data(), links0_.size());
+        writer.add_array("hnsw.levels", levels_.data(), levels_.size());
+
+        uint64_t upper_ints = 0;
+        for (size_t i = 0; i < upper_.size(); i++) upper_ints += upper_[i].size();
+        const std::vector<std::vector<int>>* upper = &upper_;
+        writer.add("hnsw.upper", upper_ints * sizeof(int), [upper](std::ostream& out) {
+            for (size_t i = 0; i < upper->size() && out; i++) {
+                out.write(reinterpret_cast<const char*>((*upper)[i].data()),
+                          static_cast<std::streamsize>((*upper)[i].size() * sizeof(int)));
+            }
+            return static_cast<bool>(out);
+        });
+    }
+
+    // data must be the store the index was built over (same rows).
+    bool load(const Snapshot& snapshot, const VectorStore& data) {
+        const SnapshotSection* graph = snapshot.require("hnsw.graph");
+        FlatArray<int> upper;
+        if (!graph || !snapshot.array("hnsw.links0", links0_) || !snapshot.array("hnsw.levels", levels_) ||
+            !snapshot.array("hnsw.upper", upper)) {
+            return false;
+        }
+        data_ = &data;
+        M_ = graph->meta[0];
+        max_m0_ = 2 * M_;
+        entry_point_ = static_cast<int>(static_cast<int64_t>(graph->meta[1]));
+        max_level_ = static_cast<int>(static_cast<int64_t>(graph->meta[2]));
+
+        const size_t n = data.size();
+        if (M_ < 2 || levels_.size() != n || links0_.size() != n * (1 + max_m0_)) {
+            std::cerr << "Error: HNSW snapshot does not match the database" << std::endl;
+            return false;
+        }
+        upper_.assign(n, std::vector<int>());
+        size_t pos = 0;
+        for (size_t i = 0; i < n; i++) {
+            size_t len = static_cast<size_t>(std::max(0, levels_[i])) * (1 + M_);
+            if (len == 0) continue;
+            if (pos + len > upper.size()) {
+                std::cerr << "Error: Truncated HNSW upper layers in snapshot" << std::endl;
+                return false;
+            }
+            upper_[i].assign(upper.data() + pos, upper.data() + pos + len);
+            pos += len;
+        }
+        visited_pool_.clear();
+        return true;
+    }
+
+    // Approximate k-NN. ef_search (>= k) is the size of the layer 0
+    // candidate list: larger is slower and more accurate.
+    std::vector<SearchResult> search(const float* query, int k, size_t ef_search,
+                                     const SearchParams& params = SearchParams()) const {
+        std::vector<SearchResult> results;
+        if (entry_point_ < 0 || k <= 0) return results;
+
+        int cur = greedy_descend(query, entry_point_, max_level_, 0);
+
+        std::unique_ptr<VisitedList> visited = acquire_visited();
+        CandidateHeap top = search_layer(query, cur, std::max(ef_search, static_cast<size_t>(k)),
+                                         0, *visited, false);
+        release_visited(std::move(visited));
+
+        TopK topk(static_cast<size_t>(k));
+        while (!top.empty()) {
+            topk.push(top.top().second, top.top().first);
+            top.pop();
+        }
+        results = topk.take_sorted();
+        finalize_distances(results, params);
+        return results;
+    }
+
+    // Top k among the nodes filter allows. A broad filter keeps the graph
+    // walk and filters inside it: every node is still expanded (the graph
+    // stays connected), but only allowed nodes enter the ef result list.
+    // The walk visits roughly ef * 2M / selectivity nodes, so once the
+    // allowed nodes are fewer than that the filtered database is simply
+    // scanned instead (exact, skipping the filter's zero words).
+    std::vector<SearchResult> search(const float* query, int k, size_t ef_search, const IdFilter& filter,
+                                     const SearchParams& params = SearchParams()) const {
+        std::vector<SearchResult> results;
+        if (entry_point_ < 0 || k <= 0) return results;
+        const size_t ef = std::max(ef_search, static_cast<size_t>(k));
+
+        TopK topk(static_cast<size_t>(k));
+        if (static_cast<double>(filter.count()) * filter.selectivity() <= static_cast<double>(ef * max_m0_)) {
+            scan_range_filtered(query, *data_, 0, data_->size(), topk, filter, params.early_abandon);
+        }
+        else {
+            int cur = greedy_descend(query, entry_point_, max_level_, 0);
+            std::unique_ptr<VisitedList> visited = acquire_visited();
+            CandidateHeap top = search_layer(query, cur, ef, 0, *visited, false, &filter);
+            release_visited(std::move(visited));
+            for (; !top.empty(); top.pop()) topk.push(top.top().second, top.top().first);
+        }
+        results = topk.take_sorted();
+        finalize_distances(results, params);
+        return results;
+    }
+
+    std::vector<std::vector<SearchResult>> search_batch(const VectorStore& queries, int k, size_t ef_search,
+                                                        const SearchParams& params = SearchParams()) const {
+        std::vector<std::vector<SearchResult>> results(queries.size());
+        parallel_ranges(queries.size(), 1, params, [&](size_t, size_t begin, size_t end) {
+            for (size_t q = begin; q < end; q++) results[q] = search(queries.row(q), k, ef_search, params);
+        });
+        return results;
+    }
+
+    std::vector<std::vector<SearchResult>> search_batch(const VectorStore& queries, int k, size_t ef_search,
+                                                        const IdFilter& filter,
+                                                        const SearchParams& params = SearchParams()) const {
+        std::vector<std::vector<SearchResult>> results(queries.size());
+        parallel_ranges(queries.size(), 1, params, [&](size_t, size_t begin, size_t end) {
+            for (size_t q = begin; q < end; q++) results[q] = search(queries.row(q), k, ef_search, filter, params);
+        });
+        return results;
+    }
+
+private:
+    typedef std::pair<float, int> Candidate;  // (squared distance, node)
+    // Furthest candidate on top.
+    typedef std::priority_queue<Candidate> CandidateHeap;
+    // Closest candidate on top.
+    typedef std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> FrontierHeap;
+
+    float distance(const float* query, int node) const {
+        return active_kernel().distance(query, data_->row(static_cast<size_t>(node)), data_->dim());
+    }
+
+    int* links(int node, int level) {
+        if (level == 0) return &links0_[static_cast<size_t>(node) * (1 + max_m0_)];
+        return &upper_[node][(level - 1) * (1 + M_)];
+    }
+    const int* links(int node, int level) const {
+        return const_cast<HnswIndex*>(this)->links(node, level);
+    }
+    size_t max_links(int level) const { return level == 0 ? max_m0_ : M_; }
+
+    // Walk greedily from entry through layers [from_level, to_level).
+    int greedy_descend(const float* query, int entry, int from_level, int to_level,
+                       bool locked = false) const {
+        int cur = entry;
+        float cur_dist = distance(query, cur);
+        for (int level = from_level; level > to_level; level--) {
+            bool changed = true;
+            while (changed) {
+                changed = false;
+                std::vector<int> neighbors = read_links(cur, level, locked);
+                for (size_t i = 0; i < neighbors.size(); i++) {
+                    float d = distance(query, neighbors[i]);
+                    if (d < cur_dist) {
+                        cur_dist = d;
+                        cur = neighbors[i];
+                        changed = true;
+                    }
+                }
+            }
+        }
+        return cur;
+    }
+
+    std::vector<int> read_links(int node, int level, bool locked) const {
+        std::unique_lock<std::mutex> lock;
+        if (locked) lock = std::unique_lock<std::mutex>(node_locks_[node]);
+        const int* l = links(node, level);
+        return std::vector<int>(l + 1, l + 1 + l[0]);
+    }
+
+    // Best-first search on one layer; returns up to ef nearest found.
+    // locked is set during construction, when other threads may be
+    // rewriting neighbor lists. With a filter, every node is explored but
+    // only allowed ones are returned.
+    CandidateHeap search_layer(const float* query, int entry, size_t ef, int level,
+                               VisitedList& visited, bool locked, const IdFilter* filter = nullptr) const {
+        visited.next_epoch();
+        CandidateHeap top;
+        FrontierHeap frontier;
+
+        float d = distance(query, entry);
+        if (!filter || filter->allows(static_cast<size_t>(entry))) top.push(Candidate(d, entry));
+        frontier.push(Candidate(d, entry));
+        visited.test_and_set(static_cast<size_t>(entry));
+
+        int buffer[1 + 2 * 64];
+        std::vector<int> overflow;
+        while (!frontier.empty()) {
+            Candidate current = frontier.top();
+            if (top.size() >= ef && current.first > top.top().first) break;
+            frontier.pop();
+
+            // Copy the list out so the node lock (if any) is held briefly.
+            const int* l;
+            size_t count;
+            {
+                std::unique_lock<std::mutex> lock;
+                if (locked) lock = std::unique_lock<std::mutex>(node_locks_[current.second]);
+                const int* src = links(current.second, level);
+                count = static_cast<size_t>(src[0]);
+                if (count + 1 <= sizeof(buffer) / sizeof(buffer[0])) {
+                    std::copy(src, src + 1 + count, buffer);
+                    l = buffer;
+                }
+                else {
+                    overflow.assign(src, src + 1 + count);
+                    l = overflow.data();
+                }
+            }
+
+            for (size_t i = 1; i <= count; i++) {
+                __builtin_prefetch(data_->row(static_cast<size_t>(l[i])));
+            }
+            for (size_t i = 1; i <= count; i++) {
+                int neighbor = l[i];
+                if (visited.test_and_set(static_cast<size_t>(neighbor))) continue;
+                float nd = distance(query, neighbor);
+                if (top.size() < ef || nd < top.top().first) {
+                    frontier.push(Candidate(nd, neighbor));
+                    if (filter && !filter->allows(static_cast<size_t>(neighbor))) continue;
+                    top.push(Candidate(nd, neighbor));
+                    if (top.size() > ef) top.pop();
+                }
+            }
+        }
+        return top;
+    }
+
+    // Keep up to m candidates that are closer to the base point than to any
+    // already kept neighbor (heuristic of Algorithm 4), which preserves
+    // links in several directions instead of one tight cluster.
+    std::vector<int> select_neighbors(CandidateHeap& candidates, size_t m) const {
+        std::vector<Candidate> sorted;
+        sorted.reserve(candidates.size());
+        while (!candidates.empty()) {
+            sorted.push_back(candidates.top());
+            candidates.pop();
+        }
+        std::reverse(sorted.begin(), sorted.end());
+
+        std::vector<int> kept;
+        for (size_t i = 0; i < sorted.size() && kept.size() < m; i++) {
+            const float* v = data_->row(static_cast<size_t>(sorted[i].second));
+            bool good = true;
+            for (size_t j = 0; j < kept.size(); j++) {
+                if (distance(v, kept[j]) < sorted[i].first) {
+                    good = false;
+                    break;
+                }
+            }
+            if (good) kept.push_back(sorted[i].second);
+        }
+        return kept;
+    }
+
+    // Add link node -> target on level, pruning target's list if it is full.
+    void connect(int target, int node, float dist, int level) {
+        std::lock_guard<std::mutex> lock(node_locks_[target]);
+        int* l = links(target, level);
+        size_t count = static_cast<size_t>(l[0]);
+        size_t limit = max_links(level);
+        if (count < limit) {
+            l[1 + count] = node;
+            l[0] = static_cast<int>(count + 1);
+            return;
+        }
+
+        const float* t = data_->row(static_cast<size_t>(target));
+        CandidateHeap candidates;
+        candidates.push(Candidate(dist, node));
+        for (size_t i = 1; i <= count; i++) candidates.push(Candidate(distance(t, l[i]), l[i]));
+        std::vector<int> kept = select_neighbors(candidates, limit);
+        std::copy(kept.begin(), kept.end(), l + 1);
+        l[0] = static_cast<int>(kept.size());
+    }
+
+    void insert(size_t id, VisitedList* visited = nullptr) {
+        std::unique_ptr<VisitedList> own;
+        if (!visited) {
+            own.reset(new VisitedList(data_->size()));
+            visited = own.get();
+        }
+
+        const int node = static_cast<int>(id);
+        const int level = levels_[id];
+        const float* v = data_->row(id);
+
+        // A node that raises the top level holds the global lock for its
+        // whole insertion so the entry point stays consistent.
+        std::unique_lock<std::mutex> global(global_lock_);
+        if (entry_point_ < 0) {
+            entry_point_ = node;
+            max_level_ = level;
+            return;
+        }
+        int entry = entry_point_;
+        int top_level = max_level_;
+        if (level <= top_level) global.unlock();
+
+        int cur = greedy_descend(v, entry, top_level, level, true);
+        for (int l = std::min(level, top_level); l >= 0; l--) {
+            CandidateHeap candidates = search_layer(v, cur, ef_construction_, l, *visited, true);
+            std::vector<Candidate> all;
+            CandidateHeap copy = candidates;
+            while (!copy.empty()) {
+                all.push_back(copy.top());
+                copy.pop();
+            }
+            cur = all.back().second;  // closest found seeds the next layer
+
+            std::vector<int> neighbors = select_neighbors(candidates, M_);
+            {
+                std::lock_guard<std::mutex> lock(node_locks_[node]);
+                int* own_links = links(node, l);
+                std::copy(neighbors.begin(), neighbors.end(), own_links + 1);
+                own_links[0] = static_cast<int>(neighbors.size());
+            }
+            for (size_t i = 0; i < neighbors.size(); i++) {
+                connect(neighbors[i], node, distance(v, neighbors[i]), l);
+            }
+        }
+
+        if (level > top_level) {
+            entry_point_ = node;
+            max_level_ = level;
+        }
+    }
+
+    std::unique_ptr<VisitedList> acquire_visited() const {
+        std::lock_guard<std::mutex> lock(pool_lock_);
+        if (visited_pool_.empty()) return std::unique_ptr<VisitedList>(new VisitedList(data_->size()));
+        std::unique_ptr<VisitedList> v = std::move(visited_pool_.back());
+        visited_pool_.pop_back();
+        return v;
+    }
+
+    void release_visited(std::unique_ptr<VisitedList> v) const {
+        std::lock_guard<std::mutex> lock(pool_lock_);
+        visited_pool_.push_back(std::move(v));
+    }
+
+    size_t M_;
+    size_t max_m0_;
+    size_t ef_construction_;
+    double level_mult_;
+    int entry_point_;
+    int max_level_;
+    const VectorStore* data_;
+
+    FlatArray<int> links0_;                 // n * (1 + 2M): count, neighbor ids
+    std::vector<std::vector<int>> upper_;   // per node: level * (1 + M)
+    FlatArray<int> levels_;
+    std::unique_ptr<std::mutex[]> node_locks_;
+    std::mutex global_lock_;
+
+    mutable std::mutex pool_lock_;
+    mutable std::vector<std::unique_ptr<VisitedList>> visited_pool_;
+};
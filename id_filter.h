@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Allow-list of database ids for filtered search, as a dense bitset: bit
+// id % 64 of word id / 64 is set when id may be returned. Scans walk the
+// words rather than the ids, so a zero word skips 64 rows at the cost of
+// one load, and the set bits of a nonzero word are visited with
+// count-trailing-zeros. Ids at or beyond size() are never allowed.
+//
+// An allow-list held in another form (a Roaring bitmap, a sorted id list
+// from a tenant table) is converted once per filter with allow() or
+// from_ids(); at one bit per database row the dense form costs n / 8
+// bytes and makes every membership test a single load.
+class IdFilter {
+public:
+    IdFilter() : size_(0), count_(0) {}
+
+    // Nothing allowed yet, over ids [0, n).
+    explicit IdFilter(size_t n) : size_(n), count_(0), words_((n + 63) / 64, 0) {}
+
+    static IdFilter from_ids(size_t n, const int* ids, size_t count) {
+        IdFilter filter(n);
+        for (size_t i = 0; i < count; i++) {
+            if (ids[i] >= 0) filter.allow(static_cast<size_t>(ids[i]));
+        }
+        return filter;
+    }
+
+    void allow(size_t id) {
+        if (id >= size_) return;
+        const uint64_t bit = uint64_t(1) << (id & 63);
+        if (!(words_[id >> 6] & bit)) {
+            words_[id >> 6] |= bit;
+            count_++;
+        }
+    }
+
+    bool allows(size_t id) const {
+        return id < size_ && (words_[id >> 6] >> (id & 63) & 1) != 0;
+    }
+
+    size_t size() const { return size_; }
+    size_t count() const { return count_; }
+    size_t num_words() const { return words_.size(); }
+
+    // Fraction of [0, size()) that is allowed.
+    double selectivity() const { return size_ == 0 ? 0.0 : static_cast<double>(count_) / size_; }
+
+    // Word w of the bitset; zero past the end.
+    uint64_t word(size_t w) const { return w < words_.size() ? words_[w] : 0; }
+
+private:
+    size_t size_;
+    size_t count_;
+    std::vector<uint64_t> words_;
+};
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "distance.h"
+#include "flat_array.h"
+#include "id_filter.h"
+#include "kmeans.h"
+#include "search.h"
+#include "snapshot.h"
+#include "topk.h"
+#include "vector_store.h"
+
+struct IvfParams {
+    size_t nlist = 1024;          // number of coarse centroids / posting lists
+    size_t train_size = 65536;    // base vectors sampled for k-means
+    KMeansParams kmeans;
+};
+
+// Inverted file index with a k-means coarse quantizer.
+//
+// The base vectors are copied into one contiguous store ordered by posting
+// list, so scanning a list is the same sequential stream brute_force_search
+// runs over the whole database. A query scans only the nprobe lists whose
+// centroids are nearest; nprobe = nlist makes the search exact.
+//
+// save() / load() store the index in a snapshot; a loaded index serves
+// queries straight from the mapping.
+class IvfIndex {
+public:
+    void build(const VectorStore& base, const IvfParams& params = IvfParams()) {
+        VectorStore train = sample_rows(base, std::max(params.train_size, params.nlist),
+                                        params.kmeans.seed);
+        centroids_ = kmeans(train, params.nlist, params.kmeans);
+
+        std::vector<size_t> assignment;
+        assign_to_centroids(base, centroids_, params.kmeans.num_threads, assignment);
+
+        const size_t nlist = centroids_.size();
+        offsets_.assign(nlist + 1, 0);
+        for (size_t i = 0; i < base.size(); i++) offsets_[assignment[i] + 1]++;
+        for (size_t c = 0; c < nlist; c++) offsets_[c + 1] += offsets_[c];
+
+        vectors_ = VectorStore(base.dim(), base.size());
+        ids_.resize(base.size());
+        std::vector<size_t> fill(offsets_.begin(), offsets_.end() - 1);
+        for (size_t i = 0; i < base.size(); i++) {
+            size_t slot = fill[assignment[i]]++;
+            std::memcpy(vectors_.row(slot), base.row(i), base.dim() * sizeof(float));
+            ids_[slot] = static_cast<int>(i);
+        }
+    }
+
+    void save(SnapshotWriter& writer) const {
+        writer.add_vectors("ivf.centroids", centroids_);
+        writer.add_vectors("ivf.vectors", vectors_);
+        writer.add_array("ivf.ids", ids_.data(), ids_.size());
+        writer.add_array("ivf.offsets", offsets_.data(), offsets_.size());
+    }
+
+    bool load(const Snapshot& snapshot) {
+        if (!snapshot.vectors("ivf.centroids", centroids_) || !snapshot.vectors("ivf.vectors", vectors_) ||
+            !snapshot.array("ivf.ids", ids_) || !snapshot.array("ivf.offsets", offsets_)) {
+            return false;
+        }
+        if (offsets_.size() != centroids_.size() + 1 || ids_.size() != vectors_.size() ||
+            offsets_[centroids_.size()] != vectors_.size()) {
+            std::cerr << "Error: Inconsistent IVF sections in snapshot" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    size_t nlist() const { return centroids_.size(); }
+    size_t size() const { return vectors_.size(); }
+    size_t list_size(size_t list) const { return offsets_[list + 1] - offsets_[list]; }
+    const VectorStore& centroids() const { return centroids_; }
+
+    // Nearest nprobe lists for query, closest first.
+    std::vector<SearchResult> probe_lists(const float* query, size_t nprobe) const {
+        TopK lists(std::min(nprobe, nlist()));
+        scan_range(query, centroids_, 0, centroids_.size(), lists);
+        return lists.take_sorted();
+    }
+
+    std::vector<SearchResult> search(const float* query, int k, size_t nprobe,
+                                     const SearchParams& params = SearchParams()) const {
+        TopK topk(static_cast<size_t>(k));
+        std::vector<SearchResult> lists = probe_lists(query, nprobe);
+        for (size_t l = 0; l < lists.size(); l++) {
+            size_t list = static_cast<size_t>(lists[l].index);
+            scan_range(query, vectors_, offsets_[list], offsets_[list + 1], topk,
+                       params.early_abandon);
+        }
+
+        // Rows of vectors_ are in list order; map them back to base ids.
+        std::vector<SearchResult> results = topk.take_sorted();
+        for (size_t i = 0; i < results.size(); i++) results[i].index = ids_[results[i].index];
+        finalize_distances(results, params);
+        return results;
+    }
+
+    // Top k among the base ids filter allows. Probing nprobe lists of a
+    // selective filter would find few allowed rows, so the strategy follows
+    // the filter's selectivity s:
+    //  - s <= nprobe / nlist: allowed rows are fewer than the rows nprobe
+    //    lists hold, so every list is scanned (exact, and cheaper than the
+    //    unfiltered probe);
+    //  - otherwise lists are probed nearest first, at least nprobe of them
+    //    and then on until k allowed rows have been seen.
+    // Rows are tested with one bit load each; the list order decouples them
+    // from the bitset's words, so no block can be skipped here.
+    std::vector<SearchResult> search(const float* query, int k, size_t nprobe, const IdFilter& filter,
+                                     const SearchParams& params = SearchParams()) const {
+        const size_t kk = static_cast<size_t>(k);
+        TopK topk(kk);
+        if (filter.selectivity() * nlist() <= std::min(nprobe, nlist())) {
+            scan_list_filtered(query, 0, vectors_.size(), filter, topk, params);
+        }
+        else {
+            std::vector<SearchResult> lists = probe_lists(query, nlist());
+            size_t seen = 0;
+            for (size_t l = 0; l < lists.size() && (l < nprobe || seen < kk); l++) {
+                size_t list = static_cast<size_t>(lists[l].index);
+                seen += scan_list_filtered(query, offsets_[list], offsets_[list + 1], filter, topk, params);
+            }
+        }
+
+        std::vector<SearchResult> results = topk.take_sorted();
+        for (size_t i = 0; i < results.size(); i++) results[i].index = ids_[results[i].index];
+        finalize_distances(results, params);
+        return results;
+    }
+
+    // One search per query, spread over params.num_threads (one task per
+    // query on params.scheduler).
+    std::vector<std::vector<SearchResult>> search_batch(const VectorStore& queries, int k, size_t nprobe,
+                                                        const SearchParams& params = SearchParams()) const {
+        std::vector<std::vector<SearchResult>> results(queries.size());
+        parallel_ranges(queries.size(), 1, params, [&](size_t, size_t begin, size_t end) {
+            for (size_t q = begin; q < end; q++) results[q] = search(queries.row(q), k, nprobe, params);
+        });
+        return results;
+    }
+
+    std::vector<std::vector<SearchResult>> search_batch(const VectorStore& queries, int k, size_t nprobe,
+                                                        const IdFilter& filter,
+                                                        const SearchParams& params = SearchParams()) const {
+        std::vector<std::vector<SearchResult>> results(queries.size());
+        parallel_ranges(queries.size(), 1, params, [&](size_t, size_t begin, size_t end) {
+            for (size_t q = begin; q < end; q++) results[q] = search(queries.row(q), k, nprobe, filter, params);
+        });
+        return results;
+    }
+
+private:
+    // Scan rows [begin, end) of vectors_ whose base id filter allows into
+    // topk (by row); returns how many were allowed.
+    size_t scan_list_filtered(const float* query, size_t begin, size_t end, const IdFilter& filter,
+                              TopK& topk, const SearchParams& params) const {
+        const DistanceKernel& kernel = active_kernel();
+        const size_t dim = vectors_.dim();
+        size_t allowed = 0;
+        for (size_t i = begin; i < end; i++) {
+            if (!filter.allows(static_cast<size_t>(ids_[i]))) continue;
+            allowed++;
+            topk.push(static_cast<int>(i), params.early_abandon
+                                               ? kernel.bounded(query, vectors_.row(i), dim, topk.threshold())
+                                               : kernel.distance(query, vectors_.row(i), dim));
+        }
+        SEARCH_PROFILE_COUNT(kCountDistances, allowed);
+        return allowed;
+    }
+
+    VectorStore centroids_;
+    VectorStore vectors_;          // base vectors grouped by list
+    FlatArray<int> ids_;           // base id of each row of vectors_
+    FlatArray<size_t> offsets_;    // list l occupies rows [offsets_[l], offsets_[l + 1])
+};
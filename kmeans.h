@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "distance.h"
+#include "search.h"
+#include "vector_store.h"
+
+// Options for k-means training.
+struct KMeansParams {
+    int iterations = 20;
+    unsigned seed = 1234;
+    int num_threads = 1;
+};
+
+// Index of the centroid nearest to v under dist_fn (by default the active
+// metric's kernel).
+inline size_t nearest_centroid(const float* v, const VectorStore& centroids,
+                               DistanceFn dist_fn = active_kernel().distance) {
+    size_t best = 0;
+    float best_dist = dist_fn(v, centroids.row(0), centroids.dim());
+    for (size_t c = 1; c < centroids.size(); c++) {
+        float dist = dist_fn(v, centroids.row(c), centroids.dim());
+        if (dist < best_dist) {
+            best_dist = dist;
+            best = c;
+        }
+    }
+    return best;
+}
+
+// assignment[i] = nearest_centroid(data.row(i)) for every row, in parallel.
+inline void assign_to_centroids(const VectorStore& data, const VectorStore& centroids,
+                                int num_threads, std::vector<size_t>& assignment,
+                                DistanceFn dist_fn = active_kernel().distance) {
+    assignment.resize(data.size());
+    parallel_for(data.size(), num_threads, [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) assignment[i] = nearest_centroid(data.row(i), centroids, dist_fn);
+    });
+}
+
+// Lloyd's k-means on data. Centroids start from distinct random rows; an
+// empty cluster takes over half of the largest one by copying its centroid
+// with a small symmetric perturbation (as in FAISS). Training always
+// minimizes squared L2, whatever the search metric.
+inline VectorStore kmeans(const VectorStore& data, size_t k, const KMeansParams& params = KMeansParams()) {
+    const size_t n = data.size();
+    const size_t dim = data.dim();
+    k = std::min(k, n);
+    VectorStore centroids(dim, k);
+    if (k == 0) return centroids;
+
+    std::mt19937 rng(params.seed);
+    std::vector<size_t> perm(n);
+    for (size_t i = 0; i < n; i++) perm[i] = i;
+    for (size_t c = 0; c < k; c++) {
+        std::uniform_int_distribution<size_t> pick(c, n - 1);
+        std::swap(perm[c], perm[pick(rng)]);
+        std::memcpy(centroids.row(c), data.row(perm[c]), dim * sizeof(float));
+    }
+
+    std::vector<size_t> assignment;
+    std::vector<double> sums(k * dim);
+    std::vector<size_t> counts(k);
+    for (int iter = 0; iter < params.iterations; iter++) {
+        assign_to_centroids(data, centroids, params.num_threads, assignment, active_kernel().l2);
+
+        std::fill(sums.begin(), sums.end(), 0.0);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t i = 0; i < n; i++) {
+            const float* v = data.row(i);
+            double* sum = &sums[assignment[i] * dim];
+            for (size_t d = 0; d < dim; d++) sum[d] += v[d];
+            counts[assignment[i]]++;
+        }
+
+        for (size_t c = 0; c < k; c++) {
+            if (counts[c] == 0) continue;
+            float* centroid = centroids.row(c);
+            for (size_t d = 0; d < dim; d++) {
+                centroid[d] = static_cast<float>(sums[c * dim + d] / counts[c]);
+            }
+        }
+
+        for (size_t c = 0; c < k; c++) {
+            if (counts[c] != 0) continue;
+            size_t largest = static_cast<size_t>(
+                std::max_element(counts.begin(), counts.end()) - counts.begin());
+            float* dst = centroids.row(c);
+            float* src = centroids.row(largest);
+            const float eps = 1.0f / 1024.0f;
+            for (size_t d = 0; d < dim; d++) {
+                float sign = (d % 2 == 0) ? 1.0f : -1.0f;
+                dst[d] = src[d] * (1.0f + sign * eps);
+                src[d] = src[d] * (1.0f - sign * eps);
+            }
+            counts[c] = counts[largest] / 2;
+            counts[largest] -= counts[c];
+        }
+    }
+    return centroids;
+}
+
+// Copy up to sample_size distinct random rows of data into a new store.
+inline VectorStore sample_rows(const VectorStore& data, size_t sample_size, unsigned seed) {
+    const size_t n = data.size();
+    if (sample_size >= n) sample_size = n;
+    std::mt19937 rng(seed);
+    std::vector<size_t> perm(n);
+    for (size_t i = 0; i < n; i++) perm[i] = i;
+    VectorStore sample(data.dim(), sample_size);
+    for (size_t i = 0; i < sample_size; i++) {
+        std::uniform_int_distribution<size_t> pick(i, n - 1);
+        std::swap(perm[i], perm[pick(rng)]);
+        std::memcpy(sample.row(i), data.row(perm[i]), data.dim() * sizeof(float));
+    }
+    return sample;
+}
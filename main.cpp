@@ -1,183 +1,927 @@
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <string>
-#include <cmath>
-#include <algorithm>
-#include <queue>
+#include <sstream>
 #include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <csignal>
+#include <atomic>
 
-using namespace std;
+#include "distance.h"
+#include "gemm_search.h"
+#include "gpu_search.h"
+#include "groundtruth.h"
+#include "hnsw_index.h"
+#include "ivf_index.h"
+#include "pq_index.h"
+#include "quantized_store.h"
+#include "mapped_file.h"
+#include "numa.h"
+#include "parallel_loader.h"
+#include "range_search.h"
+#include "search.h"
+#include "segmented_store.h"
+#include "server.h"
+#include "snapshot.h"
+#include "streaming.h"
+#include "vector_store.h"
 
-// Read vectors from .fvecs binary file
-// Format: [dim (4 bytes)] [float values (dim × 4 bytes)] repeated
-vector<vector<float>> read_fvecs(const string& filename, int max_vectors = -1) {
-    ifstream file(filename, ios::binary);
-    if (!file) {
-        cerr << "Error: Cannot open file " << filename << endl;
-        return {};
-    }
-    
-    vector<vector<float>> vectors;
-    int count = 0;
-    
-    while (file.peek() != EOF) {
-        if (max_vectors > 0 && count >= max_vectors) {
-            break;
-        }
-        
-        int dim;
-        file.read(reinterpret_cast<char*>(&dim), sizeof(int));
-        if (!file) break;
-        
-        vector<float> vec(dim);
-        file.read(reinterpret_cast<char*>(vec.data()), dim * sizeof(float));
-        if (!file) break;
-        
-        vectors.push_back(vec);
-        count++;
-    }
-    
-    file.close();
-    return vectors;
-}
+using namespace std;
 
-// Compute L2 (Euclidean) distance between two vectors
-// Formula: sqrt(sum of (a[i] - b[i])^2)
-float l2_distance(const vector<float>& a, const vector<float>& b) {
-    if (a.size() != b.size()) {
-        cerr << "Error: Vectors have different dimensions!" << endl;
-        return -1.0f;
-    }
-    
-    float sum = 0.0f;
-    for (size_t i = 0; i < a.size(); i++) {
-        float diff = a[i] - b[i];
-        sum += diff * diff;
-    }
+int main(int argc, char* argv[]) {
+    cout << "========================================" << endl;
+    cout << "Brute Force Vector Search Demo" << endl;
+    cout << "========================================" << endl;
     
-    return sqrt(sum);
-}
-
-// Search result: index and distance
-struct SearchResult {
-    int index;
-    float distance;
+    int NUM_BASE_VECTORS = 100;  // Default
+    bool count_given = false;
+    int NUM_QUERIES = 1;         // 0 = every query in the file
+    const int K = 10;
+    string engine = "scan";
+    string storage = "f32";
+    IvfParams ivf_params;
+    size_t nprobe = 8;
+    HnswParams hnsw_params;
+    size_t ef_search = 64;
+    PqParams pq_params;
+    size_t rerank = 0;
+    bool use_mmap = false;
+    bool stream = false;
+    int delete_every = 0;
+    int filter_every = 0;
+    bool range = false;
+    float radius = 0.0f;
+    string serve_address;
+    string connect_address;
+    int batch_window_us = 200;
+    size_t max_batch = 64;
+    bool work_stealing = false;
+    bool numa = false;
+    bool generic_kernel = false;
+    Metric metric = kMetricL2;
+    size_t chunk_mb = 64;
+    bool eval_recall = false;
+    string base_file = "sift_base.fvecs";
+    string query_file = "sift_query.fvecs";
+    string groundtruth_file = "sift_groundtruth.ivecs";
+    string snapshot_file;
+    string save_snapshot_file;
+    bool reorder_dims = false;
+    int load_threads = 0;
+    int max_gpus = -1;   // --gpus; -1 when not given
+    bool index_options = false;   // any of --nlist ... --rerank given
+    bool kernel_given = false;
+    MapOptions map_options;
+    SearchParams params;
     
-    bool operator>(const SearchResult& other) const {
-        return distance > other.distance;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--mmap") {
+            use_mmap = true;
+        }
+        else if (arg == "--hugepages") {
+            use_mmap = true;
+            map_options.hugepages = true;
+        }
+        else if (arg == "--recall") {
+            eval_recall = true;
+        }
+        else if (arg == "--groundtruth" && i + 1 < argc) {
+            groundtruth_file = argv[++i];
+            eval_recall = true;
+        }
+        else if (arg == "--base" && i + 1 < argc) {
+            base_file = argv[++i];
+        }
+        else if (arg == "--delete-every" && i + 1 < argc) {
+            delete_every = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--radius" && i + 1 < argc) {
+            range = true;
+            radius = static_cast<float>(atof(argv[++i]));
+        }
+        else if (arg == "--filter-every" && i + 1 < argc) {
+            filter_every = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--serve" && i + 1 < argc) {
+            serve_address = argv[++i];
+        }
+        else if (arg == "--connect" && i + 1 < argc) {
+            connect_address = argv[++i];
+        }
+        else if (arg == "--batch-window-us" && i + 1 < argc) {
+            batch_window_us = max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--max-batch" && i + 1 < argc) {
+            max_batch = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--metric" && i + 1 < argc) {
+            string name = argv[++i];
+            if (!parse_metric(name, metric)) {
+                cerr << "Error: Unknown metric '" << name << "' (expected l2, ip or cosine)" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--generic-kernel") {
+            generic_kernel = true;
+        }
+        else if (arg == "--numa") {
+            numa = true;
+        }
+        else if (arg == "--work-stealing") {
+            work_stealing = true;
+        }
+        else if (arg == "--stream") {
+            stream = true;
+        }
+        else if (arg == "--chunk-mb" && i + 1 < argc) {
+            chunk_mb = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--snapshot" && i + 1 < argc) {
+            snapshot_file = argv[++i];
+        }
+        else if (arg == "--save-snapshot" && i + 1 < argc) {
+            save_snapshot_file = argv[++i];
+        }
+        else if (arg == "--query-file" && i + 1 < argc) {
+            query_file = argv[++i];
+        }
+        else if (arg == "--squared") {
+            params.squared = true;
+        }
+        else if (arg == "--early-abandon") {
+            params.early_abandon = true;
+        }
+        else if (arg == "--reorder-dims") {
+            reorder_dims = true;
+        }
+        else if (arg == "--gpus" && i + 1 < argc) {
+            max_gpus = max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--load-threads" && i + 1 < argc) {
+            load_threads = max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            params.num_threads = atoi(argv[++i]);
+            if (params.num_threads < 0) {
+                cerr << "Error: Invalid thread count. Using 1." << endl;
+                params.num_threads = 1;
+            }
+        }
+        else if (arg == "--queries" && i + 1 < argc) {
+            NUM_QUERIES = atoi(argv[++i]);
+            if (NUM_QUERIES < 0) {
+                cerr << "Error: Invalid query count. Using 1." << endl;
+                NUM_QUERIES = 1;
+            }
+        }
+        else if (arg == "--engine" && i + 1 < argc) {
+            engine = argv[++i];
+            if (engine != "scan" && engine != "gemm" && engine != "gpu" && engine != "ivf" && engine != "hnsw" &&
+                engine != "pq") {
+                cerr << "Error: Unknown engine '" << engine << "' (expected scan, gemm, gpu, ivf, hnsw or pq)" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--storage" && i + 1 < argc) {
+            storage = argv[++i];
+            if (storage != "f32" && storage != "u8" && storage != "f16") {
+                cerr << "Error: Unknown storage '" << storage << "' (expected f32, u8 or f16)" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--nlist" && i + 1 < argc) {
+            ivf_params.nlist = max(1, atoi(argv[++i]));
+            index_options = true;
+        }
+        else if (arg == "--nprobe" && i + 1 < argc) {
+            nprobe = max(1, atoi(argv[++i]));
+            index_options = true;
+        }
+        else if (arg == "--M" && i + 1 < argc) {
+            hnsw_params.M = max(2, atoi(argv[++i]));
+            index_options = true;
+        }
+        else if (arg == "--ef-construction" && i + 1 < argc) {
+            hnsw_params.ef_construction = max(1, atoi(argv[++i]));
+            index_options = true;
+        }
+        else if (arg == "--ef-search" && i + 1 < argc) {
+            ef_search = max(1, atoi(argv[++i]));
+            index_options = true;
+        }
+        else if (arg == "--pq-m" && i + 1 < argc) {
+            pq_params.m = max(1, atoi(argv[++i]));
+            index_options = true;
+        }
+        else if (arg == "--rerank" && i + 1 < argc) {
+            rerank = max(0, atoi(argv[++i]));
+            index_options = true;
+        }
+        else if (arg == "--kernel" && i + 1 < argc) {
+            string name = argv[++i];
+            kernel_given = true;
+            if (!set_kernel(name)) {
+                cerr << "Error: Distance kernel '" << name << "' is not available on this CPU" << endl;
+                return 1;
+            }
+        }
+        else if (arg[0] == '-') {
+            cerr << "Error: Unknown option " << arg << endl;
+            cerr << "Usage: " << argv[0]
+                 << " [num_vectors] [--mmap] [--hugepages] [--kernel scalar|avx2|avx512|neon]"
+                 << " [--squared] [--threads N] [--load-threads N] [--queries N] [--engine scan|gemm|gpu|ivf|hnsw|pq]"
+                 << " [--storage f32|u8|f16] [--early-abandon] [--reorder-dims] [--nlist N] [--nprobe N]"
+                 << " [--M N] [--ef-construction N] [--ef-search N] [--pq-m N] [--rerank N]"
+                 << " [--base FILE] [--query-file FILE] [--recall] [--groundtruth FILE]"
+                 << " [--snapshot FILE] [--save-snapshot FILE] [--stream] [--chunk-mb N]"
+                 << " [--delete-every N] [--serve ADDR] [--connect ADDR] [--batch-window-us N]"
+                 << " [--max-batch N] [--work-stealing] [--numa]"
+                 << " [--generic-kernel] [--metric l2|ip|cosine] [--filter-every N] [--radius R] [--gpus N]" << endl;
+            return 1;
+        }
+        else {
+            NUM_BASE_VECTORS = atoi(arg.c_str());
+            count_given = true;
+            if (NUM_BASE_VECTORS <= 0) {
+                cerr << "Error: Invalid number of vectors. Using default (100)." << endl;
+                NUM_BASE_VECTORS = 100;
+            }
+        }
     }
     
-    bool operator<(const SearchResult& other) const {
-        return distance < other.distance;
+    if (!serve_address.empty() && stream) {
+        cerr << "Error: --serve needs a resident database; it cannot be combined with --stream" << endl;
+        return 1;
+    }
+    // A client (--connect) sends the queries to a server and loads no database.
+    const bool remote = !connect_address.empty();
+    const bool no_database = stream || remote;
+    // --metric and --squared are checked against the server per request;
+    // everything else that shapes the search is the server's.
+    if (remote && (!serve_address.empty() || stream || reorder_dims || delete_every > 0 ||
+                   !snapshot_file.empty() || !save_snapshot_file.empty() || engine != "scan" ||
+                   storage != "f32" || use_mmap || load_threads != 0 || numa || work_stealing ||
+                   generic_kernel || kernel_given || params.early_abandon || index_options)) {
+        cerr << "Error: --connect only sends queries; database, engine, storage, kernel, index and"
+             << " snapshot options (--engine, --storage, --mmap, --numa, --work-stealing, --kernel,"
+             << " --early-abandon, --nprobe, ...) belong to the --serve side" << endl;
+        return 1;
     }
-};
-
-// Brute force k-NN search: compares query to every vector in database
-// Time Complexity: O(n * d) where n = vectors, d = dimensions
-vector<SearchResult> brute_force_search(
-    const vector<float>& query,
-    const vector<vector<float>>& database,
-    int k) {
     
-    // Use max-heap to keep top k nearest neighbors
-    priority_queue<SearchResult, vector<SearchResult>, less<SearchResult>> max_heap;
+    if (max_gpus >= 0 && engine != "gpu") {
+        cerr << "Error: --gpus shards the database for the GPU engine; it works with --engine gpu only" << endl;
+        return 1;
+    }
+    if (storage != "f32" && engine != "scan") {
+        cerr << "Error: --storage " << storage << " stores the database for the brute-force scan;"
+             << " it works with the default scan engine only" << endl;
+        return 1;
+    }
+    if (delete_every > 0 && (engine != "scan" || storage != "f32" || stream)) {
+        cerr << "Error: --delete-every works with the default scan engine only" << endl;
+        return 1;
+    }
+    const bool filtered = filter_every > 0;
+    if (filtered && ((engine != "scan" && engine != "ivf" && engine != "hnsw") || storage != "f32" || stream ||
+                     remote || numa || delete_every > 0)) {
+        cerr << "Error: --filter-every works with the f32 scan, ivf and hnsw engines only"
+             << " (no --storage, --stream, --connect, --numa or --delete-every)" << endl;
+        return 1;
+    }
+    if (range && (engine != "scan" || storage != "f32" || stream || remote || !serve_address.empty() || numa ||
+                  delete_every > 0 || filtered)) {
+        cerr << "Error: --radius runs the f32 brute-force scan; it works with the default scan engine only"
+             << " (no --storage, --stream, --serve, --connect, --numa, --delete-every or --filter-every)" << endl;
+        return 1;
+    }
+    if (numa && (engine != "scan" || storage != "f32" || stream || delete_every > 0 || work_stealing)) {
+        cerr << "Error: --numa shards the flat f32 scan; it works with the default scan engine only"
+             << " (no --storage, --stream, --delete-every or --work-stealing)" << endl;
+        return 1;
+    }
+    if (metric != kMetricL2 && storage != "f32") {
+        cerr << "Error: --metric " << metric_name(metric) << " needs f32 storage; the u8 and f16"
+             << " kernels compute L2 only" << endl;
+        return 1;
+    }
+    if (metric == kMetricCosine && stream) {
+        cerr << "Error: --metric cosine normalizes the database at load time; it cannot be"
+             << " combined with --stream (use --metric ip on pre-normalized data)" << endl;
+        return 1;
+    }
+    set_metric(metric);
     
-    cout << "\n[Search Progress]" << endl;
-    cout << "Comparing query vector against " << database.size() << " vectors..." << endl;
+    if (stream && (engine != "scan" || storage != "f32" || use_mmap || reorder_dims || work_stealing ||
+                   !snapshot_file.empty() || !save_snapshot_file.empty())) {
+        cerr << "Error: --stream scans the base file directly; it works with the default"
+             << " scan engine only (no --storage, --mmap, --reorder-dims, --work-stealing or snapshots)" << endl;
+        return 1;
+    }
     
-    for (size_t i = 0; i < database.size(); i++) {
-        float dist = l2_distance(query, database[i]);
-        
-        if (max_heap.size() < static_cast<size_t>(k)) {
-            max_heap.push({static_cast<int>(i), dist});
+    cout << "\n[Step 1] Loading database vectors..." << endl;
+    VectorStore database;
+    unique_ptr<Uint8Store> u8_store;
+    unique_ptr<Snapshot> snapshot;
+    Metric snapshot_metric = kMetricL2;
+    if (remote) {
+        cout << "Sending queries to the server at " << connect_address << endl;
+    }
+    else if (stream) {
+        cout << "Streaming " << (count_given ? "first " + to_string(NUM_BASE_VECTORS) : string("all"))
+             << " vectors of " << base_file << " in " << chunk_mb << " MB chunks (double-buffered)" << endl;
+    }
+    else if (!snapshot_file.empty()) {
+        auto map_start = chrono::steady_clock::now();
+        // Index sections are read at random; only the flat scan streams.
+        MapOptions snapshot_options = map_options;
+        snapshot_options.sequential = engine == "scan" || engine == "gemm" || engine == "gpu";
+        snapshot.reset(new Snapshot());
+        if (!snapshot->open(snapshot_file, snapshot_options) || !snapshot->vectors("vectors", database)) {
+            cerr << "Failed to load snapshot " << snapshot_file << endl;
+            return 1;
         }
-        else if (dist < max_heap.top().distance) {
-            max_heap.pop();
-            max_heap.push({static_cast<int>(i), dist});
+        double map_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - map_start).count();
+        cout << "Mapped snapshot " << snapshot_file << " in " << map_ms << " ms" << endl;
+        // Indexes are built for one metric and cosine vectors are saved
+        // normalized, so a snapshot is only searched with its own metric.
+        if (snapshot->has("metric")) {
+            FlatArray<uint32_t> saved_metric;
+            if (!snapshot->array("metric", saved_metric) || saved_metric.size() != 1 ||
+                saved_metric[0] > static_cast<uint32_t>(kMetricCosine)) {
+                cerr << "Error: Snapshot " << snapshot_file << " has an invalid metric section" << endl;
+                return 1;
+            }
+            snapshot_metric = static_cast<Metric>(saved_metric[0]);
         }
-        
-        if (database.size() >= 10 && (i + 1) % (database.size() / 10) == 0) {
-            cout << "  Progress: " << (i + 1) << "/" << database.size() << " vectors" << endl;
+        if (snapshot_metric != metric) {
+            cerr << "Error: Snapshot " << snapshot_file << " was saved with --metric "
+                 << metric_name(snapshot_metric) << "; it cannot be searched with --metric "
+                 << metric_name(metric) << endl;
+            return 1;
         }
     }
+    else {
+        bool byte_base = base_file.size() > 6 && base_file.compare(base_file.size() - 6, 6, ".bvecs") == 0;
+        // The bytes of a .bvecs file are already uint8 codes: load (or map)
+        // them directly instead of widening to floats and quantizing back.
+        const bool direct_u8 = byte_base && storage == "u8" && engine == "scan" && metric == kMetricL2 &&
+                               save_snapshot_file.empty() && !reorder_dims && delete_every == 0 && !numa;
+        if (use_mmap && byte_base && !direct_u8) {
+            cerr << "Note: --mmap maps a .bvecs file only as u8 codes (--storage u8 with the scan engine);"
+                 << " reading " << base_file << " into memory" << endl;
+            use_mmap = false;
+        }
+        cout << "Reading first " << NUM_BASE_VECTORS << " vectors from " << base_file;
+        cout << (use_mmap ? " (mmap)" : "") << (direct_u8 ? " as u8 codes" : "") << endl;
     
-    // Extract and reverse to get closest-first order
-    vector<SearchResult> results;
-    while (!max_heap.empty()) {
-        results.push_back(max_heap.top());
-        max_heap.pop();
-    }
-    reverse(results.begin(), results.end());
-    
-    return results;
-}
-
-int main(int argc, char* argv[]) {
-    cout << "========================================" << endl;
-    cout << "Brute Force Vector Search Demo" << endl;
-    cout << "========================================" << endl;
-    
-    int NUM_BASE_VECTORS = 100;  // Default
-    const int K = 10;
-    
-    if (argc > 1) {
-        NUM_BASE_VECTORS = atoi(argv[1]);
-        if (NUM_BASE_VECTORS <= 0) {
-            cerr << "Error: Invalid number of vectors. Using default (100)." << endl;
-            NUM_BASE_VECTORS = 100;
+        auto load_start = chrono::steady_clock::now();
+        if (use_mmap && direct_u8) {
+            Uint8Store codes = map_bvecs(base_file, NUM_BASE_VECTORS, map_options);
+            if (codes.size() > 0) u8_store.reset(new Uint8Store(std::move(codes)));
+        }
+        else if (use_mmap) {
+            database = map_fvecs(base_file, NUM_BASE_VECTORS, map_options);
+        }
+        else if (direct_u8) {
+            Uint8Store codes = parallel_read_bvecs_u8(base_file, NUM_BASE_VECTORS, load_threads);
+            if (codes.size() > 0) u8_store.reset(new Uint8Store(std::move(codes)));
+        }
+        else {
+            database = parallel_read_vecs(base_file, NUM_BASE_VECTORS, load_threads);
+        }
+        double load_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - load_start).count();
+        if (!use_mmap && (u8_store || !database.empty())) {
+            cout << " Read in " << load_ms << " ms on "
+                 << parallel_thread_count(u8_store ? u8_store->size() : database.size(), load_threads)
+                 << " thread(s)" << endl;
         }
     }
+    // With a direct u8 load the float store stays empty.
+    const size_t db_rows = u8_store ? u8_store->size() : database.size();
+    const size_t db_dim = u8_store ? u8_store->dim() : database.dim();
     
-    cout << "\n[Step 1] Loading database vectors..." << endl;
-    cout << "Reading first " << NUM_BASE_VECTORS << " vectors from sift_base.fvecs" << endl;
-    
-    auto database = read_fvecs("sift_base.fvecs", NUM_BASE_VECTORS);
-    
-    if (database.empty()) {
+    if (!no_database && db_rows == 0) {
         cerr << "Failed to load database vectors!" << endl;
         return 1;
     }
     
-    cout << " Loaded " << database.size() << " vectors" << endl;
-    cout << " Each vector has " << database[0].size() << " dimensions" << endl;
+    if (!no_database) {
+        cout << " Loaded " << db_rows << " vectors" << endl;
+        cout << " Each vector has " << db_dim << " dimensions" << endl;
+    }
     
     cout << "\n[Step 2] Loading query vector..." << endl;
-    cout << "Reading first query from sift_query.fvecs" << endl;
+    if (NUM_QUERIES == 1) {
+        cout << "Reading first query from " << query_file << endl;
+    }
+    else if (NUM_QUERIES == 0) {
+        cout << "Reading all queries from " << query_file << endl;
+    }
+    else {
+        cout << "Reading first " << NUM_QUERIES << " queries from " << query_file << endl;
+    }
     
-    auto queries = read_fvecs("sift_query.fvecs", 1);
+    auto queries = read_vecs(query_file, NUM_QUERIES == 0 ? -1 : NUM_QUERIES);
     
     if (queries.empty()) {
         cerr << "Failed to load query vector!" << endl;
         return 1;
     }
     
-    vector<float> query = queries[0];
-    cout << " Loaded query vector (dimension: " << query.size() << ")" << endl;
+    if (!no_database && queries.dim() != db_dim) {
+        cerr << "Error: Query and database dimensions differ!" << endl;
+        return 1;
+    }
+    
+    const float* query = queries.row(0);
+    cout << " Loaded " << queries.size() << " query vector(s) (dimension: " << queries.dim() << ")" << endl;
     
     cout << "  First 5 values: [";
-    for (int i = 0; i < 5 && i < static_cast<int>(query.size()); i++) {
+    for (int i = 0; i < 5 && i < static_cast<int>(queries.dim()); i++) {
         cout << query[i];
         if (i < 4) cout << ", ";
     }
     cout << ", ...]" << endl;
     
-    cout << "\n[Step 3] Performing brute force search..." << endl;
+    if (metric == kMetricCosine && !remote) {
+        // Unit-length rows turn cosine into a dot product. A cosine snapshot
+        // was saved normalized.
+        const bool saved_normalized = snapshot_metric == kMetricCosine;
+        if (!saved_normalized) normalize_rows(database);
+        normalize_rows(queries);
+        cout << " Normalized " << (saved_normalized ? "queries" : "database and queries")
+             << " for cosine similarity" << endl;
+    }
+    
+    // Stand-in for a tenant or category allow-list: every Nth vector.
+    IdFilter filter;
+    if (filtered) {
+        filter = IdFilter(database.size());
+        for (size_t i = 0; i < database.size(); i += filter_every) filter.allow(i);
+        cout << " Filter allows " << filter.count() << " of " << database.size() << " vectors (every "
+             << filter_every << "th)" << endl;
+    }
+    
+    vector<size_t> dim_order;
+    if (snapshot && snapshot->has("dim_order")) {
+        // The snapshot was saved with --reorder-dims; queries must follow.
+        FlatArray<size_t> order;
+        snapshot->array("dim_order", order);
+        dim_order.assign(order.begin(), order.end());
+        permute_dims(queries, dim_order);
+        cout << " Applied the snapshot's dimension order to the queries" << endl;
+    }
+    else if (reorder_dims && snapshot) {
+        cerr << "Note: --reorder-dims ignored; snapshot " << snapshot_file << " was saved without it" << endl;
+    }
+    else if (reorder_dims) {
+        dim_order = variance_dim_order(database);
+        permute_dims(database, dim_order);
+        permute_dims(queries, dim_order);
+        cout << " Reordered dimensions by decreasing variance" << endl;
+    }
+    
+    // The dimension is fixed from here on: pick the kernel unrolled for it.
+    if (!remote && !generic_kernel && specialize_kernels(queries.dim())) {
+        cout << " Using " << active_kernel().name << " kernel specialized for dimension "
+             << queries.dim() << endl;
+    }
+    
+    string engine_label = remote ? "remote" : engine == "ivf" ? "IVF" : engine == "hnsw" ? "HNSW"
+                        : engine == "pq" ? "PQ" : engine == "gpu" ? "GPU brute force" : "brute force";
+    cout << "\n[Step 3] Performing " << engine_label << " search..." << endl;
     cout << "Finding top " << K << " nearest neighbors" << endl;
     
-    auto results = brute_force_search(query, database, K);
+    // This thread runs its own tasks too, so threads - 1 workers keep
+    // --threads cores busy.
+    unique_ptr<TaskScheduler> scheduler;
+    if (work_stealing && !remote) {
+        scheduler.reset(new TaskScheduler(static_cast<size_t>(max(1, resolve_thread_count(params.num_threads) - 1))));
+        params.scheduler = scheduler.get();
+        cout << "Work-stealing scheduler: " << scheduler->num_workers() << " worker(s) plus the caller" << endl;
+    }
+    
+    unique_ptr<GemmSearchEngine> gemm;
+    unique_ptr<GpuSearchEngine> gpu;
+    unique_ptr<IvfIndex> ivf;
+    unique_ptr<HnswIndex> hnsw;
+    unique_ptr<PqIndex> pq;
+    unique_ptr<Float16Store> f16_store;
+    unique_ptr<SegmentedStore> segmented;
+    unique_ptr<NumaShardedStore> numa_store;
+    if (remote) {
+        cout << "Searching on the server at " << connect_address << " over "
+             << parallel_thread_count(queries.size(), params.num_threads) << " connection(s)" << endl;
+    }
+    else if (delete_every > 0) {
+        // Exercise the updatable store: insert everything, tombstone every
+        // Nth vector, then reclaim the deleted slots.
+        auto insert_start = chrono::steady_clock::now();
+        segmented.reset(new SegmentedStore(database.dim(), max<size_t>(1024, database.size() / 16)));
+        for (size_t i = 0; i < database.size(); i++) segmented->insert(database.row(i));
+        double insert_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - insert_start).count();
+        auto delete_start = chrono::steady_clock::now();
+        size_t deleted = 0;
+        for (size_t i = 0; i < database.size(); i += delete_every) deleted += segmented->remove(static_cast<int>(i));
+        double delete_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - delete_start).count();
+        auto compact_start = chrono::steady_clock::now();
+        size_t reclaimed = segmented->compact(0.0);
+        double compact_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - compact_start).count();
+        cout << "Distance kernel: " << active_kernel().name << endl;
+        cout << "Segmented store: inserted " << database.size() << " vectors in " << insert_ms << " ms, deleted "
+             << deleted << " (every " << delete_every << "th) in " << delete_ms << " ms, compaction reclaimed "
+             << reclaimed << " slots in " << compact_ms << " ms; " << segmented->size() << " live in "
+             << segmented->num_segments() << " segment(s)" << endl;
+    }
+    else if (numa) {
+        auto shard_start = chrono::steady_clock::now();
+        numa_store.reset(new NumaShardedStore(NumaShardedStore::from(database)));
+        double shard_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - shard_start).count();
+        cout << "Distance kernel: " << active_kernel().name << endl;
+        cout << "Sharded database over " << numa_store->shards().size() << " NUMA node(s) in " << shard_ms << " ms:";
+        const vector<size_t> shard_threads = numa_store->threads_per_shard(params.num_threads);
+        for (size_t s = 0; s < numa_store->shards().size(); s++) {
+            const NumaShardedStore::Shard& shard = numa_store->shards()[s];
+            cout << (s ? ";" : "") << " node " << shard.node.id << " rows " << shard.first << "-"
+                 << shard.first + shard.rows.size() << ", " << shard_threads[s] << " thread(s) on "
+                 << shard.node.cpus.size() << " CPU(s)" << (shard.bound ? ", mbind" : ", first touch");
+        }
+        cout << endl;
+    }
+    else if (u8_store) {
+        cout << "Distance kernel: " << quantized_kernels().u8_name << endl;
+        cout << "Loaded database as u8 codes (" << u8_store->codes.bytes() / (1024.0 * 1024.0)
+             << " MB), no float copy" << endl;
+    }
+    else if (engine == "scan" && storage != "f32") {
+        auto convert_start = chrono::steady_clock::now();
+        size_t bytes = 0;
+        string kernel;
+        if (storage == "u8") {
+            u8_store.reset(new Uint8Store(Uint8Store::from(database)));
+            bytes = u8_store->codes.bytes();
+            kernel = quantized_kernels().u8_name;
+        }
+        else {
+            f16_store.reset(new Float16Store(Float16Store::from(database)));
+            bytes = f16_store->codes.bytes();
+            kernel = quantized_kernels().f16_name;
+        }
+        double convert_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - convert_start).count();
+        cout << "Distance kernel: " << kernel << endl;
+        cout << "Converted database to " << storage << " (" << bytes / (1024.0 * 1024.0) << " MB vs "
+             << database.size() * database.stride() * sizeof(float) / (1024.0 * 1024.0) << " MB) in "
+             << convert_ms << " ms" << endl;
+    }
+    else if (engine == "gemm") {
+        auto norms_start = chrono::steady_clock::now();
+        FlatArray<float> norms;
+        bool mapped = snapshot && snapshot->has("norms") && snapshot->array("norms", norms) &&
+                      norms.size() == database.size();
+        gemm.reset(mapped ? new GemmSearchEngine(database, std::move(norms)) : new GemmSearchEngine(database));
+        double norms_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - norms_start).count();
+        cout << "GEMM engine (" << gemm->backend() << "), database norms "
+             << (mapped ? "mapped from snapshot" : "computed") << " in " << norms_ms << " ms" << endl;
+    }
+    else if (engine == "gpu") {
+        auto upload_start = chrono::steady_clock::now();
+        gpu.reset(new GpuSearchEngine(database, max(0, max_gpus)));
+        if (!gpu->ok()) {
+            cerr << "Failed to place the database on the GPU(s)" << endl;
+            return 1;
+        }
+        double upload_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - upload_start).count();
+        cout << "GPU engine: database sharded over " << gpu->num_devices() << " device(s) in " << upload_ms
+             << " ms:";
+        for (int d = 0; d < gpu->num_devices(); d++) cout << (d ? ";" : "") << " " << gpu->shard_description(d);
+        cout << endl;
+    }
+    else if (engine == "ivf") {
+        cout << "Distance kernel: " << active_kernel().name << endl;
+        auto build_start = chrono::steady_clock::now();
+        ivf_params.kmeans.num_threads = params.num_threads;
+        ivf.reset(new IvfIndex());
+        bool loaded = snapshot && snapshot->has("ivf.vectors");
+        if (loaded && !ivf->load(*snapshot)) {
+            return 1;
+        }
+        if (!loaded) {
+            ivf->build(database, ivf_params);
+        }
+        double build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - build_start).count();
+        cout << (loaded ? "Loaded" : "Built") << " IVF index (nlist=" << ivf->nlist() << ") in " << build_ms << " ms, probing "
+             << min(nprobe, ivf->nlist()) << " lists per query" << endl;
+    }
+    else if (engine == "hnsw") {
+        cout << "Distance kernel: " << active_kernel().name << endl;
+        auto build_start = chrono::steady_clock::now();
+        hnsw_params.num_threads = params.num_threads;
+        hnsw.reset(new HnswIndex());
+        bool loaded = snapshot && snapshot->has("hnsw.graph");
+        if (loaded && !hnsw->load(*snapshot, database)) {
+            return 1;
+        }
+        if (!loaded) {
+            hnsw->build(database, hnsw_params);
+        }
+        double build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - build_start).count();
+        cout << (loaded ? "Loaded" : "Built") << " HNSW index (";
+        if (!loaded) cout << "M=" << hnsw_params.M << ", efConstruction=" << hnsw_params.ef_construction << ", ";
+        cout << "levels=" << (hnsw->max_level() + 1) << ") in " << build_ms << " ms, efSearch="
+             << ef_search << endl;
+    }
+    else if (engine == "pq") {
+        cout << "Distance kernel: " << active_kernel().name << endl;
+        auto build_start = chrono::steady_clock::now();
+        pq_params.kmeans.num_threads = params.num_threads;
+        pq.reset(new PqIndex());
+        bool loaded = snapshot && snapshot->has("pq.codes");
+        if (loaded ? !pq->load(*snapshot, &database) : !pq->build(database, pq_params)) {
+            return 1;
+        }
+        double build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - build_start).count();
+        cout << (loaded ? "Loaded" : "Built") << " PQ index (" << pq->code_size() << " bytes/vector vs "
+             << database.dim() * sizeof(float) << ") in " << build_ms << " ms";
+        cout << (rerank > 0 ? ", re-ranking top " + to_string(rerank) + " exactly" : string()) << endl;
+    }
+    else {
+        cout << "Distance kernel: " << active_kernel().name << endl;
+    }
+    
+    if (!save_snapshot_file.empty()) {
+        auto save_start = chrono::steady_clock::now();
+        SnapshotWriter writer;
+        writer.add_vectors("vectors", database);
+        if (!dim_order.empty()) {
+            writer.add_array("dim_order", dim_order.data(), dim_order.size());
+        }
+        // Indexes are built for one metric, and cosine vectors are saved normalized.
+        const uint32_t saved_metric = static_cast<uint32_t>(metric);
+        if (metric != kMetricL2) writer.add_array("metric", &saved_metric, 1);
+        // Norms are cheap to compute but saved anyway so GEMM starts instantly.
+        unique_ptr<GemmSearchEngine> norms_engine;
+        if (!gemm) norms_engine.reset(new GemmSearchEngine(database));
+        (gemm ? gemm : norms_engine)->save(writer);
+        if (ivf) ivf->save(writer);
+        if (hnsw) hnsw->save(writer);
+        if (pq) pq->save(writer);
+        if (!writer.write(save_snapshot_file)) {
+            return 1;
+        }
+        double save_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - save_start).count();
+        cout << "Saved snapshot " << save_snapshot_file << " in " << save_ms << " ms" << endl;
+    }
+    
+    // Every resident engine behind one batched entry point, shared by the
+    // local search below and the server's micro-batches.
+    BatchSearchFn run_batch = [&](const VectorStore& batch, int k) {
+        if (filtered) {
+            if (ivf) return ivf->search_batch(batch, k, nprobe, filter, params);
+            if (hnsw) return hnsw->search_batch(batch, k, ef_search, filter, params);
+            if (batch.size() > 1) return batch_search(batch, database, k, filter, params);
+            return vector<vector<SearchResult>>(1, brute_force_search(batch.row(0), database, k, filter, params));
+        }
+        if (gemm) return gemm->search(batch, k, params);
+        if (gpu) return gpu->search(batch, k, params);
+        if (ivf) return ivf->search_batch(batch, k, nprobe, params);
+        if (hnsw) return hnsw->search_batch(batch, k, ef_search, params);
+        if (pq) return pq->search_batch(batch, k, rerank, params);
+        if (numa_store) {
+            if (batch.size() > 1) return batch_search(batch, *numa_store, k, params);
+            return vector<vector<SearchResult>>(1, brute_force_search(batch.row(0), *numa_store, k, params));
+        }
+        if (!segmented && !u8_store && !f16_store && batch.size() > 1) return batch_search(batch, database, k, params);
+        // One query (or a store without a batched path): split the scan itself over the threads.
+        vector<vector<SearchResult>> out;
+        for (size_t q = 0; q < batch.size(); q++) {
+            out.push_back(segmented ? brute_force_search(batch.row(q), *segmented, k, params)
+                          : u8_store ? brute_force_search(batch.row(q), *u8_store, k, params)
+                          : f16_store ? brute_force_search(batch.row(q), *f16_store, k, params)
+                          : brute_force_search(batch.row(q), database, k, params));
+        }
+        return out;
+    };
+    
+    if (!serve_address.empty()) {
+        // Clients send raw queries in the file's dimension order.
+        BatchSearchFn serve_batch = run_batch;
+        if (!dim_order.empty() || metric == kMetricCosine) {
+            serve_batch = [&](const VectorStore& batch, int k) {
+                VectorStore prepared(batch.dim(), batch.size());
+                for (size_t q = 0; q < batch.size(); q++) {
+                    memcpy(prepared.row(q), batch.row(q), batch.dim() * sizeof(float));
+                }
+                if (!dim_order.empty()) permute_dims(prepared, dim_order);
+                if (metric == kMetricCosine) normalize_rows(prepared);
+                return run_batch(prepared, k);
+            };
+        }
+        QueryBatcher batcher(db_dim, serve_batch, chrono::microseconds(batch_window_us), max_batch);
+        SearchServer server(batcher, ranking_code(metric, params.squared));
+        if (!server.listen(serve_address)) {
+            return 1;
+        }
+        signal(SIGINT, [](int) { server_stop_flag().store(true); });
+        signal(SIGTERM, [](int) { server_stop_flag().store(true); });
+        cout << "\nServing " << db_rows << " vectors on " << serve_address << " (batch window "
+             << batch_window_us << " us, up to " << max_batch << " queries per batch); Ctrl-C to stop" << endl;
+        server.run();
+        cout << "\nServed " << batcher.queries() << " queries in " << batcher.batches() << " batch(es)";
+        if (batcher.batches() > 0) cout << ", " << double(batcher.queries()) / batcher.batches() << " per batch";
+        cout << endl;
+        return 0;
+    }
+    
+    if (range) {
+        // Query #0 collects its hits for display; the rest are streamed
+        // through a counting callback, which keeps memory flat however
+        // many vectors match.
+        const char* unit = metric == kMetricCosine ? "cosine similarity" : metric == kMetricInnerProduct
+                         ? "inner product" : params.squared ? "squared distance" : "distance";
+        ostringstream within;
+        if (metric == kMetricL2) within << "within " << radius << " (" << unit << ")";
+        else within << "with " << unit << " >= " << radius;
+        cout << "Range search: all vectors " << within.str() << endl;
+        auto range_start = chrono::steady_clock::now();
+        vector<SearchResult> hits = range_search(query, database, radius, params);
+        size_t streamed = 0;
+        for (size_t q = 1; q < queries.size(); q++) {
+            streamed += range_search(queries.row(q), database, radius, [](const SearchResult*, size_t) {}, params);
+        }
+        double range_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - range_start).count();
+    
+        cout << "\n[Step 4] Results!" << endl;
+        cout << "========================================" << endl;
+        cout << hits.size() << " vector(s) " << within.str() << (queries.size() > 1 ? " of query #0" : "")
+             << (hits.size() > 10 ? ", closest 10:" : ":") << endl;
+        cout << "========================================" << endl;
+        for (size_t i = 0; i < hits.size() && i < 10; i++) {
+            cout << "Hit " << (i + 1) << ": Vector #" << hits[i].index << " (" << unit << ": " << hits[i].distance
+                 << ")" << endl;
+        }
+        cout << "\nSearched " << queries.size() << " query(s) in " << range_ms << " ms";
+        cout << " (" << (queries.size() * 1000.0 / range_ms) << " QPS)";
+        if (queries.size() > 1) cout << ", " << streamed << " hit(s) streamed for the other queries";
+        cout << endl;
+        return 0;
+    }
+    
+#ifdef SEARCH_PROFILE
+    PerfCounters perf;
+    perf.start();
+#endif
+    auto start = chrono::steady_clock::now();
+    vector<vector<SearchResult>> all_results;
+    StreamStats stream_stats;
+    vector<double> latencies_ms;
+    if (stream) {
+        all_results = stream_search(base_file, queries, K, params, chunk_mb << 20,
+                                    count_given ? NUM_BASE_VECTORS : -1, &stream_stats);
+        if (stream_stats.rows == 0) {
+            cerr << "Failed to stream database vectors!" << endl;
+            return 1;
+        }
+    }
+    else if (remote) {
+        // One connection per thread, each sending its share of the queries
+        // one at a time, so the server sees concurrent single-query traffic.
+        all_results.resize(queries.size());
+        latencies_ms.resize(queries.size());
+        atomic<bool> failed(false);
+        atomic<bool> mismatch(false);
+        parallel_for(queries.size(), params.num_threads, [&](size_t, size_t begin, size_t end) {
+            SearchClient client(ranking_code(metric, params.squared));
+            if (!client.connect(connect_address)) {
+                failed = true;
+                return;
+            }
+            for (size_t q = begin; q < end; q++) {
+                auto sent = chrono::steady_clock::now();
+                if (!client.search(queries.row(q), queries.dim(), K, all_results[q])) {
+                    failed = true;
+                    if (client.status() == kStatusRankingMismatch) mismatch = true;
+                    return;
+                }
+                latencies_ms[q] = chrono::duration<double, milli>(chrono::steady_clock::now() - sent).count();
+            }
+        });
+        if (mismatch) {
+            cerr << "Error: the server at " << connect_address << " does not rank by --metric "
+                 << metric_name(metric) << (metric == kMetricL2 && params.squared ? " --squared" : "")
+                 << "; pass the --metric and --squared it was started with" << endl;
+            return 1;
+        }
+        if (failed) {
+            cerr << "Failed to search on the server at " << connect_address << endl;
+            return 1;
+        }
+    }
+    else if (queries.size() == 1 && !gemm && !gpu && !ivf && !hnsw && !pq && !segmented && !u8_store && !f16_store &&
+             !numa_store && !filtered) {
+        cout << "\n[Search Progress]" << endl;
+        cout << "Comparing query vector against " << database.size() << " vectors..." << endl;
+        params.progress = [](size_t scanned, size_t total) {
+            cout << "  Progress: " << scanned << "/" << total << " vectors" << endl;
+        };
+        params.progress_chunk = max<size_t>(1, database.size() / 10);
+        all_results.push_back(brute_force_search(query, database, K, params));
+        params.progress = ProgressCallback();
+    }
+    else {
+        if (engine == "scan" && queries.size() > 1) {
+            cout << "Batch searching " << queries.size() << " queries" << endl;
+        }
+        all_results = run_batch(queries, K);
+    }
+    double elapsed_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+#ifdef SEARCH_PROFILE
+    perf.stop();
+#endif
+    const vector<SearchResult>& results = all_results[0];
     
     cout << "\n[Step 4] Results!" << endl;
     cout << "========================================" << endl;
-    cout << "Top " << K << " Nearest Neighbors:" << endl;
+    cout << "Top " << K << " Nearest Neighbors" << (queries.size() > 1 ? " of query #0:" : ":") << endl;
     cout << "========================================" << endl;
     
+    // Without --rerank, PQ reports its ADC estimates, not exact distances.
+    const bool estimated = pq && rerank == 0;
     for (size_t i = 0; i < results.size(); i++) {
         cout << "Rank " << (i + 1) << ": ";
         cout << "Vector #" << results[i].index;
-        cout << " (distance: " << results[i].distance << ")";
+        cout << (estimated ? " (approximate " : " (")
+             << (metric == kMetricCosine ? "cosine similarity: " : metric == kMetricInnerProduct ? "inner product: "
+                 : params.squared ? "squared distance: " : "distance: ") << results[i].distance << ")";
         cout << endl;
     }
+    if (estimated) {
+        cout << "(ADC estimates from the PQ codes; --rerank N recomputes the best N exactly)" << endl;
+    }
+    
+    cout << "\nSearched " << queries.size() << " query(s) in " << elapsed_ms << " ms";
+    cout << " (" << (queries.size() * 1000.0 / elapsed_ms) << " QPS)" << endl;
+    if (stream) {
+        cout << "Streamed " << stream_stats.rows << " vectors in " << stream_stats.chunks << " chunk(s): "
+             << stream_stats.scan_ms << " ms scanning, " << stream_stats.wait_ms << " ms waiting for I/O" << endl;
+    }
+    if (remote) {
+        sort(latencies_ms.begin(), latencies_ms.end());
+        cout << "Round-trip latency: p50 " << latencies_ms[latencies_ms.size() / 2] << " ms, p99 "
+             << latencies_ms[min(latencies_ms.size() - 1, latencies_ms.size() * 99 / 100)] << " ms" << endl;
+    }
+#ifdef SEARCH_PROFILE
+    profile_report(cout, &perf);
+#endif
+    
+    if (eval_recall) {
+        // The shipped groundtruth indexes the full base file; for a
+        // truncated database fall back to exact brute force over what is loaded.
+        IdTable truth = read_ivecs(groundtruth_file, static_cast<int>(queries.size()));
+        string source = groundtruth_file;
+        const size_t db_size = stream ? stream_stats.rows : db_rows;
+        if (metric != kMetricL2 && (remote || stream)) {
+            cout << "\nGroundtruth " << groundtruth_file << " ranks by L2, not " << metric_name(metric) << ";"
+                 << (remote ? " recall needs the database, run it on the server side" : " streamed results are exact")
+                 << endl;
+            return 0;
+        }
+        if (remote && truth.size() < queries.size()) {
+            cout << "\nGroundtruth " << groundtruth_file << " does not cover the queries;"
+                 << " recall needs the database, run it on the server side" << endl;
+            return 0;
+        }
+        if (remote) {
+            cout << "Recall@" << K << ": " << recall_at_k(all_results, truth, K)
+                 << " (" << queries.size() << " queries vs " << groundtruth_file
+                 << "; assumes the server holds the database it was computed for)" << endl;
+            return 0;
+        }
+        if (stream && (truth.size() < queries.size() || !groundtruth_covers(truth, K, db_size))) {
+            cout << "\nGroundtruth " << groundtruth_file << " does not match the streamed database;"
+                 << " streamed results are exact" << endl;
+            return 0;
+        }
+        if (database.empty() && (truth.size() < queries.size() || !groundtruth_covers(truth, K, db_size))) {
+            cout << "\nGroundtruth " << groundtruth_file << " does not match the loaded database;"
+                 << " the u8 codes of a .bvecs file are lossless, so the scan is exact" << endl;
+            return 0;
+        }
+        if (filtered || metric != kMetricL2 || truth.size() < queries.size() ||
+            !groundtruth_covers(truth, K, db_size)) {
+            cout << "\nGroundtruth " << groundtruth_file
+                 << (filtered ? string(" ignores the filter")
+                     : metric != kMetricL2 ? " ranks by L2, not " + string(metric_name(metric))
+                                           : string(" does not match the loaded database"))
+                 << "; computing exact neighbors by brute force" << endl;
+            truth = exact_groundtruth(queries, database, K, params, filtered ? &filter : nullptr);
+            source = "brute force";
+        }
+        cout << "Recall@" << K << ": " << recall_at_k(all_results, truth, K)
+             << " (" << queries.size() << " queries vs " << source << ")" << endl;
+    }
     
     return 0;
 }
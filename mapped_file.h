@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "quantized_store.h"
+#include "vector_store.h"
+
+// Access hints applied to a mapping with madvise.
+struct MapOptions {
+    bool sequential = true;   // MADV_SEQUENTIAL: aggressive kernel read-ahead
+    bool willneed = false;    // MADV_WILLNEED: start paging the file in now
+    bool hugepages = false;   // MADV_HUGEPAGE: ask for transparent huge pages
+};
+
+// Private (copy-on-write) mapping of a whole file.
+// Pages come from the page cache, so processes mapping the same file share
+// physical memory until one of them writes (copy-on-write).
+class MappedFile {
+public:
+    MappedFile() : addr_(nullptr), size_(0) {}
+    ~MappedFile() {
+        if (addr_) munmap(addr_, size_);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& filename, const MapOptions& options = MapOptions()) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Error: Cannot open file " << filename << std::endl;
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            std::cerr << "Error: Cannot stat or empty file " << filename << std::endl;
+            ::close(fd);
+            return false;
+        }
+
+        size_ = static_cast<size_t>(st.st_size);
+        void* addr = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            std::cerr << "Error: mmap failed for " << filename << std::endl;
+            size_ = 0;
+            return false;
+        }
+        addr_ = addr;
+
+        // Hints are best effort; failures (e.g. no THP for this filesystem) are ignored.
+        if (options.sequential) madvise(addr_, size_, MADV_SEQUENTIAL);
+        if (options.willneed) madvise(addr_, size_, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+        if (options.hugepages) madvise(addr_, size_, MADV_HUGEPAGE);
+#endif
+        return true;
+    }
+
+    char* data() const { return static_cast<char*>(addr_); }
+    size_t size() const { return size_; }
+
+private:
+    void* addr_;
+    size_t size_;
+};
+
+// Map a file of [int32 dim][dim elements] records and return the common
+// dimension and record count. Only the first and last headers are checked
+// so opening does not fault in the whole file.
+inline bool map_vecs_records(const std::string& filename, size_t elem_size, int max_vectors,
+                             const MapOptions& options, std::shared_ptr<MappedFile>& file,
+                             size_t& dim, size_t& count) {
+    file = std::make_shared<MappedFile>();
+    if (!file->open(filename, options)) return false;
+
+    int header = 0;
+    if (file->size() < sizeof(int)) {
+        std::cerr << "Error: Truncated file " << filename << std::endl;
+        return false;
+    }
+    std::memcpy(&header, file->data(), sizeof(int));
+    if (header <= 0) {
+        std::cerr << "Error: Invalid header in " << filename << std::endl;
+        return false;
+    }
+
+    dim = static_cast<size_t>(header);
+    size_t record_bytes = sizeof(int) + dim * elem_size;
+    count = file->size() / record_bytes;
+    if (max_vectors > 0 && static_cast<size_t>(max_vectors) < count) {
+        count = static_cast<size_t>(max_vectors);
+    }
+
+    if (count > 0) {
+        int last = 0;
+        std::memcpy(&last, file->data() + (count - 1) * record_bytes, sizeof(int));
+        if (last != header) {
+            std::cerr << "Error: Inconsistent dimension in " << filename << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Zero-copy load of a .fvecs file. The returned store is a view whose rows
+// point just past each 4-byte dim header (stride = dim + 1 floats).
+inline VectorStore map_fvecs(const std::string& filename, int max_vectors = -1,
+                             const MapOptions& options = MapOptions()) {
+    std::shared_ptr<MappedFile> file;
+    size_t dim = 0, count = 0;
+    if (!map_vecs_records(filename, sizeof(float), max_vectors, options, file, dim, count)) {
+        return VectorStore();
+    }
+
+    float* first = reinterpret_cast<float*>(file->data() + sizeof(int));
+    return VectorStore::view(first, dim, dim + 1, count, file);
+}
+
+// Zero-copy load of a .bvecs file as u8 codes. The bytes are already the
+// codes of the identity quantizer (offset 0, scale 1), so the store's
+// rows point just past each 4-byte dim header (stride = dim + 4 bytes).
+inline Uint8Store map_bvecs(const std::string& filename, int max_vectors = -1,
+                            const MapOptions& options = MapOptions()) {
+    Uint8Store store;
+    std::shared_ptr<MappedFile> file;
+    size_t dim = 0, count = 0;
+    if (!map_vecs_records(filename, 1, max_vectors, options, file, dim, count)) return store;
+
+    uint8_t* first = reinterpret_cast<uint8_t*>(file->data() + sizeof(int));
+    store.codes = CodeRows<uint8_t>::view(first, dim, sizeof(int) + dim, count, file);
+    return store;
+}
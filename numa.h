@@ -0,0 +1,308 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "search.h"
+#include "topk.h"
+#include "vector_store.h"
+
+// NUMA placement without libnuma: the topology comes from
+// /sys/devices/system/node, threads are pinned with
+// pthread_setaffinity_np, and memory is bound with the raw mbind syscall.
+// On a machine (or container) without NUMA information everything
+// collapses to one node holding every allowed CPU, so callers need no
+// special case.
+
+struct NumaNode {
+    int id;
+    std::vector<int> cpus;   // allowed CPUs local to this node
+};
+
+// "0-3,8,10-11" -> {0,1,2,3,8,10,11}
+inline std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream in(list);
+    for (std::string item; std::getline(in, item, ',');) {
+        if (item.empty() || item[0] < '0' || item[0] > '9') continue;
+        size_t dash = item.find('-');
+        int first = std::atoi(item.c_str());
+        int last = dash == std::string::npos ? first : std::atoi(item.c_str() + dash + 1);
+        for (int c = first; c <= last; c++) cpus.push_back(c);
+    }
+    return cpus;
+}
+
+// Nodes that have at least one CPU this process may run on, in node order.
+inline std::vector<NumaNode> numa_topology() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    const bool have_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    auto usable = [&](int cpu) {
+        return cpu >= 0 && cpu < CPU_SETSIZE && (!have_mask || CPU_ISSET(cpu, &allowed));
+    };
+
+    std::vector<NumaNode> nodes;
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string ids;
+    if (online && std::getline(online, ids)) {
+        std::vector<int> node_ids = parse_cpu_list(ids);
+        for (size_t i = 0; i < node_ids.size(); i++) {
+            std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node_ids[i]) + "/cpulist");
+            std::string list;
+            if (!cpulist || !std::getline(cpulist, list)) continue;
+            NumaNode node;
+            node.id = node_ids[i];
+            std::vector<int> cpus = parse_cpu_list(list);
+            for (size_t c = 0; c < cpus.size(); c++) {
+                if (usable(cpus[c])) node.cpus.push_back(cpus[c]);
+            }
+            if (!node.cpus.empty()) nodes.push_back(node);
+        }
+    }
+    if (nodes.empty()) {
+        NumaNode node;
+        node.id = 0;
+        const int hw = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        for (int c = 0; c < (have_mask ? CPU_SETSIZE : hw); c++) {
+            if (usable(c)) node.cpus.push_back(c);
+        }
+        if (node.cpus.empty()) node.cpus.push_back(0);
+        nodes.push_back(node);
+    }
+    return nodes;
+}
+
+// Restrict the calling thread to cpus. False if the kernel refused.
+inline bool pin_current_thread(const std::vector<int>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); i++) {
+        if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE) CPU_SET(cpus[i], &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Bind the pages [addr, addr + bytes) to node, migrating any already
+// placed elsewhere. addr must be page-aligned and the range should be
+// whole pages the caller owns outright (see node_local_store): MPOL_MF_MOVE
+// moves every page it touches. False when addr is unaligned, or mbind is
+// unavailable (no NUMA kernel, seccomp) or refused; first touch from a
+// pinned thread still places the pages in that case.
+inline bool bind_to_node(const void* addr, size_t bytes, int node) {
+#ifdef SYS_mbind
+    static const int kMpolBind = 2;
+    static const unsigned kMpolMfMove = 1u << 1;
+    unsigned long mask = 0;
+    const int max_node = static_cast<int>(sizeof(mask) * 8);
+    const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    if (node < 0 || node >= max_node || bytes == 0 || reinterpret_cast<uintptr_t>(addr) % page != 0) return false;
+    mask = 1ul << node;
+    // The kernel reads maxnode - 1 bits of the mask.
+    return syscall(SYS_mbind, addr, bytes, kMpolBind, &mask, static_cast<unsigned long>(max_node) + 1,
+                   kMpolMfMove) == 0;
+#else
+    (void)addr;
+    (void)bytes;
+    (void)node;
+    return false;
+#endif
+}
+
+// n zeroed rows in an anonymous mapping of their own, rounded up to whole
+// pages, so binding the mapping moves no other allocation's memory.
+// *bytes receives the mapping length.
+inline VectorStore node_local_store(size_t dim, size_t n, size_t* bytes) {
+    const size_t stride = VectorStore::padded_stride(dim);
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t length = std::max<size_t>(1, (n * stride * sizeof(float) + page - 1) / page) * page;
+    void* addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) throw std::bad_alloc();
+    std::shared_ptr<void> owner(addr, [length](void* p) { munmap(p, length); });
+    *bytes = length;
+    return VectorStore::view(static_cast<float*>(addr), dim, stride, n, std::move(owner));
+}
+
+// A database split into one contiguous shard per NUMA node. Each shard is
+// mapped and filled by a thread pinned to its node, so first touch puts
+// its pages in local memory, and its mapping is then mbind'ed there. Shard sizes follow
+// each node's CPU count, so a node's threads scan only local memory and
+// finish together. Rows keep their original index in search results.
+class NumaShardedStore {
+public:
+    struct Shard {
+        NumaNode node;
+        VectorStore rows;
+        size_t first = 0;     // index of rows.row(0) in the source store
+        bool bound = false;   // mbind succeeded
+    };
+
+    NumaShardedStore() : size_(0), dim_(0) {}
+
+    NumaShardedStore(const NumaShardedStore&) = delete;
+    NumaShardedStore& operator=(const NumaShardedStore&) = delete;
+    NumaShardedStore(NumaShardedStore&&) = default;
+    NumaShardedStore& operator=(NumaShardedStore&&) = default;
+
+    static NumaShardedStore from(const VectorStore& source,
+                                 const std::vector<NumaNode>& nodes = numa_topology()) {
+        NumaShardedStore store;
+        store.size_ = source.size();
+        store.dim_ = source.dim();
+        size_t total_cpus = 0;
+        for (size_t i = 0; i < nodes.size(); i++) total_cpus += nodes[i].cpus.size();
+
+        store.shards_.resize(nodes.size());
+        size_t first = 0;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            Shard& shard = store.shards_[i];
+            shard.node = nodes[i];
+            shard.first = first;
+            first = i + 1 == nodes.size() ? source.size()
+                                          : first + source.size() * nodes[i].cpus.size() / total_cpus;
+        }
+
+        std::vector<std::thread> fillers;
+        for (size_t i = 0; i < store.shards_.size(); i++) {
+            const size_t last = i + 1 < store.shards_.size() ? store.shards_[i + 1].first : source.size();
+            Shard* shard = &store.shards_[i];
+            fillers.emplace_back([shard, last, &source] {
+                pin_current_thread(shard->node.cpus);
+                const size_t n = last - shard->first;
+                size_t bytes = 0;
+                shard->rows = node_local_store(source.dim(), n, &bytes);
+                for (size_t r = 0; r < n; r++) {
+                    std::memcpy(shard->rows.row(r), source.row(shard->first + r), source.dim() * sizeof(float));
+                }
+                shard->bound = n > 0 && bind_to_node(shard->rows.data(), bytes, shard->node.id);
+            });
+        }
+        for (size_t i = 0; i < fillers.size(); i++) fillers[i].join();
+        return store;
+    }
+
+    size_t size() const { return size_; }
+    size_t dim() const { return dim_; }
+    const std::vector<Shard>& shards() const { return shards_; }
+
+    // Split a thread budget over the shards in proportion to their CPUs,
+    // at least one thread each.
+    std::vector<size_t> threads_per_shard(int requested) const {
+        const size_t total = static_cast<size_t>(resolve_thread_count(requested));
+        size_t cpus = 0;
+        for (size_t i = 0; i < shards_.size(); i++) cpus += shards_[i].node.cpus.size();
+        std::vector<size_t> threads(shards_.size());
+        for (size_t i = 0; i < shards_.size(); i++) {
+            threads[i] = std::max<size_t>(1, total * shards_[i].node.cpus.size() / std::max<size_t>(1, cpus));
+        }
+        return threads;
+    }
+
+private:
+    std::vector<Shard> shards_;
+    size_t size_;
+    size_t dim_;
+};
+
+// Run fn(shard, thread, begin, end) over every shard's rows (or queries,
+// when over_queries is set) on threads pinned to the shard's node. Threads
+// are numbered globally across shards.
+template <class Fn>
+inline void shard_parallel_for(const NumaShardedStore& store, int requested, size_t nq, bool over_queries, Fn fn) {
+    const std::vector<NumaShardedStore::Shard>& shards = store.shards();
+    const std::vector<size_t> threads = store.threads_per_shard(requested);
+    if (shards.size() == 1 && threads[0] == 1) {
+        // Nothing to place: run on the caller, as parallel_for does.
+        fn(size_t(0), size_t(0), size_t(0), over_queries ? nq : shards[0].rows.size());
+        return;
+    }
+    std::vector<std::thread> workers;
+    size_t global = 0;
+    for (size_t s = 0; s < shards.size(); s++) {
+        const size_t n = over_queries ? nq : shards[s].rows.size();
+        const size_t t_count = std::max<size_t>(1, std::min(threads[s], n));
+        for (size_t t = 0; t < t_count; t++, global++) {
+            const size_t begin = n * t / t_count, end = n * (t + 1) / t_count;
+            workers.emplace_back([&fn, &shards, s, global, begin, end] {
+                pin_current_thread(shards[s].node.cpus);
+                fn(s, global, begin, end);
+            });
+        }
+    }
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+}
+
+inline size_t shard_thread_count(const NumaShardedStore& store, int requested, size_t nq, bool over_queries) {
+    const std::vector<size_t> threads = store.threads_per_shard(requested);
+    size_t total = 0;
+    for (size_t s = 0; s < threads.size(); s++) {
+        const size_t n = over_queries ? nq : store.shards()[s].rows.size();
+        total += std::max<size_t>(1, std::min(threads[s], n));
+    }
+    return total;
+}
+
+// Brute force k-NN over a sharded store: each node's threads scan only
+// that node's shard into their own TopK, then everything is merged.
+inline std::vector<SearchResult> brute_force_search(
+    const float* query,
+    const NumaShardedStore& database,
+    int k,
+    const SearchParams& params = SearchParams()) {
+
+    const size_t kk = static_cast<size_t>(k);
+    std::vector<TopK> partial(shard_thread_count(database, params.num_threads, 1, false), TopK(kk));
+    shard_parallel_for(database, params.num_threads, 1, false, [&](size_t s, size_t t, size_t begin, size_t end) {
+        const NumaShardedStore::Shard& shard = database.shards()[s];
+        scan_range(query, shard.rows, begin, end, partial[t], params.early_abandon, shard.first);
+    });
+    SEARCH_PROFILE_SCOPE(kTimerTopkMerge);
+    TopK topk(kk);
+    for (size_t t = 0; t < partial.size(); t++) topk.merge(partial[t]);
+    std::vector<SearchResult> results = topk.take_sorted();
+    finalize_distances(results, params);
+    return results;
+}
+
+// Batch k-NN over a sharded store: every node scans all queries against
+// its own shard (tiled as in batch_search), keeping one TopK per query per
+// shard; the per-shard selections are merged per query.
+inline std::vector<std::vector<SearchResult>> batch_search(
+    const VectorStore& queries,
+    const NumaShardedStore& database,
+    int k,
+    const SearchParams& params = SearchParams()) {
+
+    const size_t nq = queries.size();
+    const size_t kk = static_cast<size_t>(k);
+    const size_t num_shards = database.shards().size();
+    std::vector<std::vector<TopK>> topk(num_shards, std::vector<TopK>(nq, TopK(kk)));
+    shard_parallel_for(database, params.num_threads, nq, true, [&](size_t s, size_t, size_t begin, size_t end) {
+        const NumaShardedStore::Shard& shard = database.shards()[s];
+        batch_scan(queries, begin, end, shard.rows, params, topk[s], shard.first);
+    });
+
+    std::vector<std::vector<SearchResult>> results(nq);
+    for (size_t q = 0; q < nq; q++) {
+        for (size_t s = 1; s < num_shards; s++) topk[0][q].merge(topk[s][q]);
+        results[q] = topk[0][q].take_sorted();
+        finalize_distances(results[q], params);
+    }
+    return results;
+}
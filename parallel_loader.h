@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "profile.h"
+#include "quantized_store.h"
+#include "search.h"
+#include "vector_store.h"
+
+// Parallel loader for [int32 dim][dim x T] record files. Every record has
+// the same size, so offsets follow from the first header: the row range is
+// split over the threads and each one preads its share a chunk at a time
+// and converts it into its final rows of the preallocated store, with no
+// shared file position and no lock. Before converting a chunk a thread
+// asks the kernel to start reading its next one (POSIX_FADV_WILLNEED), so
+// the disk stays busy while the rows are copied out. With enough threads
+// the load runs at disk (or page cache) bandwidth instead of one core's
+// parse speed.
+
+// Bytes each thread preads at a time.
+const size_t kLoadChunkBytes = 4 << 20;
+
+// Shape of a record file, from its size and first header.
+struct VecsFile {
+    std::string filename;
+    int fd = -1;
+    size_t dim = 0;
+    size_t record_bytes = 0;
+    size_t rows = 0;      // whole records, capped at max_vectors
+
+    VecsFile() {}
+    ~VecsFile() {
+        if (fd >= 0) ::close(fd);
+    }
+    VecsFile(const VecsFile&) = delete;
+    VecsFile& operator=(const VecsFile&) = delete;
+};
+
+// Open filename as records of elem_size-byte components. False (with a
+// message) if it cannot be opened or its header is invalid.
+inline bool open_vecs_file(const std::string& filename, size_t elem_size, int max_vectors, const char* format,
+                           VecsFile& file) {
+    file.filename = filename;
+    file.fd = ::open(filename.c_str(), O_RDONLY);
+    if (file.fd < 0) {
+        std::cerr << "Error: Cannot open file " << filename << std::endl;
+        return false;
+    }
+    struct stat st;
+    int dim = 0;
+    if (fstat(file.fd, &st) != 0 || pread(file.fd, &dim, sizeof(dim), 0) != static_cast<ssize_t>(sizeof(dim)) ||
+        dim <= 0) {
+        std::cerr << "Error: Invalid ." << format << " header in " << filename << std::endl;
+        return false;
+    }
+    file.dim = static_cast<size_t>(dim);
+    file.record_bytes = sizeof(int) + file.dim * elem_size;
+    file.rows = static_cast<size_t>(st.st_size) / file.record_bytes;
+    if (max_vectors > 0) file.rows = std::min(file.rows, static_cast<size_t>(max_vectors));
+    return true;
+}
+
+// Read every record of file on num_threads threads, calling
+// row_fn(row, payload) once per row (concurrently, for distinct rows) with
+// the bytes after the record's header, which are not aligned for the
+// element type. Returns how many leading rows were read; on a read error
+// or a bad header the rest are dropped, as the sequential reader does.
+template <class RowFn>
+inline size_t parallel_read_records(const VecsFile& file, int num_threads, RowFn row_fn) {
+    const size_t rows_per_chunk = std::max<size_t>(1, kLoadChunkBytes / file.record_bytes);
+    std::atomic<size_t> first_bad(std::numeric_limits<size_t>::max());
+
+    parallel_for(file.rows, num_threads, [&](size_t, size_t begin, size_t end) {
+        std::vector<char> buffer(std::min(rows_per_chunk, end - begin) * file.record_bytes);
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(file.fd, static_cast<off_t>(begin * file.record_bytes),
+                      static_cast<off_t>((end - begin) * file.record_bytes), POSIX_FADV_SEQUENTIAL);
+#endif
+        for (size_t row = begin; row < end; row += rows_per_chunk) {
+            // A failure in an earlier range already truncates the store.
+            if (first_bad.load(std::memory_order_relaxed) < row) return;
+            const size_t rows = std::min(rows_per_chunk, end - row);
+            const off_t offset = static_cast<off_t>(row * file.record_bytes);
+            const size_t bytes = rows * file.record_bytes;
+            size_t done = 0;
+            while (done < bytes) {
+                ssize_t n = pread(file.fd, buffer.data() + done, bytes - done, offset + static_cast<off_t>(done));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                done += static_cast<size_t>(n);
+            }
+#ifdef POSIX_FADV_WILLNEED
+            if (row + rows < end) {
+                posix_fadvise(file.fd, offset + static_cast<off_t>(bytes),
+                              static_cast<off_t>(std::min(rows_per_chunk, end - row - rows) * file.record_bytes),
+                              POSIX_FADV_WILLNEED);
+            }
+#endif
+            const size_t complete = done / file.record_bytes;
+            for (size_t i = 0; i < complete; i++) {
+                const char* record = buffer.data() + i * file.record_bytes;
+                int header;
+                std::memcpy(&header, record, sizeof(int));
+                if (header != static_cast<int>(file.dim)) {
+                    std::cerr << "Error: Inconsistent dimension at vector " << row + i
+                              << " in " << file.filename << std::endl;
+                    size_t bad = first_bad.load();
+                    while (row + i < bad && !first_bad.compare_exchange_weak(bad, row + i)) {}
+                    return;
+                }
+                row_fn(row + i, record + sizeof(int));
+            }
+            if (complete < rows) {
+                std::cerr << "Error: Read failed in " << file.filename << " at row " << row + complete << std::endl;
+                size_t bad = first_bad.load();
+                while (row + complete < bad && !first_bad.compare_exchange_weak(bad, row + complete)) {}
+                return;
+            }
+        }
+    });
+    return std::min(file.rows, first_bad.load());
+}
+
+// read_vecs_as_float on num_threads threads (0 = all cores).
+template <class T>
+inline VectorStore parallel_read_vecs_as_float(const std::string& filename, int max_vectors, const char* format,
+                                               int num_threads) {
+    SEARCH_PROFILE_SCOPE(kTimerLoad);
+    VecsFile file;
+    if (!open_vecs_file(filename, sizeof(T), max_vectors, format, file)) return VectorStore();
+
+    VectorStore store(file.dim, file.rows);
+    size_t loaded = parallel_read_records(file, num_threads, [&](size_t row, const char* payload) {
+        if (std::is_same<T, float>::value) {
+            std::memcpy(store.row(row), payload, file.dim * sizeof(float));
+        }
+        else {
+            T value;
+            for (size_t d = 0; d < file.dim; d++) {
+                std::memcpy(&value, payload + d * sizeof(T), sizeof(T));
+                store.row(row)[d] = static_cast<float>(value);
+            }
+        }
+    });
+    store.shrink(loaded);
+    return store;
+}
+
+// Pick the element type from the file extension, as read_vecs does.
+inline VectorStore parallel_read_vecs(const std::string& filename, int max_vectors = -1, int num_threads = 0) {
+    const std::string ext = ".bvecs";
+    bool bytes = filename.size() >= ext.size() &&
+                 filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0;
+    return bytes ? parallel_read_vecs_as_float<uint8_t>(filename, max_vectors, "bvecs", num_threads)
+                 : parallel_read_vecs_as_float<float>(filename, max_vectors, "fvecs", num_threads);
+}
+
+// Load a .bvecs file straight into uint8 codes, without the float store
+// Uint8Store::from() would need (4x the memory of the result). The bytes
+// of a .bvecs file are already the codes of the identity quantizer
+// (offset 0, scale 1), so the conversion is a copy and is lossless.
+inline Uint8Store parallel_read_bvecs_u8(const std::string& filename, int max_vectors = -1, int num_threads = 0) {
+    SEARCH_PROFILE_SCOPE(kTimerLoad);
+    Uint8Store store;
+    VecsFile file;
+    if (!open_vecs_file(filename, 1, max_vectors, "bvecs", file)) return store;
+
+    store.codes = CodeRows<uint8_t>(file.dim, file.rows);
+    size_t loaded = parallel_read_records(file, num_threads, [&](size_t row, const char* payload) {
+        std::memcpy(store.codes.row(row), payload, file.dim);
+    });
+    if (loaded < file.rows) {
+        CodeRows<uint8_t> kept(file.dim, loaded);
+        for (size_t i = 0; i < loaded; i++) std::memcpy(kept.row(i), store.codes.row(i), file.dim);
+        store.codes = std::move(kept);
+    }
+    return store;
+}
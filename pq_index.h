@@ -0,0 +1,230 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "distance.h"
+#include "flat_array.h"
+#include "kmeans.h"
+#include "search.h"
+#include "snapshot.h"
+#include "topk.h"
+#include "vector_store.h"
+
+// Product quantizer: the vector is cut into m subvectors of dim / m
+// components and each is replaced by the index of its nearest centroid in
+// a 256-entry per-subspace codebook, i.e. m bytes per vector.
+class ProductQuantizer {
+public:
+    static const size_t kCentroids = 256;
+
+    ProductQuantizer() : dim_(0), m_(0), dsub_(0) {}
+
+    // Train per-subspace codebooks. dim must be divisible by m.
+    bool train(const VectorStore& data, size_t m, const KMeansParams& params = KMeansParams()) {
+        if (m == 0 || data.dim() % m != 0) {
+            std::cerr << "Error: PQ needs dim (" << data.dim() << ") divisible by m (" << m << ")" << std::endl;
+            return false;
+        }
+        dim_ = data.dim();
+        m_ = m;
+        dsub_ = dim_ / m_;
+        codebooks_.assign(m_ * kCentroids * dsub_, 0.0f);
+
+        VectorStore sub(dsub_, data.size());
+        for (size_t j = 0; j < m_; j++) {
+            for (size_t i = 0; i < data.size(); i++) {
+                std::memcpy(sub.row(i), data.row(i) + j * dsub_, dsub_ * sizeof(float));
+            }
+            VectorStore centroids = kmeans(sub, kCentroids, params);
+            for (size_t c = 0; c < centroids.size(); c++) {
+                std::memcpy(centroid(j, c), centroids.row(c), dsub_ * sizeof(float));
+            }
+            // With fewer training points than centroids the extra codes
+            // stay unused; park them far away so no vector encodes to them.
+            for (size_t c = centroids.size(); c < kCentroids; c++) {
+                std::fill(centroid(j, c), centroid(j, c) + dsub_, 1e30f);
+            }
+        }
+        return true;
+    }
+
+    size_t dim() const { return dim_; }
+    size_t code_size() const { return m_; }
+
+    // Codes are the nearest centroids in squared L2 under every metric: they
+    // approximate the vector, and the metric only enters the ADC table.
+    void encode(const float* v, uint8_t* code) const {
+        const DistanceFn dist_fn = active_kernel().l2;
+        for (size_t j = 0; j < m_; j++) {
+            const float* x = v + j * dsub_;
+            size_t best = 0;
+            float best_dist = dist_fn(x, centroid(j, 0), dsub_);
+            for (size_t c = 1; c < kCentroids; c++) {
+                float d = dist_fn(x, centroid(j, c), dsub_);
+                if (d < best_dist) {
+                    best_dist = d;
+                    best = c;
+                }
+            }
+            code[j] = static_cast<uint8_t>(best);
+        }
+    }
+
+    void decode(const uint8_t* code, float* v) const {
+        for (size_t j = 0; j < m_; j++) {
+            std::memcpy(v + j * dsub_, centroid(j, code[j]), dsub_ * sizeof(float));
+        }
+    }
+
+    // Asymmetric distance table: table[j * 256 + c] is the squared distance
+    // (negated dot product, with an inner-product metric) between query
+    // subvector j and centroid c of subspace j; both sum over subspaces.
+    void compute_table(const float* query, float* table) const {
+        const DistanceFn dist_fn = active_kernel().distance;
+        for (size_t j = 0; j < m_; j++) {
+            for (size_t c = 0; c < kCentroids; c++) {
+                table[j * kCentroids + c] = dist_fn(query + j * dsub_, centroid(j, c), dsub_);
+            }
+        }
+    }
+
+    // Approximate squared distance to an encoded vector: m table lookups.
+    float adc_distance(const float* table, const uint8_t* code) const {
+        float d0 = 0.0f, d1 = 0.0f, d2 = 0.0f, d3 = 0.0f;
+        size_t j = 0;
+        for (; j + 4 <= m_; j += 4) {
+            d0 += table[(j + 0) * kCentroids + code[j + 0]];
+            d1 += table[(j + 1) * kCentroids + code[j + 1]];
+            d2 += table[(j + 2) * kCentroids + code[j + 2]];
+            d3 += table[(j + 3) * kCentroids + code[j + 3]];
+        }
+        for (; j < m_; j++) d0 += table[j * kCentroids + code[j]];
+        return (d0 + d1) + (d2 + d3);
+    }
+
+    const FlatArray<float>& codebooks() const { return codebooks_; }
+
+    // Codebooks as section "pq.codebooks", meta = {dim, m}.
+    void save(SnapshotWriter& writer) const {
+        writer.add_array("pq.codebooks", codebooks_.data(), codebooks_.size(), dim_, m_);
+    }
+
+    bool load(const Snapshot& snapshot) {
+        const SnapshotSection* s = snapshot.require("pq.codebooks");
+        if (!s || !snapshot.array("pq.codebooks", codebooks_)) return false;
+        dim_ = s->meta[0];
+        m_ = s->meta[1];
+        if (m_ == 0 || dim_ % m_ != 0 || codebooks_.size() != kCentroids * dim_) {
+            std::cerr << "Error: Inconsistent PQ codebooks in snapshot" << std::endl;
+            return false;
+        }
+        dsub_ = dim_ / m_;
+        return true;
+    }
+
+private:
+    float* centroid(size_t j, size_t c) { return &codebooks_[(j * kCentroids + c) * dsub_]; }
+    const float* centroid(size_t j, size_t c) const { return &codebooks_[(j * kCentroids + c) * dsub_]; }
+
+    size_t dim_;
+    size_t m_;
+    size_t dsub_;
+    FlatArray<float> codebooks_;     // m * 256 * dsub
+};
+
+struct PqParams {
+    size_t m = 16;                 // bytes per encoded vector
+    size_t train_size = 65536;     // base vectors sampled for codebook training
+    KMeansParams kmeans;
+};
+
+// Flat PQ index: every base vector stored as m code bytes and scanned with
+// per-query ADC lookup tables. search() can re-rank the best rerank ADC
+// candidates with exact distances against the original vectors, if the
+// index was built with them kept (keep_original) and they are still alive.
+class PqIndex {
+public:
+    PqIndex() : original_(nullptr) {}
+
+    bool build(const VectorStore& base, const PqParams& params = PqParams(), bool keep_original = true) {
+        VectorStore train = sample_rows(base, params.train_size, params.kmeans.seed);
+        if (!pq_.train(train, params.m, params.kmeans)) return false;
+
+        const size_t m = pq_.code_size();
+        codes_.resize(base.size() * m);
+        parallel_for(base.size(), params.kmeans.num_threads, [&](size_t, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) pq_.encode(base.row(i), &codes_[i * m]);
+        });
+        original_ = keep_original ? &base : nullptr;
+        return true;
+    }
+
+    void save(SnapshotWriter& writer) const {
+        pq_.save(writer);
+        writer.add_array("pq.codes", codes_.data(), codes_.size());
+    }
+
+    // original, if given, is used for re-ranking as with keep_original.
+    bool load(const Snapshot& snapshot, const VectorStore* original = nullptr) {
+        if (!pq_.load(snapshot) || !snapshot.array("pq.codes", codes_)) return false;
+        if (codes_.size() % pq_.code_size() != 0 ||
+            (original && original->size() * pq_.code_size() != codes_.size())) {
+            std::cerr << "Error: Inconsistent PQ codes in snapshot" << std::endl;
+            return false;
+        }
+        original_ = original;
+        return true;
+    }
+
+    size_t size() const { return pq_.code_size() == 0 ? 0 : codes_.size() / pq_.code_size(); }
+    size_t code_size() const { return pq_.code_size(); }
+    const ProductQuantizer& quantizer() const { return pq_; }
+
+    std::vector<SearchResult> search(const float* query, int k, size_t rerank = 0,
+                                     const SearchParams& params = SearchParams()) const {
+        const size_t m = pq_.code_size();
+        const size_t n = size();
+        std::vector<float> table(m * ProductQuantizer::kCentroids);
+        pq_.compute_table(query, table.data());
+
+        bool exact = rerank > 0 && original_ != nullptr;
+        size_t shortlist = exact ? std::max(rerank, static_cast<size_t>(k)) : static_cast<size_t>(k);
+        TopK candidates(shortlist);
+        const uint8_t* code = codes_.data();
+        for (size_t i = 0; i < n; i++, code += m) {
+            candidates.push(static_cast<int>(i), pq_.adc_distance(table.data(), code));
+        }
+
+        std::vector<SearchResult> results = candidates.take_sorted();
+        if (exact) {
+            const DistanceFn dist_fn = active_kernel().distance;
+            TopK topk(static_cast<size_t>(k));
+            for (size_t i = 0; i < results.size(); i++) {
+                int id = results[i].index;
+                topk.push(id, dist_fn(query, original_->row(static_cast<size_t>(id)), original_->dim()));
+            }
+            results = topk.take_sorted();
+        }
+        finalize_distances(results, params);
+        return results;
+    }
+
+    std::vector<std::vector<SearchResult>> search_batch(const VectorStore& queries, int k, size_t rerank = 0,
+                                                        const SearchParams& params = SearchParams()) const {
+        std::vector<std::vector<SearchResult>> results(queries.size());
+        parallel_ranges(queries.size(), 1, params, [&](size_t, size_t begin, size_t end) {
+            for (size_t q = begin; q < end; q++) results[q] = search(queries.row(q), k, rerank, params);
+        });
+        return results;
+    }
+
+private:
+    ProductQuantizer pq_;
+    FlatArray<uint8_t> codes_;       // n * m
+    const VectorStore* original_;
+};
@@ -0,0 +1,230 @@
+#pragma once
+
+// Opt-in hot-path instrumentation. Build with -DSEARCH_PROFILE (make
+// profile) to collect scoped timers and event counters; without it every
+// SEARCH_PROFILE_* macro expands to nothing and the hot loops are exactly
+// the production code.
+//
+// Counts and times accumulate in thread-local slots (plain increments, no
+// atomics in the scan) and are folded into the process totals when a
+// thread exits or the report is printed.
+
+#ifdef SEARCH_PROFILE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum ProfileTimer {
+    kTimerLoad,        // read_fvecs / read_bvecs
+    kTimerScan,        // distance evaluation + top-k pushes
+    kTimerTopkMerge,   // merging per-thread selections and sorting
+    kTimerCount
+};
+
+enum ProfileCounter {
+    kCountDistances,       // distance kernel calls in scans
+    kCountTopkUpdates,     // pushes that replaced an entry of the top-k
+    kCountEarlyAbandons,   // bounded distances cut short by the threshold
+    kCountCounters
+};
+
+inline const char* profile_timer_name(int t) {
+    static const char* names[kTimerCount] = {"load", "scan", "topk_merge"};
+    return names[t];
+}
+
+inline const char* profile_counter_name(int c) {
+    static const char* names[kCountCounters] = {"distances", "topk_updates", "early_abandons"};
+    return names[c];
+}
+
+struct ProfileTotals {
+    std::atomic<uint64_t> timer_ns[kTimerCount];
+    std::atomic<uint64_t> timer_calls[kTimerCount];
+    std::atomic<uint64_t> counters[kCountCounters];
+
+    ProfileTotals() {
+        for (int i = 0; i < kTimerCount; i++) timer_ns[i] = timer_calls[i] = 0;
+        for (int i = 0; i < kCountCounters; i++) counters[i] = 0;
+    }
+};
+
+inline ProfileTotals& profile_totals() {
+    static ProfileTotals totals;
+    return totals;
+}
+
+struct ProfileLocal {
+    uint64_t timer_ns[kTimerCount];
+    uint64_t timer_calls[kTimerCount];
+    uint64_t counters[kCountCounters];
+
+    ProfileLocal() { reset(); }
+    ~ProfileLocal() { flush(); }
+
+    void reset() {
+        std::memset(timer_ns, 0, sizeof(timer_ns));
+        std::memset(timer_calls, 0, sizeof(timer_calls));
+        std::memset(counters, 0, sizeof(counters));
+    }
+
+    void flush() {
+        ProfileTotals& totals = profile_totals();
+        for (int i = 0; i < kTimerCount; i++) {
+            totals.timer_ns[i] += timer_ns[i];
+            totals.timer_calls[i] += timer_calls[i];
+        }
+        for (int i = 0; i < kCountCounters; i++) totals.counters[i] += counters[i];
+        reset();
+    }
+};
+
+inline ProfileLocal& profile_local() {
+    static thread_local ProfileLocal local;
+    return local;
+}
+
+class ScopedProfileTimer {
+public:
+    explicit ScopedProfileTimer(ProfileTimer timer)
+        : timer_(timer), start_(std::chrono::steady_clock::now()) {}
+
+    ~ScopedProfileTimer() {
+        ProfileLocal& local = profile_local();
+        local.timer_ns[timer_] += static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count());
+        local.timer_calls[timer_]++;
+    }
+
+private:
+    ProfileTimer timer_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Hardware counters for a region of the program via perf_event_open:
+// cycles, instructions and last-level cache misses, inherited by threads
+// created after start(). Unavailable counters (no PMU access, e.g.
+// perf_event_paranoid or a VM) are reported as such instead of failing.
+class PerfCounters {
+public:
+    enum { kCycles, kInstructions, kLlcMisses, kNumEvents };
+
+    PerfCounters() {
+        for (int i = 0; i < kNumEvents; i++) {
+            fd_[i] = -1;
+            value_[i] = 0;
+        }
+    }
+
+    ~PerfCounters() {
+#ifdef __linux__
+        for (int i = 0; i < kNumEvents; i++) {
+            if (fd_[i] >= 0) close(fd_[i]);
+        }
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    static const char* event_name(int e) {
+        static const char* names[kNumEvents] = {"cycles", "instructions", "llc_misses"};
+        return names[e];
+    }
+
+    void start() {
+#ifdef __linux__
+        static const uint64_t configs[kNumEvents] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+        for (int i = 0; i < kNumEvents; i++) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.disabled = 1;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd_[i] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+            if (fd_[i] >= 0) {
+                ioctl(fd_[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd_[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    void stop() {
+#ifdef __linux__
+        for (int i = 0; i < kNumEvents; i++) {
+            if (fd_[i] < 0) continue;
+            ioctl(fd_[i], PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t v = 0;
+            if (read(fd_[i], &v, sizeof(v)) == static_cast<ssize_t>(sizeof(v))) value_[i] = v;
+            else fd_[i] = (close(fd_[i]), -1);
+        }
+#endif
+    }
+
+    bool available(int e) const { return fd_[e] >= 0; }
+    uint64_t value(int e) const { return value_[e]; }
+
+private:
+    int fd_[kNumEvents];
+    uint64_t value_[kNumEvents];
+};
+
+// Print the process totals (flushing the calling thread first) and, if
+// given, the hardware counters of a measured region.
+inline void profile_report(std::ostream& out, const PerfCounters* perf = nullptr) {
+    profile_local().flush();
+    ProfileTotals& totals = profile_totals();
+    out << "\n[Profile]" << std::endl;
+    for (int t = 0; t < kTimerCount; t++) {
+        out << "  " << std::left << std::setw(16) << profile_timer_name(t) << std::right
+            << totals.timer_ns[t] / 1e6 << " ms over " << totals.timer_calls[t] << " call(s)" << std::endl;
+    }
+    for (int c = 0; c < kCountCounters; c++) {
+        out << "  " << std::left << std::setw(16) << profile_counter_name(c) << std::right
+            << totals.counters[c] << std::endl;
+    }
+    if (!perf) return;
+    for (int e = 0; e < PerfCounters::kNumEvents; e++) {
+        out << "  " << std::left << std::setw(16) << PerfCounters::event_name(e) << std::right;
+        if (perf->available(e)) out << perf->value(e) << std::endl;
+        else out << "unavailable" << std::endl;
+    }
+    if (perf->available(PerfCounters::kCycles) && perf->available(PerfCounters::kInstructions) &&
+        perf->value(PerfCounters::kCycles) > 0) {
+        out << "  " << std::left << std::setw(16) << "ipc" << std::right
+            << static_cast<double>(perf->value(PerfCounters::kInstructions)) / perf->value(PerfCounters::kCycles)
+            << std::endl;
+    }
+}
+
+#define SEARCH_PROFILE_CONCAT_(a, b) a##b
+#define SEARCH_PROFILE_CONCAT(a, b) SEARCH_PROFILE_CONCAT_(a, b)
+#define SEARCH_PROFILE_SCOPE(timer) \
+    ScopedProfileTimer SEARCH_PROFILE_CONCAT(search_profile_scope_, __LINE__)(timer)
+#define SEARCH_PROFILE_COUNT(counter, n) (profile_local().counters[counter] += (n))
+#define SEARCH_PROFILE_ONLY(...) __VA_ARGS__
+
+#else
+
+#define SEARCH_PROFILE_SCOPE(timer) ((void)0)
+#define SEARCH_PROFILE_COUNT(counter, n) ((void)0)
+#define SEARCH_PROFILE_ONLY(...)
+
+#endif
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "profile.h"
+#include "search.h"
+#include "sq_distance.h"
+#include "topk.h"
+#include "vector_store.h"
+
+// Contiguous 64-byte aligned rows of fixed-width codes, the compressed
+// counterpart of VectorStore's buffer. Rows are padded to a multiple of
+// 64 bytes. Like VectorStore, CodeRows can also be a view over memory it
+// does not allocate (see map_bvecs), kept alive through owner_ and with an
+// arbitrary stride.
+template <class T>
+class CodeRows {
+public:
+    CodeRows() : dim_(0), stride_(0), size_(0), data_(nullptr) {}
+
+    CodeRows(size_t dim, size_t n) : dim_(dim), stride_(padded_stride(dim)), size_(n), data_(nullptr) {
+        size_t bytes = std::max<size_t>(VectorStore::kAlignment, n * stride_ * sizeof(T));
+        void* p = nullptr;
+        if (posix_memalign(&p, VectorStore::kAlignment, bytes) != 0) throw std::bad_alloc();
+        data_ = static_cast<T*>(p);
+        std::fill(data_, data_ + n * stride_, T());
+    }
+
+    // Wrap n rows of externally owned codes, stride elements apart.
+    static CodeRows view(T* data, size_t dim, size_t stride, size_t n, std::shared_ptr<void> owner) {
+        CodeRows rows;
+        rows.dim_ = dim;
+        rows.stride_ = stride;
+        rows.size_ = n;
+        rows.data_ = data;
+        rows.owner_ = std::move(owner);
+        return rows;
+    }
+
+    ~CodeRows() {
+        if (!owner_) std::free(data_);
+    }
+
+    CodeRows(const CodeRows&) = delete;
+    CodeRows& operator=(const CodeRows&) = delete;
+
+    CodeRows(CodeRows&& other) noexcept
+        : dim_(other.dim_), stride_(other.stride_), size_(other.size_), data_(other.data_),
+          owner_(std::move(other.owner_)) {
+        other.dim_ = other.stride_ = other.size_ = 0;
+        other.data_ = nullptr;
+    }
+
+    CodeRows& operator=(CodeRows&& other) noexcept {
+        if (this != &other) {
+            if (!owner_) std::free(data_);
+            dim_ = other.dim_;
+            stride_ = other.stride_;
+            size_ = other.size_;
+            data_ = other.data_;
+            owner_ = std::move(other.owner_);
+            other.dim_ = other.stride_ = other.size_ = 0;
+            other.data_ = nullptr;
+        }
+        return *this;
+    }
+
+    size_t size() const { return size_; }
+    size_t dim() const { return dim_; }
+    size_t stride() const { return stride_; }
+    bool empty() const { return size_ == 0; }
+    size_t bytes() const { return size_ * stride_ * sizeof(T); }
+
+    const T* row(size_t i) const { return data_ + i * stride_; }
+    T* row(size_t i) { return data_ + i * stride_; }
+
+    static size_t padded_stride(size_t dim) {
+        const size_t lanes = VectorStore::kAlignment / sizeof(T);
+        return (dim + lanes - 1) / lanes * lanes;
+    }
+
+private:
+    size_t dim_;
+    size_t stride_;
+    size_t size_;
+    T* data_;
+    std::shared_ptr<void> owner_;
+};
+
+// Uniform scalar quantizer to uint8: code = round((v - offset) / scale).
+// One scale for all dimensions keeps distances a plain integer sum:
+// ||a - b||^2 ~= scale^2 * sum (code_a - code_b)^2.
+struct ScalarQuantizer {
+    float offset = 0.0f;
+    float scale = 1.0f;
+
+    // Data that is already integral in [0, 255] (e.g. SIFT) maps to itself,
+    // which makes uint8 storage lossless. Anything else is scaled to fit.
+    static ScalarQuantizer fit(const VectorStore& data) {
+        ScalarQuantizer sq;
+        if (data.empty()) return sq;
+        float lo = data.row(0)[0], hi = lo;
+        bool integral = true;
+        for (size_t i = 0; i < data.size(); i++) {
+            const float* v = data.row(i);
+            for (size_t d = 0; d < data.dim(); d++) {
+                lo = std::min(lo, v[d]);
+                hi = std::max(hi, v[d]);
+                if (v[d] != std::floor(v[d])) integral = false;
+            }
+        }
+        if (integral && lo >= 0.0f && hi <= 255.0f) return sq;
+        sq.offset = lo;
+        sq.scale = hi > lo ? (hi - lo) / 255.0f : 1.0f;
+        return sq;
+    }
+
+    void encode(const float* v, uint8_t* code, size_t dim) const {
+        for (size_t d = 0; d < dim; d++) {
+            float q = std::round((v[d] - offset) / scale);
+            code[d] = static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, q)));
+        }
+    }
+};
+
+// Database stored as uint8 codes (4x less scan bandwidth than float32).
+struct Uint8Store {
+    ScalarQuantizer quantizer;
+    CodeRows<uint8_t> codes;
+
+    static Uint8Store from(const VectorStore& data) {
+        Uint8Store store;
+        store.quantizer = ScalarQuantizer::fit(data);
+        store.codes = CodeRows<uint8_t>(data.dim(), data.size());
+        for (size_t i = 0; i < data.size(); i++) {
+            store.quantizer.encode(data.row(i), store.codes.row(i), data.dim());
+        }
+        return store;
+    }
+
+    size_t size() const { return codes.size(); }
+    size_t dim() const { return codes.dim(); }
+};
+
+// Database stored as IEEE half floats (2x less scan bandwidth than float32).
+struct Float16Store {
+    CodeRows<uint16_t> codes;
+
+    static Float16Store from(const VectorStore& data) {
+        Float16Store store;
+        store.codes = CodeRows<uint16_t>(data.dim(), data.size());
+        for (size_t i = 0; i < data.size(); i++) {
+            floats_to_halves(data.row(i), store.codes.row(i), data.dim());
+        }
+        return store;
+    }
+
+    size_t size() const { return codes.size(); }
+    size_t dim() const { return codes.dim(); }
+};
+
+// Brute force k-NN over uint8 codes. The query is quantized onto the same
+// grid and ranked by the exact integer distance between codes; reported
+// distances are rescaled to the original units.
+inline std::vector<SearchResult> brute_force_search(
+    const float* query,
+    const Uint8Store& database,
+    int k,
+    const SearchParams& params = SearchParams()) {
+
+    std::vector<uint8_t> code(database.dim());
+    database.quantizer.encode(query, code.data(), database.dim());
+    const U8L2SqrFn dist_fn = quantized_kernels().u8;
+    const CodeRows<uint8_t>& rows = database.codes;
+
+    std::vector<SearchResult> results = parallel_scan_topk(
+        database.size(), k, params, [&](size_t begin, size_t end, TopK& topk) {
+            SEARCH_PROFILE_SCOPE(kTimerScan);
+            SEARCH_PROFILE_COUNT(kCountDistances, end - begin);
+            SEARCH_PROFILE_ONLY(size_t updates = 0;)
+            for (size_t i = begin; i < end; i++) {
+                SEARCH_PROFILE_ONLY(updates +=)
+                topk.push(static_cast<int>(i),
+                          static_cast<float>(dist_fn(code.data(), rows.row(i), rows.dim())));
+            }
+            SEARCH_PROFILE_COUNT(kCountTopkUpdates, updates);
+        });
+
+    const float scale2 = database.quantizer.scale * database.quantizer.scale;
+    for (size_t i = 0; i < results.size(); i++) results[i].distance *= scale2;
+    finalize_distances(results, params);
+    return results;
+}
+
+// Brute force k-NN over float16 rows with a float32 query.
+inline std::vector<SearchResult> brute_force_search(
+    const float* query,
+    const Float16Store& database,
+    int k,
+    const SearchParams& params = SearchParams()) {
+
+    const F16L2SqrFn dist_fn = quantized_kernels().f16;
+    const CodeRows<uint16_t>& rows = database.codes;
+
+    std::vector<SearchResult> results = parallel_scan_topk(
+        database.size(), k, params, [&](size_t begin, size_t end, TopK& topk) {
+            SEARCH_PROFILE_SCOPE(kTimerScan);
+            SEARCH_PROFILE_COUNT(kCountDistances, end - begin);
+            SEARCH_PROFILE_ONLY(size_t updates = 0;)
+            for (size_t i = begin; i < end; i++) {
+                SEARCH_PROFILE_ONLY(updates +=)
+                topk.push(static_cast<int>(i), dist_fn(query, rows.row(i), rows.dim()));
+            }
+            SEARCH_PROFILE_COUNT(kCountTopkUpdates, updates);
+        });
+    finalize_distances(results, params);
+    return results;
+}
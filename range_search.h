@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+#include "distance.h"
+#include "profile.h"
+#include "search.h"
+#include "topk.h"
+#include "vector_store.h"
+
+// Receives a batch of range-search hits (finalized distances, in no
+// particular order). Calls are serialized, so the callback needs no lock
+// of its own, but they come from the scanning threads.
+typedef std::function<void(const SearchResult* hits, size_t count)> RangeCallback;
+
+// Ranking value a hit must not exceed for radius, in the units
+// finalize_distances() produces: a distance (squared with params.squared)
+// for L2, a minimum similarity for the inner-product metrics.
+inline float range_bound(float radius, const SearchParams& params) {
+    if (active_metric() != kMetricL2) return -radius;
+    if (params.squared) return radius;
+    return radius < 0.0f ? -std::numeric_limits<float>::infinity() : radius * radius;
+}
+
+// Append every row of [begin, end) whose ranking value is <= bound to
+// hits, calling flush(hits) whenever it reaches limit entries. With
+// early_abandon the bound is fixed, so the bounded kernels can stop a
+// candidate as soon as it is out of range. They are handed the next float
+// above bound: an abandoned partial sum reaches that, so it is rejected
+// even though a hit may sit exactly on bound.
+template <class FlushFn>
+inline void range_scan(const float* query, const VectorStore& database, size_t begin, size_t end,
+                       float bound, bool early_abandon, std::vector<SearchResult>& hits, size_t limit,
+                       FlushFn flush) {
+    SEARCH_PROFILE_SCOPE(kTimerScan);
+    SEARCH_PROFILE_COUNT(kCountDistances, end - begin);
+    const DistanceKernel& kernel = active_kernel();
+    const size_t dim = database.dim();
+    const float abandon_at = std::nextafter(bound, std::numeric_limits<float>::infinity());
+    for (size_t i = begin; i < end; i++) {
+        const float dist = early_abandon ? kernel.bounded(query, database.row(i), dim, abandon_at)
+                                         : kernel.distance(query, database.row(i), dim);
+        if (dist <= bound) {
+            hits.push_back({static_cast<int>(i), dist});
+            if (hits.size() >= limit) flush(hits);
+        }
+    }
+}
+
+// All database rows within radius of query (see range_bound), closest
+// first. Unlike brute_force_search there is no k: each worker appends its
+// hits to its own buffer without taking a lock, and the buffers are
+// concatenated and sorted once at the end. Memory grows with the number
+// of hits; use the callback form to bound it.
+inline std::vector<SearchResult> range_search(
+    const float* query,
+    const VectorStore& database,
+    float radius,
+    const SearchParams& params = SearchParams()) {
+
+    const float bound = range_bound(radius, params);
+    const size_t n = database.size();
+    std::vector<std::vector<SearchResult>> hits(parallel_range_count(n, params.task_rows, params));
+    parallel_ranges(n, params.task_rows, params, [&](size_t t, size_t begin, size_t end) {
+        range_scan(query, database, begin, end, bound, params.early_abandon, hits[t],
+                   std::numeric_limits<size_t>::max(), [](std::vector<SearchResult>&) {});
+    });
+
+    size_t total = 0;
+    for (size_t t = 0; t < hits.size(); t++) total += hits[t].size();
+    std::vector<SearchResult> results;
+    results.reserve(total);
+    for (size_t t = 0; t < hits.size(); t++) results.insert(results.end(), hits[t].begin(), hits[t].end());
+    std::sort(results.begin(), results.end());
+    finalize_distances(results, params);
+    return results;
+}
+
+// Streamed range search: every hit is passed to callback in batches of up
+// to buffer_hits, so memory stays at one buffer per worker however many
+// rows match. Workers only synchronize to hand over a full buffer. Returns
+// the number of hits.
+inline size_t range_search(
+    const float* query,
+    const VectorStore& database,
+    float radius,
+    const RangeCallback& callback,
+    const SearchParams& params = SearchParams(),
+    size_t buffer_hits = 4096) {
+
+    const float bound = range_bound(radius, params);
+    const size_t n = database.size();
+    const size_t limit = std::max<size_t>(1, buffer_hits);
+    std::mutex callback_mutex;
+    size_t total = 0;
+    auto flush = [&](std::vector<SearchResult>& hits) {
+        finalize_distances(hits, params);
+        std::lock_guard<std::mutex> lock(callback_mutex);
+        total += hits.size();
+        callback(hits.data(), hits.size());
+        hits.clear();
+    };
+    parallel_ranges(n, params.task_rows, params, [&](size_t, size_t begin, size_t end) {
+        std::vector<SearchResult> hits;
+        hits.reserve(std::min(limit, end - begin));
+        range_scan(query, database, begin, end, bound, params.early_abandon, hits, limit, flush);
+        if (!hits.empty()) flush(hits);
+    });
+    return total;
+}
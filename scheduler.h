@@ -0,0 +1,316 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Chase-Lev work-stealing deque of T* (Chase & Lev 2005, with the C11
+// orderings of Le et al. 2013). The owning thread pushes and pops at the
+// bottom; any thread steals from the top with one CAS, so thieves never
+// take a lock. The ring grows when full; old rings are kept until the
+// deque is destroyed because a thief may still be reading one.
+template <class T>
+class WorkStealingDeque {
+public:
+    explicit WorkStealingDeque(size_t capacity = 256) : top_(0), bottom_(0) {
+        size_t cap = 1;
+        while (cap < capacity) cap <<= 1;
+        rings_.emplace_back(new Ring(cap));
+        ring_.store(rings_.back().get(), std::memory_order_relaxed);
+    }
+
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+    // Owner only.
+    void push(T* item) {
+        const int64_t b = bottom_.load(std::memory_order_relaxed);
+        const int64_t t = top_.load(std::memory_order_acquire);
+        Ring* ring = ring_.load(std::memory_order_relaxed);
+        if (b - t >= static_cast<int64_t>(ring->capacity())) ring = grow(ring, t, b);
+        ring->put(b, item);
+        bottom_.store(b + 1, std::memory_order_release);
+    }
+
+    // Owner only: most recently pushed item, or nullptr if empty.
+    T* pop() {
+        const int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+        Ring* ring = ring_.load(std::memory_order_relaxed);
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top_.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        T* item = ring->get(b);
+        if (t == b) {
+            // Last item: race the thieves for it.
+            if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                item = nullptr;
+            }
+            bottom_.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // Any thread: oldest item, or nullptr if empty or another thread won it.
+    T* steal() {
+        int64_t t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const int64_t b = bottom_.load(std::memory_order_acquire);
+        if (t >= b) return nullptr;
+        T* item = ring_.load(std::memory_order_acquire)->get(t);
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return item;
+    }
+
+    bool empty() const {
+        return top_.load(std::memory_order_acquire) >= bottom_.load(std::memory_order_acquire);
+    }
+
+private:
+    class Ring {
+    public:
+        explicit Ring(size_t capacity) : mask_(capacity - 1), items_(new std::atomic<T*>[capacity]) {}
+        size_t capacity() const { return mask_ + 1; }
+        T* get(int64_t i) const { return items_[static_cast<size_t>(i) & mask_].load(std::memory_order_relaxed); }
+        void put(int64_t i, T* item) { items_[static_cast<size_t>(i) & mask_].store(item, std::memory_order_relaxed); }
+
+    private:
+        size_t mask_;
+        std::unique_ptr<std::atomic<T*>[]> items_;
+    };
+
+    Ring* grow(Ring* ring, int64_t t, int64_t b) {
+        rings_.emplace_back(new Ring(ring->capacity() * 2));
+        Ring* bigger = rings_.back().get();
+        for (int64_t i = t; i < b; i++) bigger->put(i, ring->get(i));
+        ring_.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+    std::atomic<int64_t> top_;
+    std::atomic<int64_t> bottom_;
+    std::atomic<Ring*> ring_;
+    std::vector<std::unique_ptr<Ring>> rings_;   // owner only
+};
+
+// Work-stealing pool for the search entry points. run(n, grain, fn) splits
+// [0, n) into tasks of grain items and pushes them onto the calling
+// thread's deque; the caller works through its own tasks newest first
+// while idle workers steal the oldest ones from every deque. Because each
+// caller always executes its own job, a short query submitted next to a
+// long batch runs immediately on its own thread and is helped by whichever
+// workers free up, instead of queueing behind the batch.
+//
+// Any number of threads may call run() concurrently (up to kCallerSlots
+// non-worker callers at once; beyond that a call runs inline). Calls from
+// inside a task use the worker's own deque.
+class TaskScheduler {
+public:
+    static const size_t kCallerSlots = 64;
+
+    // num_workers background threads; callers add themselves on top, so a
+    // single caller with num_workers = threads - 1 keeps threads cores busy.
+    explicit TaskScheduler(size_t num_workers) : queued_(0), sleeping_(0), stop_(false) {
+        for (size_t i = 0; i < num_workers + kCallerSlots; i++) slots_.emplace_back(new Slot());
+        for (size_t i = 0; i < num_workers; i++) {
+            slots_[i]->in_use.store(true, std::memory_order_relaxed);
+            workers_.emplace_back([this, i] { work(i); });
+        }
+    }
+
+    ~TaskScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex_);
+            stop_ = true;
+        }
+        idle_cv_.notify_all();
+        for (size_t i = 0; i < workers_.size(); i++) workers_[i].join();
+    }
+
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    size_t num_workers() const { return workers_.size(); }
+
+    static size_t task_count(size_t n, size_t grain) {
+        grain = std::max<size_t>(1, grain);
+        return (n + grain - 1) / grain;
+    }
+
+    // Run fn(task, begin, end) for every grain-sized range of [0, n), where
+    // task = begin / grain, and return once all of them have finished.
+    template <class Fn>
+    void run(size_t n, size_t grain, Fn fn) {
+        grain = std::max<size_t>(1, grain);
+        const size_t count = task_count(n, grain);
+        Slot* slot = count > 1 ? acquire_slot() : nullptr;
+        if (!slot) {
+            for (size_t i = 0; i < count; i++) fn(i, i * grain, std::min(n, (i + 1) * grain));
+            return;
+        }
+
+        Job job(&invoke<Fn>, &fn, n, grain, count);
+        // Task storage is reused per slot and nesting depth, so a warmed-up
+        // run() does not allocate.
+        if (slot->task_buffers.size() <= slot->depth) slot->task_buffers.resize(slot->depth + 1);
+        std::vector<Task>& tasks = slot->task_buffers[slot->depth++];
+        if (tasks.size() < count) tasks.resize(count);
+        // Pairs with the sleep predicate in work(): the increment must be
+        // ordered before wake_workers() reads sleeping_ (a relaxed add may
+        // pass that load on ARM), or a worker going to sleep could miss
+        // the whole run.
+        queued_.fetch_add(count, std::memory_order_seq_cst);
+        // Pushed last-first, so the caller pops task 0 first and thieves
+        // take from the far end of the range.
+        for (size_t i = count; i-- > 0;) {
+            tasks[i].job = &job;
+            tasks[i].index = i;
+            slot->deque.push(&tasks[i]);
+        }
+        wake_workers();
+
+        while (Task* task = slot->deque.pop()) execute(task);
+        {
+            std::unique_lock<std::mutex> lock(job.mutex);
+            job.cv.wait(lock, [&job] { return job.done; });
+        }
+        slot->depth--;
+        release_slot(slot);
+    }
+
+private:
+    struct Job {
+        Job(void (*invoke)(void*, size_t, size_t, size_t), void* fn, size_t n, size_t grain, size_t count)
+            : invoke(invoke), fn(fn), n(n), grain(grain), remaining(count), done(false) {}
+        void (*invoke)(void* fn, size_t task, size_t begin, size_t end);
+        void* fn;
+        size_t n;
+        size_t grain;
+        std::atomic<size_t> remaining;
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool done;
+    };
+
+    struct Task {
+        Job* job = nullptr;
+        size_t index = 0;
+    };
+
+    struct Slot {
+        WorkStealingDeque<Task> deque;
+        std::atomic<bool> in_use{false};
+        // Owner only: task arrays of the run() calls active on this slot.
+        std::vector<std::vector<Task>> task_buffers;
+        size_t depth = 0;
+    };
+
+    // The slot of the worker running on this thread, if any.
+    struct Current {
+        const TaskScheduler* owner;
+        Slot* slot;
+    };
+    static Current& current() {
+        static thread_local Current c = {nullptr, nullptr};
+        return c;
+    }
+
+    template <class Fn>
+    static void invoke(void* fn, size_t task, size_t begin, size_t end) {
+        (*static_cast<Fn*>(fn))(task, begin, end);
+    }
+
+    Slot* acquire_slot() {
+        Current& c = current();
+        if (c.owner == this) return c.slot;
+        for (size_t i = workers_.size(); i < slots_.size(); i++) {
+            bool expected = false;
+            if (slots_[i]->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                return slots_[i].get();
+            }
+        }
+        return nullptr;
+    }
+
+    void release_slot(Slot* slot) {
+        if (current().owner != this) slot->in_use.store(false, std::memory_order_release);
+    }
+
+    void execute(Task* task) {
+        queued_.fetch_sub(1, std::memory_order_relaxed);
+        Job& job = *task->job;
+        const size_t begin = task->index * job.grain;
+        job.invoke(job.fn, task->index, begin, std::min(job.n, begin + job.grain));
+        if (job.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            std::lock_guard<std::mutex> lock(job.mutex);
+            job.done = true;
+            job.cv.notify_all();
+        }
+    }
+
+    // Steal from the other deques, starting at a different victim each time.
+    Task* steal(size_t self, uint64_t& seed) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        const size_t n = slots_.size();
+        const size_t start = static_cast<size_t>(seed % n);
+        for (size_t i = 0; i < n; i++) {
+            const size_t victim = (start + i) % n;
+            if (victim == self) continue;
+            if (Task* task = slots_[victim]->deque.steal()) return task;
+        }
+        return nullptr;
+    }
+
+    void wake_workers() {
+        if (sleeping_.load(std::memory_order_seq_cst) == 0) return;
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+        idle_cv_.notify_all();
+    }
+
+    void work(size_t self) {
+        current().owner = this;
+        current().slot = slots_[self].get();
+        uint64_t seed = 0x9E3779B97F4A7C15ull * (self + 1);
+        int idle_rounds = 0;
+        for (;;) {
+            Task* task = slots_[self]->deque.pop();
+            if (!task) task = steal(self, seed);
+            if (task) {
+                execute(task);
+                idle_rounds = 0;
+                continue;
+            }
+            if (++idle_rounds < 64) {
+                std::this_thread::yield();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(idle_mutex_);
+            sleeping_.fetch_add(1, std::memory_order_seq_cst);
+            idle_cv_.wait(lock, [this] { return stop_ || queued_.load(std::memory_order_seq_cst) > 0; });
+            sleeping_.fetch_sub(1, std::memory_order_relaxed);
+            if (stop_) return;
+            idle_rounds = 0;
+        }
+    }
+
+    std::vector<std::unique_ptr<Slot>> slots_;   // workers first, then caller slots
+    std::vector<std::thread> workers_;
+    std::atomic<size_t> queued_;                 // tasks pushed and not yet started
+    std::atomic<size_t> sleeping_;
+    std::mutex idle_mutex_;
+    std::condition_variable idle_cv_;
+    bool stop_;
+};
@@ -0,0 +1,436 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "distance.h"
+#include "id_filter.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "topk.h"
+#include "vector_store.h"
+
+// Progress notification: vectors scanned so far out of total.
+typedef std::function<void(size_t scanned, size_t total)> ProgressCallback;
+
+// Options shared by the search entry points.
+struct SearchParams {
+    // Return squared L2 distances instead of taking sqrt of the final k.
+    bool squared = false;
+
+    // Stop summing a candidate as soon as its partial distance reaches the
+    // current k-th best (checked every kAbandonBlock dimensions). Each check
+    // is a data-dependent branch, so this pays off when most candidates are
+    // rejected well before the last block (high dim, or variance-ordered
+    // dimensions), and can lose to the plain kernel at dim=128 otherwise.
+    bool early_abandon = false;
+
+    // Worker threads for the scan. 0 uses every hardware thread.
+    int num_threads = 1;
+
+    // When set, searches run as tasks on this shared work-stealing pool
+    // instead of splitting the work once over num_threads fresh threads:
+    // a scan becomes one task per task_rows database rows, a batch one task
+    // per query tile, so concurrent callers interleave on the same cores.
+    TaskScheduler* scheduler = nullptr;
+    size_t task_rows = 16384;
+
+    // batch_search tiling: queries per tile, and the byte budget of the
+    // database block each query tile is scanned against (sized for L2).
+    size_t query_block = 64;
+    size_t db_block_bytes = 256 * 1024;
+
+    // Optional progress reporting for brute_force_search. The callback fires
+    // once per progress_chunk vectors (never per vector); calls from worker
+    // threads are serialized. Leave empty for a quiet library call.
+    ProgressCallback progress;
+    size_t progress_chunk = 1 << 16;
+};
+
+// Shared scan counter that forwards chunk completions to params.progress.
+class ProgressReporter {
+public:
+    ProgressReporter(const SearchParams& params, size_t total)
+        : callback_(params.progress), total_(total), scanned_(0) {}
+
+    bool enabled() const { return static_cast<bool>(callback_); }
+
+    void add(size_t count) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        scanned_ += count;
+        callback_(scanned_, total_);
+    }
+
+private:
+    const ProgressCallback& callback_;
+    size_t total_;
+    size_t scanned_;
+    std::mutex mutex_;
+};
+
+// Scan database rows [begin, end) into topk using squared L2 distance.
+// With early_abandon, each candidate is bounded by the current threshold.
+// Row i is pushed as id_base + i (for stores that hold a slice of a larger
+// dataset, e.g. one streamed chunk).
+inline void scan_range(const float* query, const VectorStore& database,
+                       size_t begin, size_t end, TopK& topk, bool early_abandon = false,
+                       size_t id_base = 0) {
+    SEARCH_PROFILE_SCOPE(kTimerScan);
+    SEARCH_PROFILE_COUNT(kCountDistances, end - begin);
+    SEARCH_PROFILE_ONLY(size_t updates = 0;)
+    const DistanceKernel& kernel = active_kernel();
+    const size_t dim = database.dim();
+    if (early_abandon) {
+        const BoundedDistanceFn dist_fn = kernel.bounded;
+        for (size_t i = begin; i < end; i++) {
+            SEARCH_PROFILE_ONLY(updates +=)
+            topk.push(static_cast<int>(id_base + i), dist_fn(query, database.row(i), dim, topk.threshold()));
+        }
+    }
+    else {
+        const DistanceFn dist_fn = kernel.distance;
+        for (size_t i = begin; i < end; i++) {
+            SEARCH_PROFILE_ONLY(updates +=)
+            topk.push(static_cast<int>(id_base + i), dist_fn(query, database.row(i), dim));
+        }
+    }
+    SEARCH_PROFILE_COUNT(kCountTopkUpdates, updates);
+}
+
+// scan_range restricted to the rows whose id (id_base + i) filter allows.
+// The filter is walked a 64-id word at a time: an all-zero word skips its
+// rows with no distance computed, and only the set bits of the others are
+// visited.
+inline void scan_range_filtered(const float* query, const VectorStore& database,
+                                size_t begin, size_t end, TopK& topk, const IdFilter& filter,
+                                bool early_abandon = false, size_t id_base = 0) {
+    SEARCH_PROFILE_SCOPE(kTimerScan);
+    SEARCH_PROFILE_ONLY(size_t distances = 0;)
+    SEARCH_PROFILE_ONLY(size_t updates = 0;)
+    const DistanceKernel& kernel = active_kernel();
+    const size_t dim = database.dim();
+    const size_t last = id_base + end;
+    for (size_t id = id_base + begin; id < last;) {
+        const size_t w = id >> 6;
+        const size_t word_end = std::min(last, (w + 1) << 6);
+        uint64_t bits = filter.word(w) >> (id & 63);
+        if (word_end - id < 64) bits &= (uint64_t(1) << (word_end - id)) - 1;
+        for (; bits != 0; bits &= bits - 1) {
+            const size_t row = id - id_base + static_cast<size_t>(__builtin_ctzll(bits));
+            const float dist = early_abandon ? kernel.bounded(query, database.row(row), dim, topk.threshold())
+                                             : kernel.distance(query, database.row(row), dim);
+            SEARCH_PROFILE_ONLY(distances++;)
+            SEARCH_PROFILE_ONLY(updates +=)
+            topk.push(static_cast<int>(id_base + row), dist);
+        }
+        id = word_end;
+    }
+    SEARCH_PROFILE_COUNT(kCountDistances, distances);
+    SEARCH_PROFILE_COUNT(kCountTopkUpdates, updates);
+}
+
+inline int resolve_thread_count(int requested) {
+    if (requested > 0) return requested;
+    unsigned hw = std::thread::hardware_concurrency();
+    return hw == 0 ? 1 : static_cast<int>(hw);
+}
+
+// Threads parallel_for will use for n items (never more than n, at least 1).
+inline size_t parallel_thread_count(size_t n, int requested) {
+    size_t num_threads = static_cast<size_t>(resolve_thread_count(requested));
+    if (num_threads > n) num_threads = n == 0 ? 1 : n;
+    return num_threads;
+}
+
+// Split [0, n) into parallel_thread_count(n, requested) contiguous ranges and
+// run fn(thread, begin, end) for each. A single range runs on the caller.
+template <class Fn>
+inline void parallel_for(size_t n, int requested, Fn fn) {
+    const size_t num_threads = parallel_thread_count(n, requested);
+    if (num_threads == 1) {
+        fn(size_t(0), size_t(0), n);
+        return;
+    }
+    std::vector<std::thread> workers;
+    workers.reserve(num_threads);
+    for (size_t t = 0; t < num_threads; t++) {
+        size_t begin = n * t / num_threads;
+        size_t end = n * (t + 1) / num_threads;
+        workers.emplace_back([&fn, t, begin, end] { fn(t, begin, end); });
+    }
+    for (size_t t = 0; t < num_threads; t++) {
+        workers[t].join();
+    }
+}
+
+// Number of task indices parallel_ranges(n, grain, params, fn) passes to fn,
+// for sizing per-task state: one per grain items on the scheduler, one per
+// thread otherwise.
+inline size_t parallel_range_count(size_t n, size_t grain, const SearchParams& params) {
+    return params.scheduler ? std::max<size_t>(1, TaskScheduler::task_count(n, grain))
+                            : parallel_thread_count(n, params.num_threads);
+}
+
+// parallel_for over params.scheduler in grain-item tasks when one is set,
+// else over params.num_threads threads. fn(task, begin, end).
+template <class Fn>
+inline void parallel_ranges(size_t n, size_t grain, const SearchParams& params, Fn fn) {
+    if (params.scheduler) params.scheduler->run(n, grain, fn);
+    else parallel_for(n, params.num_threads, fn);
+}
+
+// Convert the squared distances used for ranking into the distances callers
+// asked for. Only the final k results pay for a sqrt. With an inner-product
+// metric the ranking values are negated similarities, and the final k get
+// their sign back (largest similarity first).
+inline void finalize_distances(SearchResult* results, size_t n, const SearchParams& params) {
+    if (active_metric() != kMetricL2) {
+        for (size_t i = 0; i < n; i++) results[i].distance = -results[i].distance;
+        return;
+    }
+    if (params.squared) return;
+    for (size_t i = 0; i < n; i++) {
+        results[i].distance = std::sqrt(results[i].distance);
+    }
+}
+
+inline void finalize_distances(std::vector<SearchResult>& results, const SearchParams& params) {
+    finalize_distances(results.data(), results.size(), params);
+}
+
+// Per-thread working memory for the allocation-free search calls: the
+// partial and merged selections of a scan, kept between queries so that
+// after the first call with a given k and thread count nothing is
+// allocated. One scratch per calling thread; it is not thread-safe.
+//
+// A num_threads split (no params.scheduler) runs on a pool owned by the
+// scratch instead of threads started per call, so it stays allocation-free
+// as well. keep_threads = false skips the pool, for a scratch that lives
+// for one call only.
+class SearchScratch {
+public:
+    explicit SearchScratch(bool keep_threads = true) : keep_threads_(keep_threads), pool_threads_(0) {}
+
+    SearchScratch(const SearchScratch&) = delete;
+    SearchScratch& operator=(const SearchScratch&) = delete;
+
+    // The first count selections, emptied and sized for k.
+    std::vector<TopK>& partials(size_t count, size_t k) {
+        if (partial_.size() < count) partial_.resize(count);
+        for (size_t i = 0; i < count; i++) partial_[i].reset(k);
+        return partial_;
+    }
+
+    TopK& merged(size_t k) {
+        merged_.reset(k);
+        return merged_;
+    }
+
+    // Pool running threads ranges at once: threads - 1 workers plus the
+    // caller, started on first use and kept while threads stays the same.
+    // Null for one thread or without keep_threads.
+    TaskScheduler* pool(size_t threads) {
+        if (!keep_threads_ || threads <= 1) return nullptr;
+        if (!pool_ || pool_threads_ != threads) {
+            pool_.reset();
+            pool_.reset(new TaskScheduler(threads - 1));
+            pool_threads_ = threads;
+        }
+        return pool_.get();
+    }
+
+private:
+    std::vector<TopK> partial_;
+    TopK merged_;
+    bool keep_threads_;
+    std::unique_ptr<TaskScheduler> pool_;
+    size_t pool_threads_;
+};
+
+// Exhaustive top-k driver shared by the brute-force scans. [0, n) is split
+// over params.num_threads (or into task_rows tasks on params.scheduler);
+// each worker runs scan(begin, end, topk) on its own TopK, one progress
+// chunk at a time when a progress callback is set, and the partial
+// selections are merged. Returns closest-first results with whatever
+// distances scan pushed (not finalized).
+//
+// This form writes up to k results to out and returns the count; its
+// selections, and the pool a num_threads split runs on, live in scratch.
+template <class ScanFn>
+inline size_t parallel_scan_topk(size_t n, int k, const SearchParams& params, SearchScratch& scratch,
+                                 SearchResult* out, ScanFn scan) {
+    const size_t kk = static_cast<size_t>(k);
+    const size_t chunk = std::max<size_t>(1, params.progress_chunk);
+    ProgressReporter reporter(params, n);
+
+    // Without a scheduler the scratch's pool takes the place of
+    // parallel_for, with one task per thread as in the fixed split.
+    const size_t threads = parallel_thread_count(n, params.num_threads);
+    TaskScheduler* pool = params.scheduler ? nullptr : scratch.pool(threads);
+    const size_t pool_grain = (n + threads - 1) / threads;
+    const size_t count = pool ? std::max<size_t>(1, TaskScheduler::task_count(n, pool_grain))
+                              : parallel_range_count(n, params.task_rows, params);
+    std::vector<TopK>& partial = scratch.partials(count, kk);
+
+    auto scan_task = [&](size_t t, size_t begin, size_t end) {
+        if (!reporter.enabled()) {
+            scan(begin, end, partial[t]);
+            return;
+        }
+        for (size_t b = begin; b < end; b += chunk) {
+            size_t e = std::min(b + chunk, end);
+            scan(b, e, partial[t]);
+            reporter.add(e - b);
+        }
+    };
+    if (pool) pool->run(n, pool_grain, scan_task);
+    else parallel_ranges(n, params.task_rows, params, scan_task);
+    SEARCH_PROFILE_SCOPE(kTimerTopkMerge);
+    TopK& topk = scratch.merged(kk);
+    for (size_t t = 0; t < count; t++) {
+        topk.merge(partial[t]);
+    }
+    return topk.take_sorted(out);
+}
+
+template <class ScanFn>
+inline std::vector<SearchResult> parallel_scan_topk(size_t n, int k, const SearchParams& params,
+                                                    ScanFn scan) {
+    SearchScratch scratch(false);
+    std::vector<SearchResult> results(static_cast<size_t>(k));
+    results.resize(parallel_scan_topk(n, k, params, scratch, results.data(), scan));
+    return results;
+}
+
+// Brute force k-NN search: compares query to every vector in database
+// Time Complexity: O(n * d) where n = vectors, d = dimensions
+// Candidates are ranked by squared L2 distance, which orders identically to
+// L2 distance but avoids a sqrt per database vector.
+//
+// With params.num_threads > 1 the database is split into one contiguous
+// chunk per thread. Each worker keeps its own bounded TopK and the
+// per-thread selections are merged into the global top-k at the end.
+inline std::vector<SearchResult> brute_force_search(
+    const float* query,
+    const VectorStore& database,
+    int k,
+    const SearchParams& params = SearchParams()) {
+
+    std::vector<SearchResult> results = parallel_scan_topk(
+        database.size(), k, params, [&](size_t begin, size_t end, TopK& topk) {
+            scan_range(query, database, begin, end, topk, params.early_abandon);
+        });
+    finalize_distances(results, params);
+    return results;
+}
+
+// Allocation-free brute force: writes up to k closest-first results to out
+// (room for k) and returns how many were written. All working memory comes
+// from scratch, so a thread that reuses its scratch and output buffer makes
+// no heap allocation per query once warmed up, on any number of threads
+// (a num_threads split reuses the scratch's pool).
+inline size_t brute_force_search(
+    const float* query,
+    const VectorStore& database,
+    int k,
+    SearchResult* out,
+    SearchScratch& scratch,
+    const SearchParams& params = SearchParams()) {
+
+    size_t count = parallel_scan_topk(
+        database.size(), k, params, scratch, out, [&](size_t begin, size_t end, TopK& topk) {
+            scan_range(query, database, begin, end, topk, params.early_abandon);
+        });
+    finalize_distances(out, count, params);
+    return count;
+}
+
+// Filtered brute force: the top k among the rows filter allows, with the
+// filter applied inside the scan (see scan_range_filtered), so fewer than
+// k results come back only when fewer than k rows are allowed.
+inline std::vector<SearchResult> brute_force_search(
+    const float* query,
+    const VectorStore& database,
+    int k,
+    const IdFilter& filter,
+    const SearchParams& params = SearchParams()) {
+
+    std::vector<SearchResult> results = parallel_scan_topk(
+        database.size(), k, params, [&](size_t begin, size_t end, TopK& topk) {
+            scan_range_filtered(query, database, begin, end, topk, filter, params.early_abandon);
+        });
+    finalize_distances(results, params);
+    return results;
+}
+
+// Scan queries [q_begin, q_end) against the whole database, tiled so that
+// each database block is read from memory once per query tile and then
+// reused from L2 by every query in the tile. topk is indexed by query;
+// ids are offset by id_base as in scan_range. A filter restricts every
+// query to the rows it allows.
+inline void batch_scan(const VectorStore& queries, size_t q_begin, size_t q_end,
+                       const VectorStore& database, const SearchParams& params,
+                       std::vector<TopK>& topk, size_t id_base = 0, const IdFilter* filter = nullptr) {
+    const size_t n = database.size();
+    const size_t row_bytes = database.stride() * sizeof(float);
+    const size_t block_rows = std::max<size_t>(1, params.db_block_bytes / row_bytes);
+    const size_t query_block = std::max<size_t>(1, params.query_block);
+
+    for (size_t qb = q_begin; qb < q_end; qb += query_block) {
+        size_t qe = std::min(qb + query_block, q_end);
+        for (size_t b = 0; b < n; b += block_rows) {
+            size_t be = std::min(b + block_rows, n);
+            for (size_t q = qb; q < qe; q++) {
+                if (filter) {
+                    scan_range_filtered(queries.row(q), database, b, be, topk[q], *filter,
+                                        params.early_abandon, id_base);
+                }
+                else {
+                    scan_range(queries.row(q), database, b, be, topk[q], params.early_abandon, id_base);
+                }
+            }
+        }
+    }
+}
+
+// Batch k-NN search: returns one closest-first top-k list per query.
+// Query tiles are distributed over params.num_threads workers; each query's
+// TopK is owned by exactly one worker, so no merge step is needed.
+inline std::vector<std::vector<SearchResult>> batch_search(
+    const VectorStore& queries,
+    const VectorStore& database,
+    int k,
+    const SearchParams& params = SearchParams(),
+    const IdFilter* filter = nullptr) {
+
+    const size_t nq = queries.size();
+    std::vector<TopK> topk(nq, TopK(static_cast<size_t>(k)));
+
+    parallel_ranges(nq, params.query_block, params, [&](size_t, size_t begin, size_t end) {
+        batch_scan(queries, begin, end, database, params, topk, 0, filter);
+    });
+
+    std::vector<std::vector<SearchResult>> results(nq);
+    for (size_t q = 0; q < nq; q++) {
+        results[q] = topk[q].take_sorted();
+        finalize_distances(results[q], params);
+    }
+    return results;
+}
+
+// Filtered batch k-NN: every query gets the top k among the rows filter
+// allows.
+inline std::vector<std::vector<SearchResult>> batch_search(
+    const VectorStore& queries,
+    const VectorStore& database,
+    int k,
+    const IdFilter& filter,
+    const SearchParams& params = SearchParams()) {
+    return batch_search(queries, database, k, params, &filter);
+}
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "distance.h"
+#include "search.h"
+#include "topk.h"
+#include "vector_store.h"
+
+// Updatable vector database: rows live in fixed-capacity segments whose
+// buffers are allocated once and never move, so inserts only ever append
+// into pre-reserved memory. Deletes set a tombstone bit; scans skip
+// tombstoned rows a 64-bit word at a time. compact() rewrites sealed
+// segments that have accumulated deletes, either on demand or from a
+// background thread.
+//
+// Every vector gets a stable id at insertion (0, 1, 2, ... in insertion
+// order) that search results report and that survives compaction.
+//
+// Thread safety: insert, remove and compaction are serialized by one mutex.
+// Searches take a snapshot of the segment list under the mutex and scan
+// without it; rows are published to readers by a release store of the
+// segment's row count, and tombstones are atomic words, so a search runs
+// alongside every mutation and sees each row either before or after it.
+class SegmentedStore {
+public:
+    static const size_t kDefaultSegmentRows = 1 << 16;
+
+    explicit SegmentedStore(size_t dim, size_t segment_rows = kDefaultSegmentRows)
+        : dim_(dim), segment_rows_((std::max<size_t>(64, segment_rows) + 63) / 64 * 64),
+          live_(0), stop_(false) {}
+
+    ~SegmentedStore() { stop_background_compaction(); }
+
+    SegmentedStore(const SegmentedStore&) = delete;
+    SegmentedStore& operator=(const SegmentedStore&) = delete;
+
+    size_t dim() const { return dim_; }
+    size_t segment_rows() const { return segment_rows_; }
+
+    // Live (inserted and not deleted) vectors.
+    size_t size() const { return live_.load(std::memory_order_relaxed); }
+
+    size_t num_segments() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return segments_.size();
+    }
+
+    // Append one vector of dim() floats and return its id.
+    int insert(const float* v) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (segments_.empty() || segments_.back()->full()) {
+            segments_.push_back(std::make_shared<Segment>(dim_, segment_rows_));
+        }
+        Segment& seg = *segments_.back();
+        const size_t slot = seg.count.load(std::memory_order_relaxed);
+        const int id = static_cast<int>(locations_.size());
+        std::memcpy(seg.rows.row(slot), v, dim_ * sizeof(float));
+        seg.ids[slot] = id;
+        seg.count.store(slot + 1, std::memory_order_release);
+        locations_.push_back(Location{segments_.size() - 1, slot});
+        live_.fetch_add(1, std::memory_order_relaxed);
+        return id;
+    }
+
+    // Tombstone id. Returns false if it does not exist or is already deleted.
+    bool remove(int id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (id < 0 || static_cast<size_t>(id) >= locations_.size()) return false;
+        Location& loc = locations_[static_cast<size_t>(id)];
+        if (loc.segment == kRemoved) return false;
+        segments_[loc.segment]->tombstone(loc.slot);
+        loc.segment = kRemoved;
+        live_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Rewrite every sealed (full) segment whose deleted fraction is at least
+    // min_deleted_fraction, and drop segments with no live rows. Live rows
+    // are copied outside the lock; only the swap is serialized with
+    // inserts and deletes. Returns the number of slots reclaimed.
+    size_t compact(double min_deleted_fraction = 0.25) {
+        std::lock_guard<std::mutex> lock(compact_mutex_);
+        size_t reclaimed = 0;
+        for (size_t s = 0;; s++) {
+            std::shared_ptr<Segment> old;
+            {
+                std::lock_guard<std::mutex> guard(mutex_);
+                if (s + 1 >= segments_.size()) break;   // never the active segment
+                old = segments_[s];
+            }
+            const size_t count = old->count.load(std::memory_order_acquire);
+            const size_t deleted = old->deleted.load(std::memory_order_relaxed);
+            if (deleted == 0 || deleted < min_deleted_fraction * count) continue;
+
+            // Copy live rows. A delete landing after its row was copied is
+            // re-applied below, under the lock.
+            std::shared_ptr<Segment> fresh = std::make_shared<Segment>(dim_, count - deleted);
+            std::vector<size_t> moved_from;
+            moved_from.reserve(count - deleted);
+            for (size_t i = 0; i < count; i++) {
+                if (old->is_tombstoned(i)) continue;
+                const size_t slot = moved_from.size();
+                if (slot == fresh->capacity) break;
+                std::memcpy(fresh->rows.row(slot), old->rows.row(i), dim_ * sizeof(float));
+                fresh->ids[slot] = old->ids[i];
+                moved_from.push_back(i);
+            }
+            fresh->count.store(moved_from.size(), std::memory_order_release);
+
+            std::lock_guard<std::mutex> guard(mutex_);
+            for (size_t slot = 0; slot < moved_from.size(); slot++) {
+                Location& loc = locations_[static_cast<size_t>(fresh->ids[slot])];
+                if (old->is_tombstoned(moved_from[slot])) fresh->tombstone(slot);
+                else loc.slot = slot;
+            }
+            reclaimed += count - moved_from.size();
+            if (fresh->count.load(std::memory_order_relaxed) == fresh->deleted.load(std::memory_order_relaxed)) {
+                remove_segment(s);
+                s--;
+            }
+            else {
+                segments_[s] = fresh;
+            }
+        }
+        return reclaimed;
+    }
+
+    // Run compact(min_deleted_fraction) every interval until stopped.
+    void start_background_compaction(std::chrono::milliseconds interval, double min_deleted_fraction = 0.25) {
+        stop_background_compaction();
+        stop_ = false;
+        compactor_ = std::thread([this, interval, min_deleted_fraction] {
+            std::unique_lock<std::mutex> lock(stop_mutex_);
+            while (!stop_cv_.wait_for(lock, interval, [this] { return stop_; })) {
+                lock.unlock();
+                compact(min_deleted_fraction);
+                lock.lock();
+            }
+        });
+    }
+
+    void stop_background_compaction() {
+        {
+            std::lock_guard<std::mutex> lock(stop_mutex_);
+            stop_ = true;
+        }
+        stop_cv_.notify_all();
+        if (compactor_.joinable()) compactor_.join();
+    }
+
+    // Immutable view used by one search: the segments and their published
+    // row counts at the time of the call.
+    struct Snapshot {
+        struct Part {
+            std::shared_ptr<const void> keep;   // holds the segment alive
+            const VectorStore* rows;
+            const int* ids;
+            const std::atomic<uint64_t>* tombstones;
+            size_t count;
+            size_t first;                       // offset in the concatenated slot range
+        };
+        std::vector<Part> parts;
+        size_t slots = 0;
+    };
+
+    Snapshot snapshot() const {
+        Snapshot snap;
+        std::lock_guard<std::mutex> lock(mutex_);
+        snap.parts.reserve(segments_.size());
+        for (size_t i = 0; i < segments_.size(); i++) {
+            const Segment& seg = *segments_[i];
+            Snapshot::Part part;
+            part.keep = segments_[i];
+            part.rows = &seg.rows;
+            part.ids = seg.ids.data();
+            part.tombstones = seg.tombstones.get();
+            part.count = seg.count.load(std::memory_order_acquire);
+            part.first = snap.slots;
+            snap.slots += part.count;
+            snap.parts.push_back(part);
+        }
+        return snap;
+    }
+
+private:
+    static const size_t kRemoved = static_cast<size_t>(-1);
+
+    struct Segment {
+        Segment(size_t dim, size_t rows_capacity)
+            : rows(dim, rows_capacity), ids(rows_capacity, -1), capacity(rows_capacity),
+              tombstones(new std::atomic<uint64_t>[(rows_capacity + 63) / 64]), count(0), deleted(0) {
+            for (size_t w = 0; w < (capacity + 63) / 64; w++) tombstones[w].store(0, std::memory_order_relaxed);
+        }
+
+        bool full() const { return count.load(std::memory_order_relaxed) == capacity; }
+
+        void tombstone(size_t slot) {
+            uint64_t bit = uint64_t(1) << (slot % 64);
+            if (!(tombstones[slot / 64].fetch_or(bit, std::memory_order_release) & bit)) {
+                deleted.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        bool is_tombstoned(size_t slot) const {
+            return (tombstones[slot / 64].load(std::memory_order_acquire) >> (slot % 64)) & 1;
+        }
+
+        VectorStore rows;           // capacity rows, allocated once
+        std::vector<int> ids;       // stable id of each slot
+        size_t capacity;
+        std::unique_ptr<std::atomic<uint64_t>[]> tombstones;
+        std::atomic<size_t> count;  // published rows
+        std::atomic<size_t> deleted;
+    };
+
+    struct Location {
+        size_t segment;   // kRemoved once deleted
+        size_t slot;
+    };
+
+    void remove_segment(size_t s) {
+        segments_.erase(segments_.begin() + static_cast<std::ptrdiff_t>(s));
+        for (size_t i = 0; i < locations_.size(); i++) {
+            if (locations_[i].segment != kRemoved && locations_[i].segment > s) locations_[i].segment--;
+        }
+    }
+
+    size_t dim_;
+    size_t segment_rows_;
+    std::vector<std::shared_ptr<Segment>> segments_;
+    std::vector<Location> locations_;   // indexed by id
+    std::atomic<size_t> live_;
+    mutable std::mutex mutex_;
+    std::mutex compact_mutex_;
+
+    std::thread compactor_;
+    std::mutex stop_mutex_;
+    std::condition_variable stop_cv_;
+    bool stop_;
+};
+
+// Scan concatenated snapshot slots [begin, end) into topk, skipping
+// tombstoned rows; all-deleted words cost one load per 64 rows.
+inline void scan_segments(const float* query, const SegmentedStore::Snapshot& snap,
+                          size_t begin, size_t end, TopK& topk, bool early_abandon) {
+    const DistanceKernel& kernel = active_kernel();
+    for (size_t p = 0; p < snap.parts.size() && begin < end; p++) {
+        const SegmentedStore::Snapshot::Part& part = snap.parts[p];
+        if (begin >= part.first + part.count) continue;
+        const size_t b = begin - part.first;
+        const size_t e = std::min(end - part.first, part.count);
+        const size_t dim = part.rows->dim();
+
+        for (size_t i = b; i < e;) {
+            const uint64_t word = part.tombstones[i / 64].load(std::memory_order_acquire) >> (i % 64);
+            const size_t run = std::min(e, (i / 64 + 1) * 64) - i;
+            const uint64_t mask = run == 64 ? ~uint64_t(0) : (uint64_t(1) << run) - 1;
+            if ((word & mask) == mask) {
+                i += run;
+                continue;
+            }
+            for (size_t j = 0; j < run; j++, i++) {
+                if ((word >> j) & 1) continue;
+                float d = early_abandon ? kernel.bounded(query, part.rows->row(i), dim, topk.threshold())
+                                        : kernel.distance(query, part.rows->row(i), dim);
+                topk.push(part.ids[i], d);
+            }
+        }
+        begin = part.first + e;
+    }
+}
+
+// Brute force k-NN over the live rows of a SegmentedStore; ids are the
+// stable ids returned by insert().
+inline std::vector<SearchResult> brute_force_search(
+    const float* query,
+    const SegmentedStore& database,
+    int k,
+    const SearchParams& params = SearchParams()) {
+
+    const SegmentedStore::Snapshot snap = database.snapshot();
+    std::vector<SearchResult> results = parallel_scan_topk(
+        snap.slots, k, params, [&](size_t begin, size_t end, TopK& topk) {
+            scan_segments(query, snap, begin, end, topk, params.early_abandon);
+        });
+    finalize_distances(results, params);
+    return results;
+}
@@ -0,0 +1,435 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "distance.h"
+#include "topk.h"
+#include "vector_store.h"
+
+// Wire protocol (native little-endian, one request or response per frame;
+// a connection carries any number of requests back to back):
+//
+//   request : uint32 magic 'VSRQ', uint32 k, uint32 dim, uint32 ranking,
+//             dim x float32
+//   response: uint32 magic 'VSRS', uint32 status, uint32 count,
+//             count x {int32 id, float32 distance}, closest first
+//
+// ranking (see ranking_code) is the metric and distance form the client
+// will label the results with. status is kStatusOk, kStatusBadRequest
+// (wrong dimension or k out of range), kStatusServerError (the search
+// itself failed, e.g. out of memory) or kStatusRankingMismatch (the
+// server ranks by another metric or distance form); the connection stays
+// usable either way.
+static const uint32_t kRequestMagic = 0x51525356;    // "VSRQ"
+static const uint32_t kResponseMagic = 0x53525356;   // "VSRS"
+static const uint32_t kStatusOk = 0;
+static const uint32_t kStatusBadRequest = 1;
+static const uint32_t kStatusServerError = 2;
+static const uint32_t kStatusRankingMismatch = 3;
+static const uint32_t kMaxRequestK = 4096;
+
+// The ranking word of a request: the metric, plus 0x100 when L2 distances
+// are reported squared (--squared does not apply to the inner-product
+// metrics).
+inline uint32_t ranking_code(Metric metric, bool squared) {
+    return static_cast<uint32_t>(metric) | (metric == kMetricL2 && squared ? 0x100u : 0u);
+}
+
+// Runs one query set through a batched search path and returns one
+// closest-first list per query.
+typedef std::function<std::vector<std::vector<SearchResult>>(const VectorStore& queries, int k)> BatchSearchFn;
+
+// Gathers concurrent single-query requests into micro-batches. A batch is
+// dispatched when max_batch requests are waiting or window has passed since
+// the oldest one arrived, whichever is first, so a lone request waits at
+// most window and a burst is served by one batched scan.
+class QueryBatcher {
+public:
+    QueryBatcher(size_t dim, BatchSearchFn search, std::chrono::microseconds window, size_t max_batch)
+        : dim_(dim), search_(search), window_(window), max_batch_(std::max<size_t>(1, max_batch)),
+          stop_(false), batches_(0), queries_(0) {
+        worker_ = std::thread([this] { run(); });
+    }
+
+    ~QueryBatcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        worker_.join();
+    }
+
+    QueryBatcher(const QueryBatcher&) = delete;
+    QueryBatcher& operator=(const QueryBatcher&) = delete;
+
+    size_t dim() const { return dim_; }
+    size_t batches() const { return batches_.load(); }
+    size_t queries() const { return queries_.load(); }
+
+    // Blocking search of one query of dim() floats. Rethrows whatever the
+    // batch search threw for the batch this query was part of.
+    std::vector<SearchResult> search(const float* query, int k) {
+        std::shared_ptr<Pending> pending = std::make_shared<Pending>();
+        pending->query.assign(query, query + dim_);
+        pending->k = k;
+        pending->arrival = Clock::now();
+        std::future<std::vector<SearchResult>> result = pending->result.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(pending);
+        }
+        cv_.notify_all();
+        return result.get();
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Pending {
+        std::vector<float> query;
+        int k;
+        Clock::time_point arrival;
+        std::promise<std::vector<SearchResult>> result;
+    };
+
+    void run() {
+        for (;;) {
+            std::vector<std::shared_ptr<Pending>> batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+                if (queue_.empty()) return;   // stopping and drained
+                const Clock::time_point deadline = queue_.front()->arrival + window_;
+                cv_.wait_until(lock, deadline, [this] { return stop_ || queue_.size() >= max_batch_; });
+                const size_t n = std::min(queue_.size(), max_batch_);
+                batch.assign(queue_.begin(), queue_.begin() + static_cast<std::ptrdiff_t>(n));
+                queue_.erase(queue_.begin(), queue_.begin() + static_cast<std::ptrdiff_t>(n));
+            }
+
+            // A failed batch fails each of its requests, not the server:
+            // every promise gets the exception so no client waits forever.
+            std::vector<std::vector<SearchResult>> results;
+            try {
+                VectorStore queries(dim_, batch.size());
+                int k = 1;
+                for (size_t i = 0; i < batch.size(); i++) {
+                    std::memcpy(queries.row(i), batch[i]->query.data(), dim_ * sizeof(float));
+                    k = std::max(k, batch[i]->k);
+                }
+                results = search_(queries, k);
+            }
+            catch (...) {
+                std::cerr << "Error: batch search of " << batch.size() << " queries failed" << std::endl;
+                std::exception_ptr error = std::current_exception();
+                for (size_t i = 0; i < batch.size(); i++) batch[i]->result.set_exception(error);
+                continue;
+            }
+            for (size_t i = 0; i < batch.size(); i++) {
+                std::vector<SearchResult> r = i < results.size() ? results[i] : std::vector<SearchResult>();
+                if (r.size() > static_cast<size_t>(batch[i]->k)) r.resize(static_cast<size_t>(batch[i]->k));
+                batch[i]->result.set_value(r);
+            }
+            batches_++;
+            queries_ += batch.size();
+        }
+    }
+
+    size_t dim_;
+    BatchSearchFn search_;
+    std::chrono::microseconds window_;
+    size_t max_batch_;
+    bool stop_;
+    std::deque<std::shared_ptr<Pending>> queue_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread worker_;
+    std::atomic<size_t> batches_;
+    std::atomic<size_t> queries_;
+};
+
+inline bool read_full(int fd, void* buf, size_t n) {
+    char* p = static_cast<char*>(buf);
+    while (n > 0) {
+        ssize_t r = recv(fd, p, n, 0);
+        if (r <= 0) return false;
+        p += r;
+        n -= static_cast<size_t>(r);
+    }
+    return true;
+}
+
+inline bool write_full(int fd, const void* buf, size_t n) {
+    const char* p = static_cast<const char*>(buf);
+    while (n > 0) {
+        ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+        if (r <= 0) return false;
+        p += r;
+        n -= static_cast<size_t>(r);
+    }
+    return true;
+}
+
+// Open a listening (listen = true) or connected socket for address, which
+// is "unix:PATH" for a Unix domain socket or "[HOST:]PORT" for TCP.
+// Returns -1 with a message on failure.
+inline int open_socket(const std::string& address, bool listen) {
+    if (address.compare(0, 5, "unix:") == 0) {
+        const std::string path = address.substr(5);
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            std::cerr << "Error: Bad Unix socket path " << path << std::endl;
+            return -1;
+        }
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        if (listen) unlink(path.c_str());
+        int rc = listen ? bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))
+                        : connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        if (rc != 0 || (listen && ::listen(fd, 128) != 0)) {
+            std::cerr << "Error: Cannot " << (listen ? "listen on " : "connect to ") << address << std::endl;
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    std::string host = listen ? "0.0.0.0" : "127.0.0.1";
+    std::string port = address;
+    size_t colon = address.rfind(':');
+    if (colon != std::string::npos) {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listen ? AI_PASSIVE : 0;
+    addrinfo* info = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &info) != 0 || !info) {
+        std::cerr << "Error: Cannot resolve " << address << std::endl;
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo* ai = info; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        if (listen) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        int rc = listen ? bind(fd, ai->ai_addr, ai->ai_addrlen) : connect(fd, ai->ai_addr, ai->ai_addrlen);
+        if (rc != 0 || (listen && ::listen(fd, 128) != 0)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(info);
+    if (fd < 0) std::cerr << "Error: Cannot " << (listen ? "listen on " : "connect to ") << address << std::endl;
+    return fd;
+}
+
+// Set from a signal handler to make SearchServer::run return.
+inline std::atomic<bool>& server_stop_flag() {
+    static std::atomic<bool> stop(false);
+    return stop;
+}
+
+// Accepts connections and serves each on its own thread; every request is
+// answered through the shared QueryBatcher. ranking is the ranking_code of
+// the server's metric and distance form; requests for another are refused.
+class SearchServer {
+public:
+    SearchServer(QueryBatcher& batcher, uint32_t ranking) : batcher_(batcher), ranking_(ranking), listen_fd_(-1) {}
+
+    ~SearchServer() {
+        if (listen_fd_ >= 0) close(listen_fd_);
+    }
+
+    SearchServer(const SearchServer&) = delete;
+    SearchServer& operator=(const SearchServer&) = delete;
+
+    bool listen(const std::string& address) {
+        listen_fd_ = open_socket(address, true);
+        return listen_fd_ >= 0;
+    }
+
+    // Serve until server_stop_flag() is set.
+    void run() {
+        std::vector<Worker> workers;
+        while (!server_stop_flag().load()) {
+            pollfd pfd = {listen_fd_, POLLIN, 0};
+            if (poll(&pfd, 1, 200) <= 0) continue;
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) continue;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                clients_.push_back(fd);
+            }
+            reap(workers, false);
+            Worker worker;
+            worker.done = std::make_shared<std::atomic<bool>>(false);
+            std::shared_ptr<std::atomic<bool>> done = worker.done;
+            worker.thread = std::thread([this, fd, done] {
+                serve(fd);
+                done->store(true);
+            });
+            workers.push_back(std::move(worker));
+        }
+        {
+            // Unblock connection threads still waiting for a request.
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (size_t i = 0; i < clients_.size(); i++) shutdown(clients_[i], SHUT_RDWR);
+        }
+        reap(workers, true);
+    }
+
+private:
+    struct Worker {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+
+    // Join finished connection threads (all of them when wait is set).
+    static void reap(std::vector<Worker>& workers, bool wait) {
+        size_t kept = 0;
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (wait || workers[i].done->load()) workers[i].thread.join();
+            else if (kept++ != i) workers[kept - 1] = std::move(workers[i]);
+        }
+        workers.resize(kept);
+    }
+
+    void serve(int fd) {
+        const size_t dim = batcher_.dim();
+        std::vector<float> query;
+        std::vector<char> out;
+        for (;;) {
+            uint32_t header[4];
+            if (!read_full(fd, header, sizeof(header)) || header[0] != kRequestMagic) break;
+            const uint32_t k = header[1], qdim = header[2];
+            if (qdim > (1u << 20)) break;
+            query.resize(qdim);
+            if (!read_full(fd, query.data(), qdim * sizeof(float))) break;
+
+            std::vector<SearchResult> results;
+            uint32_t status = kStatusOk;
+            if (qdim != dim || k == 0 || k > kMaxRequestK) {
+                status = kStatusBadRequest;
+            }
+            else if (header[3] != ranking_) {
+                status = kStatusRankingMismatch;
+            }
+            else {
+                try {
+                    results = batcher_.search(query.data(), static_cast<int>(k));
+                }
+                catch (...) {
+                    status = kStatusServerError;
+                    results.clear();
+                }
+            }
+
+            const uint32_t count = static_cast<uint32_t>(results.size());
+            out.resize(3 * sizeof(uint32_t) + count * 2 * sizeof(uint32_t));
+            uint32_t response[3] = {kResponseMagic, status, count};
+            std::memcpy(out.data(), response, sizeof(response));
+            char* p = out.data() + sizeof(response);
+            for (uint32_t i = 0; i < count; i++, p += 2 * sizeof(uint32_t)) {
+                int32_t id = results[i].index;
+                std::memcpy(p, &id, sizeof(id));
+                std::memcpy(p + sizeof(id), &results[i].distance, sizeof(float));
+            }
+            if (!write_full(fd, out.data(), out.size())) break;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        clients_.erase(std::remove(clients_.begin(), clients_.end(), fd), clients_.end());
+        close(fd);
+    }
+
+    QueryBatcher& batcher_;
+    uint32_t ranking_;
+    int listen_fd_;
+    std::mutex mutex_;
+    std::vector<int> clients_;
+};
+
+// Blocking client for the protocol above. Every request asks for ranking
+// (a ranking_code), so results are never read under the wrong metric.
+class SearchClient {
+public:
+    explicit SearchClient(uint32_t ranking) : fd_(-1), ranking_(ranking), status_(kStatusOk) {}
+    ~SearchClient() {
+        if (fd_ >= 0) close(fd_);
+    }
+
+    SearchClient(const SearchClient&) = delete;
+    SearchClient& operator=(const SearchClient&) = delete;
+
+    bool connect(const std::string& address) {
+        fd_ = open_socket(address, false);
+        return fd_ >= 0;
+    }
+
+    // False on a transport error or if the server rejected the request;
+    // status() then tells which.
+    bool search(const float* query, size_t dim, int k, std::vector<SearchResult>& results) {
+        status_ = kStatusServerError;
+        uint32_t header[4] = {kRequestMagic, static_cast<uint32_t>(k), static_cast<uint32_t>(dim), ranking_};
+        if (!write_full(fd_, header, sizeof(header)) || !write_full(fd_, query, dim * sizeof(float))) return false;
+
+        uint32_t response[3];
+        if (!read_full(fd_, response, sizeof(response)) || response[0] != kResponseMagic) return false;
+        if (response[2] > kMaxRequestK) return false;
+        std::vector<uint32_t> body(2 * response[2]);
+        if (!read_full(fd_, body.data(), body.size() * sizeof(uint32_t))) return false;
+        results.resize(response[2]);
+        for (size_t i = 0; i < results.size(); i++) {
+            int32_t id;
+            std::memcpy(&id, &body[2 * i], sizeof(id));
+            results[i].index = id;
+            std::memcpy(&results[i].distance, &body[2 * i + 1], sizeof(float));
+        }
+        status_ = response[1];
+        return response[1] == kStatusOk;
+    }
+
+    // Status of the last response; kStatusServerError after a transport
+    // error.
+    uint32_t status() const { return status_; }
+
+private:
+    int fd_;
+    uint32_t ranking_;
+    uint32_t status_;
+};
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "flat_array.h"
+#include "mapped_file.h"
+#include "vector_store.h"
+
+// Snapshot file: everything needed to serve queries (vectors, norms, built
+// indexes) in one file that is mmap'ed and used in place, with no parsing.
+//
+// Layout (native byte order, little-endian on every supported target):
+//   SnapshotHeader                     64 bytes
+//   SnapshotSection[section_count]     64 bytes each
+//   payloads, each starting on a kSnapshotAlignment boundary
+//
+// Sections are looked up by name; meta[] carries the shape of the payload
+// (e.g. dim / stride / rows for a vector section). Readers reject files
+// whose magic or version differ, so the format can change by bumping
+// kSnapshotVersion.
+static const char kSnapshotMagic[8] = {'V', 'S', 'N', 'A', 'P', 'S', 'H', 'T'};
+static const uint32_t kSnapshotVersion = 1;
+static const size_t kSnapshotAlignment = 4096;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    uint64_t file_size;
+    uint64_t reserved[5];
+};
+
+struct SnapshotSection {
+    char name[24];
+    uint64_t offset;     // from the start of the file
+    uint64_t bytes;
+    uint64_t meta[3];
+};
+
+static_assert(sizeof(SnapshotHeader) == 64, "snapshot header layout");
+static_assert(sizeof(SnapshotSection) == 64, "snapshot section layout");
+
+// Collects sections and writes them out in one pass. Payloads are produced
+// by callbacks at write time, so nothing is copied while sections are added
+// and the sources must stay alive until write() returns.
+class SnapshotWriter {
+public:
+    typedef std::function<bool(std::ostream&)> PayloadFn;
+
+    void add(const std::string& name, uint64_t bytes, PayloadFn payload,
+             uint64_t meta0 = 0, uint64_t meta1 = 0, uint64_t meta2 = 0) {
+        Entry entry;
+        std::memset(&entry.section, 0, sizeof(entry.section));
+        std::strncpy(entry.section.name, name.c_str(), sizeof(entry.section.name) - 1);
+        entry.section.bytes = bytes;
+        entry.section.meta[0] = meta0;
+        entry.section.meta[1] = meta1;
+        entry.section.meta[2] = meta2;
+        entry.payload = payload;
+        entries_.push_back(entry);
+    }
+
+    // A contiguous array of count elements.
+    template <class T>
+    void add_array(const std::string& name, const T* data, size_t count,
+                   uint64_t meta0 = 0, uint64_t meta1 = 0, uint64_t meta2 = 0) {
+        const uint64_t bytes = count * sizeof(T);
+        add(name, bytes, [data, bytes](std::ostream& out) {
+            out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+            return static_cast<bool>(out);
+        }, meta0, meta1, meta2);
+    }
+
+    // Rows of a store, re-padded to VectorStore's aligned stride so the
+    // loaded view is laid out exactly like an in-memory store.
+    // meta = {dim, stride, rows}.
+    void add_vectors(const std::string& name, const VectorStore& store) {
+        const size_t dim = store.dim();
+        const size_t stride = VectorStore::padded_stride(dim);
+        const VectorStore* source = &store;
+        add(name, store.size() * stride * sizeof(float), [source, dim, stride](std::ostream& out) {
+            std::vector<float> row(stride, 0.0f);
+            for (size_t i = 0; i < source->size() && out; i++) {
+                std::memcpy(row.data(), source->row(i), dim * sizeof(float));
+                out.write(reinterpret_cast<const char*>(row.data()),
+                          static_cast<std::streamsize>(stride * sizeof(float)));
+            }
+            return static_cast<bool>(out);
+        }, dim, stride, store.size());
+    }
+
+    bool write(const std::string& filename) {
+        uint64_t offset = align(sizeof(SnapshotHeader) + entries_.size() * sizeof(SnapshotSection));
+        for (size_t i = 0; i < entries_.size(); i++) {
+            entries_[i].section.offset = offset;
+            offset = align(offset + entries_[i].section.bytes);
+        }
+
+        SnapshotHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+        header.version = kSnapshotVersion;
+        header.section_count = static_cast<uint32_t>(entries_.size());
+        header.file_size = offset;
+
+        std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            std::cerr << "Error: Cannot create snapshot " << filename << std::endl;
+            return false;
+        }
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (size_t i = 0; i < entries_.size(); i++) {
+            out.write(reinterpret_cast<const char*>(&entries_[i].section), sizeof(SnapshotSection));
+        }
+        for (size_t i = 0; i < entries_.size() && out; i++) {
+            pad_to(out, entries_[i].section.offset);
+            if (!entries_[i].payload(out)) break;
+        }
+        pad_to(out, offset);
+        out.flush();
+        if (!out) {
+            std::cerr << "Error: Failed writing snapshot " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    struct Entry {
+        SnapshotSection section;
+        PayloadFn payload;
+    };
+
+    static uint64_t align(uint64_t offset) {
+        return (offset + kSnapshotAlignment - 1) / kSnapshotAlignment * kSnapshotAlignment;
+    }
+
+    static void pad_to(std::ostream& out, uint64_t offset) {
+        static const char zeros[kSnapshotAlignment] = {};
+        uint64_t pos = static_cast<uint64_t>(out.tellp());
+        while (out && pos < offset) {
+            uint64_t n = std::min<uint64_t>(offset - pos, sizeof(zeros));
+            out.write(zeros, static_cast<std::streamsize>(n));
+            pos += n;
+        }
+    }
+
+    std::vector<Entry> entries_;
+};
+
+// A mapped snapshot. Sections are returned as views that share ownership
+// of the mapping, so they stay valid after the Snapshot itself is gone.
+class Snapshot {
+public:
+    bool open(const std::string& filename, const MapOptions& options = MapOptions()) {
+        file_ = std::make_shared<MappedFile>();
+        if (!file_->open(filename, options)) return false;
+
+        SnapshotHeader header;
+        if (file_->size() < sizeof(header)) {
+            std::cerr << "Error: Truncated snapshot " << filename << std::endl;
+            return false;
+        }
+        std::memcpy(&header, file_->data(), sizeof(header));
+        if (std::memcmp(header.magic, kSnapshotMagic, sizeof(header.magic)) != 0) {
+            std::cerr << "Error: " << filename << " is not a snapshot" << std::endl;
+            return false;
+        }
+        if (header.version != kSnapshotVersion) {
+            std::cerr << "Error: Snapshot " << filename << " has version " << header.version
+                      << ", expected " << kSnapshotVersion << std::endl;
+            return false;
+        }
+        const uint64_t table_end = sizeof(header) + uint64_t(header.section_count) * sizeof(SnapshotSection);
+        if (header.file_size != file_->size() || table_end > file_->size()) {
+            std::cerr << "Error: Truncated snapshot " << filename << std::endl;
+            return false;
+        }
+
+        sections_.resize(header.section_count);
+        std::memcpy(sections_.data(), file_->data() + sizeof(header), header.section_count * sizeof(SnapshotSection));
+        for (size_t i = 0; i < sections_.size(); i++) {
+            sections_[i].name[sizeof(sections_[i].name) - 1] = '\0';
+            if (sections_[i].offset + sections_[i].bytes > file_->size()) {
+                std::cerr << "Error: Section " << sections_[i].name << " runs past the end of "
+                          << filename << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const SnapshotSection* find(const std::string& name) const {
+        for (size_t i = 0; i < sections_.size(); i++) {
+            if (name == sections_[i].name) return &sections_[i];
+        }
+        return nullptr;
+    }
+
+    bool has(const std::string& name) const { return find(name) != nullptr; }
+
+    // Array section as a view; false (with a message) if missing or if its
+    // size is not a whole number of T.
+    template <class T>
+    bool array(const std::string& name, FlatArray<T>& out) const {
+        const SnapshotSection* s = require(name);
+        if (!s) return false;
+        if (s->bytes % sizeof(T) != 0) {
+            std::cerr << "Error: Snapshot section " << name << " has a bad size" << std::endl;
+            return false;
+        }
+        out = FlatArray<T>::view(reinterpret_cast<T*>(file_->data() + s->offset), s->bytes / sizeof(T), file_);
+        return true;
+    }
+
+    // Vector section written by SnapshotWriter::add_vectors, as a store view.
+    bool vectors(const std::string& name, VectorStore& out) const {
+        const SnapshotSection* s = require(name);
+        if (!s) return false;
+        const uint64_t dim = s->meta[0], stride = s->meta[1], rows = s->meta[2];
+        if (dim == 0 || stride < dim || rows * stride * sizeof(float) != s->bytes) {
+            std::cerr << "Error: Snapshot section " << name << " has a bad shape" << std::endl;
+            return false;
+        }
+        out = VectorStore::view(reinterpret_cast<float*>(file_->data() + s->offset), dim, stride, rows, file_);
+        return true;
+    }
+
+    const SnapshotSection* require(const std::string& name) const {
+        const SnapshotSection* s = find(name);
+        if (!s) std::cerr << "Error: Snapshot has no section " << name << std::endl;
+        return s;
+    }
+
+private:
+    std::shared_ptr<MappedFile> file_;
+    std::vector<SnapshotSection> sections_;
+};
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "distance.h"
+
+// Distance kernels for scalar-quantized storage.
+//
+// uint8: both operands are uint8 codes on the same grid, so the squared
+// difference is exact integer arithmetic. Differences are widened to int16
+// and squared-and-summed with madd (AVX2), vpdpwssd (AVX-512 VNNI) or a
+// widening multiply-accumulate / UDOT on |a - b| (NEON).
+//
+// float16: the database row is stored as IEEE half and widened on load
+// (F16C / AVX-512 / NEON); the query stays in float.
+typedef uint32_t (*U8L2SqrFn)(const uint8_t* a, const uint8_t* b, size_t dim);
+typedef float (*F16L2SqrFn)(const float* q, const uint16_t* x, size_t dim);
+
+// IEEE 754 half <-> float, round to nearest even. Portable reference used
+// for conversion and by the scalar kernel.
+inline uint16_t float_to_half(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000u;
+    uint32_t abs = x & 0x7fffffffu;
+    if (abs >= 0x7f800000u) {
+        // Inf stays inf; NaN keeps a quiet payload bit.
+        return static_cast<uint16_t>(sign | 0x7c00u | (abs > 0x7f800000u ? 0x200u : 0u));
+    }
+    if (abs >= 0x477ff000u) return static_cast<uint16_t>(sign | 0x7c00u);   // overflow
+    if (abs < 0x38800000u) {
+        // Subnormal half (or zero): shift the implicit-one mantissa into place.
+        if (abs < 0x33000000u) return static_cast<uint16_t>(sign);
+        uint32_t exp = abs >> 23;
+        uint32_t mant = (abs & 0x7fffffu) | 0x800000u;
+        uint32_t shift = 126 - exp;
+        uint32_t half = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t mid = 1u << (shift - 1);
+        if (rem > mid || (rem == mid && (half & 1u))) half++;
+        return static_cast<uint16_t>(sign | half);
+    }
+    uint32_t half = ((abs - 0x38000000u) >> 13);
+    uint32_t rem = abs & 0x1fffu;
+    if (rem > 0x1000u || (rem == 0x1000u && (half & 1u))) half++;
+    return static_cast<uint16_t>(sign | half);
+}
+
+inline float half_to_float(uint16_t h) {
+    uint32_t sign = static_cast<uint32_t>(h & 0x8000u) << 16;
+    uint32_t exp = (h >> 10) & 0x1fu;
+    uint32_t mant = h & 0x3ffu;
+    uint32_t x;
+    if (exp == 0) {
+        if (mant == 0) {
+            x = sign;
+        }
+        else {
+            // Normalize the subnormal.
+            exp = 113;
+            while (!(mant & 0x400u)) {
+                mant <<= 1;
+                exp--;
+            }
+            x = sign | (exp << 23) | ((mant & 0x3ffu) << 13);
+        }
+    }
+    else if (exp == 0x1f) {
+        x = sign | 0x7f800000u | (mant << 13);
+    }
+    else {
+        x = sign | ((exp + 112) << 23) | (mant << 13);
+    }
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+inline uint32_t l2_sqr_u8_scalar(const uint8_t* a, const uint8_t* b, size_t dim) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < dim; i++) {
+        int diff = static_cast<int>(a[i]) - static_cast<int>(b[i]);
+        sum += static_cast<uint32_t>(diff * diff);
+    }
+    return sum;
+}
+
+inline float l2_sqr_f16_scalar(const float* q, const uint16_t* x, size_t dim) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < dim; i++) {
+        float diff = q[i] - half_to_float(x[i]);
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+#ifdef SEARCH_X86
+__attribute__((target("avx2")))
+inline uint32_t hsum_epi32_avx2(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(s));
+}
+
+// 16 codes per step: widen to int16, subtract, madd pairs into int32.
+__attribute__((target("avx2")))
+inline uint32_t l2_sqr_u8_avx2(const uint8_t* a, const uint8_t* b, size_t dim) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+        __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        __m256i d = _mm256_sub_epi16(va, vb);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+    }
+    uint32_t sum = hsum_epi32_avx2(acc);
+    return sum + l2_sqr_u8_scalar(a + i, b + i, dim - i);
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+// 32 codes per step; vpdpwssd fuses the int16 multiply-add and accumulate.
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+inline uint32_t l2_sqr_u8_avx512vnni(const uint8_t* a, const uint8_t* b, size_t dim) {
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        __m512i va = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)));
+        __m512i vb = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+        __m512i d = _mm512_sub_epi16(va, vb);
+        acc = _mm512_dpwssd_epi32(acc, d, d);
+    }
+    uint32_t sum = static_cast<uint32_t>(_mm512_reduce_add_epi32(acc));
+    return sum + l2_sqr_u8_scalar(a + i, b + i, dim - i);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+inline float l2_sqr_f16_f16c(const float* q, const uint16_t* x, size_t dim) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        __m256 x0 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i)));
+        __m256 x1 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i + 8)));
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(q + i), x0);
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(q + i + 8), x1);
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    float sum = hsum_avx(_mm256_add_ps(acc0, acc1));
+    return sum + l2_sqr_f16_scalar(q + i, x + i, dim - i);
+}
+
+__attribute__((target("avx512f")))
+inline float l2_sqr_f16_avx512(const float* q, const uint16_t* x, size_t dim) {
+    __m512 acc = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        __m512 xv = _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i)));
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(q + i), xv);
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    return _mm512_reduce_add_ps(acc) + l2_sqr_f16_scalar(q + i, x + i, dim - i);
+}
+#pragma GCC diagnostic pop
+
+// Bulk float -> half conversion with F16C (RNE, same as float_to_half).
+__attribute__((target("avx,f16c")))
+inline void floats_to_halves_f16c(const float* in, uint16_t* out, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), h);
+    }
+    for (; i < n; i++) out[i] = float_to_half(in[i]);
+}
+#endif
+
+#ifdef SEARCH_NEON
+inline uint32_t l2_sqr_u8_neon(const uint8_t* a, const uint8_t* b, size_t dim) {
+    uint32x4_t acc = vdupq_n_u32(0);
+    size_t i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        uint8x16_t d = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+#ifdef __ARM_FEATURE_DOTPROD
+        acc = vdotq_u32(acc, d, d);
+#else
+        uint16x8_t lo = vmull_u8(vget_low_u8(d), vget_low_u8(d));
+        uint16x8_t hi = vmull_u8(vget_high_u8(d), vget_high_u8(d));
+        acc = vpadalq_u16(acc, lo);
+        acc = vpadalq_u16(acc, hi);
+#endif
+    }
+    return vaddvq_u32(acc) + l2_sqr_u8_scalar(a + i, b + i, dim - i);
+}
+
+inline float l2_sqr_f16_neon(const float* q, const uint16_t* x, size_t dim) {
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        float16x8_t h = vreinterpretq_f16_u16(vld1q_u16(x + i));
+        float32x4_t d0 = vsubq_f32(vld1q_f32(q + i), vcvt_f32_f16(vget_low_f16(h)));
+        float32x4_t d1 = vsubq_f32(vld1q_f32(q + i + 4), vcvt_high_f32_f16(h));
+        acc0 = vfmaq_f32(acc0, d0, d0);
+        acc1 = vfmaq_f32(acc1, d1, d1);
+    }
+    return vaddvq_f32(vaddq_f32(acc0, acc1)) + l2_sqr_f16_scalar(q + i, x + i, dim - i);
+}
+#endif
+
+inline void floats_to_halves(const float* in, uint16_t* out, size_t n) {
+#ifdef SEARCH_X86
+    if (__builtin_cpu_supports("f16c")) {
+        floats_to_halves_f16c(in, out, n);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; i++) out[i] = float_to_half(in[i]);
+}
+
+struct QuantizedKernels {
+    const char* u8_name;
+    U8L2SqrFn u8;
+    const char* f16_name;
+    F16L2SqrFn f16;
+};
+
+// Best quantized kernels for this CPU, chosen once from cpuid.
+inline const QuantizedKernels& quantized_kernels() {
+    static QuantizedKernels kernels = [] {
+        QuantizedKernels k = {"scalar", l2_sqr_u8_scalar, "scalar", l2_sqr_f16_scalar};
+#ifdef SEARCH_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw")) {
+            k.u8_name = "avx512-vnni";
+            k.u8 = l2_sqr_u8_avx512vnni;
+        }
+        else if (__builtin_cpu_supports("avx2")) {
+            k.u8_name = "avx2";
+            k.u8 = l2_sqr_u8_avx2;
+        }
+        if (__builtin_cpu_supports("avx512f")) {
+            k.f16_name = "avx512";
+            k.f16 = l2_sqr_f16_avx512;
+        }
+        else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+                 __builtin_cpu_supports("f16c")) {
+            k.f16_name = "f16c";
+            k.f16 = l2_sqr_f16_f16c;
+        }
+#endif
+#ifdef SEARCH_NEON
+        k.u8_name = "neon";
+        k.u8 = l2_sqr_u8_neon;
+        k.f16_name = "neon";
+        k.f16 = l2_sqr_f16_neon;
+#endif
+        return k;
+    }();
+    return kernels;
+}
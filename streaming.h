@@ -0,0 +1,305 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "search.h"
+#include "topk.h"
+#include "vector_store.h"
+
+// Double-buffered sequential reader for [int32 dim][dim elements] record
+// files. A read-ahead thread fills one chunk buffer with pread while the
+// consumer scans the other, so I/O overlaps compute and memory stays at two
+// chunks no matter how large the file is. Consumed ranges are dropped from
+// the page cache (POSIX_FADV_DONTNEED) so a pass over a dataset larger than
+// RAM does not evict everything else.
+class ChunkStream {
+public:
+    struct Chunk {
+        const char* records = nullptr;   // rows * record_bytes() bytes
+        size_t first_row = 0;
+        size_t rows = 0;
+        std::shared_ptr<void> buffer;    // keeps records alive
+    };
+
+    ChunkStream() : fd_(-1), dim_(0), record_bytes_(0), total_rows_(0), rows_per_chunk_(0),
+                    consumer_slot_(0), held_(false), stop_(false), error_(false), reader_done_(false) {}
+
+    ~ChunkStream() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        if (reader_.joinable()) reader_.join();
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    ChunkStream(const ChunkStream&) = delete;
+    ChunkStream& operator=(const ChunkStream&) = delete;
+
+    // elem_size: 4 for .fvecs, 1 for .bvecs. chunk_bytes is rounded down to
+    // whole records (at least one).
+    bool open(const std::string& filename, size_t elem_size, size_t chunk_bytes, int max_vectors = -1) {
+        fd_ = ::open(filename.c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            std::cerr << "Error: Cannot open file " << filename << std::endl;
+            return false;
+        }
+        struct stat st;
+        int header = 0;
+        if (fstat(fd_, &st) != 0 || pread(fd_, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) ||
+            header <= 0) {
+            std::cerr << "Error: Invalid header in " << filename << std::endl;
+            return false;
+        }
+        filename_ = filename;
+        dim_ = static_cast<size_t>(header);
+        record_bytes_ = sizeof(int) + dim_ * elem_size;
+        total_rows_ = static_cast<size_t>(st.st_size) / record_bytes_;
+        if (max_vectors > 0) total_rows_ = std::min(total_rows_, static_cast<size_t>(max_vectors));
+        rows_per_chunk_ = std::max<size_t>(1, std::min(chunk_bytes / record_bytes_, total_rows_));
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+        for (int s = 0; s < 2; s++) {
+            void* p = nullptr;
+            if (posix_memalign(&p, VectorStore::kAlignment, rows_per_chunk_ * record_bytes_) != 0) {
+                std::cerr << "Error: Cannot allocate stream buffers" << std::endl;
+                return false;
+            }
+            slots_[s].buffer = std::shared_ptr<void>(p, std::free);
+            slots_[s].filled = false;
+        }
+        reader_ = std::thread([this] { read_ahead(); });
+        return true;
+    }
+
+    size_t dim() const { return dim_; }
+    size_t size() const { return total_rows_; }
+    size_t record_bytes() const { return record_bytes_; }
+    size_t rows_per_chunk() const { return rows_per_chunk_; }
+
+    // Hand back the previous chunk and wait for the next one. Returns false
+    // at the end of the file or on a read error (see failed()).
+    bool next(Chunk& out) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (held_) {
+            slots_[consumer_slot_].filled = false;
+            consumer_slot_ ^= 1;
+            held_ = false;
+            cv_.notify_all();
+        }
+        Slot& slot = slots_[consumer_slot_];
+        cv_.wait(lock, [&] { return slot.filled || error_ || reader_done_; });
+        if (!slot.filled) return false;
+        held_ = true;
+        out.records = static_cast<const char*>(slot.buffer.get());
+        out.first_row = slot.first_row;
+        out.rows = slot.rows;
+        out.buffer = slot.buffer;
+        return true;
+    }
+
+    bool failed() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return error_;
+    }
+
+private:
+    struct Slot {
+        std::shared_ptr<void> buffer;
+        size_t first_row = 0;
+        size_t rows = 0;
+        bool filled = false;
+    };
+
+    void read_ahead() {
+        int s = 0;
+        for (size_t row = 0; row < total_rows_; row += rows_per_chunk_, s ^= 1) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [&] { return !slots_[s].filled || stop_; });
+                if (stop_) break;
+            }
+
+            Slot& slot = slots_[s];
+            const size_t rows = std::min(rows_per_chunk_, total_rows_ - row);
+            const bool ok = read_rows(static_cast<char*>(slot.buffer.get()), row, rows);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!ok) {
+                error_ = true;
+                break;
+            }
+            slot.first_row = row;
+            slot.rows = rows;
+            slot.filled = true;
+            cv_.notify_all();
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        reader_done_ = true;
+        cv_.notify_all();
+    }
+
+    bool read_rows(char* dst, size_t row, size_t rows) {
+        const off_t offset = static_cast<off_t>(row * record_bytes_);
+        const size_t bytes = rows * record_bytes_;
+        for (size_t done = 0; done < bytes;) {
+            ssize_t n = pread(fd_, dst + done, bytes - done, offset + static_cast<off_t>(done));
+            if (n <= 0) {
+                std::cerr << "Error: Read failed in " << filename_ << " at row " << row << std::endl;
+                return false;
+            }
+            done += static_cast<size_t>(n);
+        }
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(fd_, offset, static_cast<off_t>(bytes), POSIX_FADV_DONTNEED);
+#endif
+        for (size_t i = 0; i < rows; i++) {
+            int header;
+            std::memcpy(&header, dst + i * record_bytes_, sizeof(int));
+            if (header != static_cast<int>(dim_)) {
+                std::cerr << "Error: Inconsistent dimension at vector " << row + i
+                          << " in " << filename_ << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::string filename_;
+    int fd_;
+    size_t dim_;
+    size_t record_bytes_;
+    size_t total_rows_;
+    size_t rows_per_chunk_;
+
+    Slot slots_[2];
+    int consumer_slot_;
+    bool held_;
+    bool stop_;
+    bool error_;
+    bool reader_done_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread reader_;
+};
+
+struct StreamStats {
+    size_t rows = 0;
+    size_t chunks = 0;
+    double wait_ms = 0.0;   // time the scan sat idle waiting for I/O
+    double scan_ms = 0.0;
+};
+
+// Exact k-NN of every query against a base file that is never held in
+// memory: chunks of chunk_bytes stream through ChunkStream and are scanned
+// into one running top-k per query. .bvecs chunks are widened to float
+// into a reused buffer. Peak memory is two chunks (plus one widened chunk
+// for .bvecs) and the per-query selections.
+inline std::vector<std::vector<SearchResult>> stream_search(
+    const std::string& filename,
+    const VectorStore& queries,
+    int k,
+    const SearchParams& params = SearchParams(),
+    size_t chunk_bytes = 64u << 20,
+    int max_vectors = -1,
+    StreamStats* stats = nullptr) {
+
+    typedef std::chrono::steady_clock Clock;
+    const std::string ext = ".bvecs";
+    const bool bytes = filename.size() >= ext.size() &&
+                       filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0;
+
+    std::vector<std::vector<SearchResult>> results(queries.size());
+    ChunkStream stream;
+    if (!stream.open(filename, bytes ? 1 : sizeof(float), chunk_bytes, max_vectors)) return results;
+    if (stream.dim() != queries.dim()) {
+        std::cerr << "Error: Query and database dimensions differ!" << std::endl;
+        return results;
+    }
+
+    const size_t nq = queries.size();
+    const size_t dim = stream.dim();
+    const size_t kk = static_cast<size_t>(k);
+    // One query: split each chunk over the threads, one TopK per thread.
+    // Several queries: split the queries, each thread tiles the chunk.
+    const bool split_rows = nq == 1;
+    const size_t lanes = split_rows ? parallel_thread_count(stream.rows_per_chunk(), params.num_threads) : 1;
+    std::vector<TopK> topk(split_rows ? lanes : nq, TopK(kk));
+
+    std::shared_ptr<VectorStore> widened;
+    if (bytes) widened = std::make_shared<VectorStore>(dim, stream.rows_per_chunk());
+
+    StreamStats local;
+    ChunkStream::Chunk chunk;
+    for (;;) {
+        auto wait_start = Clock::now();
+        if (!stream.next(chunk)) break;
+        auto scan_start = Clock::now();
+        local.wait_ms += std::chrono::duration<double, std::milli>(scan_start - wait_start).count();
+
+        VectorStore rows;
+        if (bytes) {
+            for (size_t i = 0; i < chunk.rows; i++) {
+                const uint8_t* src = reinterpret_cast<const uint8_t*>(chunk.records + i * stream.record_bytes() + sizeof(int));
+                std::copy(src, src + dim, widened->row(i));
+            }
+            rows = VectorStore::view(widened->row(0), dim, widened->stride(), chunk.rows, widened);
+        }
+        else {
+            float* first = reinterpret_cast<float*>(const_cast<char*>(chunk.records) + sizeof(int));
+            rows = VectorStore::view(first, dim, dim + 1, chunk.rows, chunk.buffer);
+        }
+
+        if (split_rows) {
+            parallel_for(chunk.rows, params.num_threads, [&](size_t t, size_t begin, size_t end) {
+                scan_range(queries.row(0), rows, begin, end, topk[t], params.early_abandon, chunk.first_row);
+            });
+        }
+        else {
+            parallel_for(nq, params.num_threads, [&](size_t, size_t begin, size_t end) {
+                batch_scan(queries, begin, end, rows, params, topk, chunk.first_row);
+            });
+        }
+        local.scan_ms += std::chrono::duration<double, std::milli>(Clock::now() - scan_start).count();
+        local.rows += chunk.rows;
+        local.chunks++;
+        if (params.progress) params.progress(local.rows, stream.size());
+    }
+    if (stream.failed()) {
+        std::cerr << "Warning: Streamed only " << local.rows << " of " << stream.size()
+                  << " vectors from " << filename << std::endl;
+    }
+
+    if (split_rows) {
+        for (size_t t = 1; t < topk.size(); t++) topk[0].merge(topk[t]);
+        results[0] = topk[0].take_sorted();
+        finalize_distances(results[0], params);
+    }
+    else {
+        for (size_t q = 0; q < nq; q++) {
+            results[q] = topk[q].take_sorted();
+            finalize_distances(results[q], params);
+        }
+    }
+    if (stats) *stats = local;
+    return results;
+}
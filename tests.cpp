@@ -0,0 +1,496 @@
+// Self-checks for the kernels and data structures every search path relies
+// on. Each check compares an optimized implementation against a plain
+// reference on seeded random inputs; mismatches are printed to stderr and
+// the program exits with status 1 (`make test` relies on this).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "distance.h"
+#include "id_filter.h"
+#include "scheduler.h"
+#include "segmented_store.h"
+#include "sq_distance.h"
+#include "topk.h"
+
+using namespace std;
+
+static int failures = 0;
+
+static void fail(const string& what) {
+    cerr << "FAIL: " << what << endl;
+    failures++;
+}
+
+// Float kernels sum in a different order than the references.
+static bool close_to(float got, float want) {
+    return fabs(got - want) <= 1e-4f * max(1.0f, fabs(want));
+}
+
+static vector<float> random_floats(mt19937& rng, size_t n) {
+    uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    vector<float> v(n);
+    for (size_t i = 0; i < n; i++) v[i] = uniform(rng);
+    return v;
+}
+
+// Dimensions on both sides of every register width and unroll step, plus
+// the specialized ones.
+static const size_t kDims[] = {1, 3, 4, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64, 65,
+                               96, 100, 128, 200, 256, 768, 960, 1536};
+
+// kernel's distance between x and y against the reference want. A bounded
+// L2 kernel either returns the full distance or gives up on a partial sum
+// that has already reached the bound.
+static void check_l2_kernel(const DistanceKernel& kernel, const float* x, const float* y, size_t dim, float want) {
+    const string where = string(kernel.name) + " dim " + to_string(dim);
+    if (!close_to(kernel.distance(x, y, dim), want)) fail(where + ": distance");
+    if (!close_to(kernel.bounded(x, y, dim, numeric_limits<float>::infinity()), want)) {
+        fail(where + ": bounded without a bound");
+    }
+    const float partial = kernel.bounded(x, y, dim, want / 2);
+    if (partial < want / 2 || partial > want * (1.0f + 1e-4f)) fail(where + ": bounded below the bound");
+}
+
+// Each L2 kernel on this CPU against l2_sqr_scalar, on rows one float off
+// alignment.
+static void test_l2_kernels() {
+    mt19937 rng(1);
+    DistanceKernel kernels[4];
+    const size_t n = available_kernels(kernels);
+    for (size_t dim : kDims) {
+        vector<float> a = random_floats(rng, dim + 1), b = random_floats(rng, dim + 1);
+        const float want = l2_sqr_scalar(a.data() + 1, b.data() + 1, dim);
+        for (size_t i = 0; i < n; i++) check_l2_kernel(kernels[i], a.data() + 1, b.data() + 1, dim, want);
+    }
+}
+
+// The dimension-specialized kernels: for every specialized dimension each
+// instruction set must pick its fixed-dim form and match the scalar
+// reference, and given any other dimension must fall back to the generic
+// kernel.
+static void test_fixed_dim_kernels() {
+    const size_t fixed[] = {96, 128, 256, 768, 960, 1536};
+    mt19937 rng(7);
+    for (size_t dim : fixed) {
+        kernel_dim() = dim;
+        DistanceKernel kernels[4];
+        const size_t n = available_kernels(kernels);
+        vector<float> a = random_floats(rng, dim + 1), b = random_floats(rng, dim + 1);
+        const float want = l2_sqr_scalar(a.data() + 1, b.data() + 1, dim);
+        for (size_t i = 0; i + 1 < n; i++) {   // the scalar kernel is last and generic
+            if (kernels[i].fixed_dim != dim) fail(string(kernels[i].name) + " is not specialized for " + to_string(dim));
+            check_l2_kernel(kernels[i], a.data() + 1, b.data() + 1, dim, want);
+            check_l2_kernel(kernels[i], a.data() + 1, b.data() + 1, dim - 1,
+                            l2_sqr_scalar(a.data() + 1, b.data() + 1, dim - 1));
+            if (!close_to(kernels[i].l2(a.data() + 1, b.data() + 1, dim), want)) {
+                fail(string(kernels[i].name) + " dim " + to_string(dim) + ": l2");
+            }
+        }
+    }
+    kernel_dim() = 0;
+}
+
+// The k smallest of n distances, closest first: distances as a full sort
+// orders them, each with the index it was pushed under. Covers both the
+// heap (k < TopK::kBufferedMinK) and the buffered selection, k above n,
+// merge() of two halves and reuse after reset().
+static void test_topk() {
+    mt19937 rng(2);
+    uniform_real_distribution<float> uniform(0.0f, 100.0f);
+    const size_t n = 5000;
+    vector<float> dist(n);
+    for (size_t i = 0; i < n; i++) dist[i] = i % 7 == 0 ? 50.0f : uniform(rng);   // with ties
+    vector<float> sorted = dist;
+    sort(sorted.begin(), sorted.end());
+
+    const size_t ks[] = {1, 2, 10, 100, 255, 256, 257, 1000, 6000};
+    TopK reused;
+    for (size_t k : ks) {
+        const string where = "k " + to_string(k);
+        const size_t want = min(k, n);
+        TopK whole(k), low(k), high(k);
+        reused.reset(k);
+        for (size_t i = 0; i < n; i++) {
+            whole.push(static_cast<int>(i), dist[i]);
+            reused.push(static_cast<int>(i), dist[i]);
+            (i < n / 2 ? low : high).push(static_cast<int>(i), dist[i]);
+        }
+        low.merge(high);
+
+        TopK* selections[] = {&whole, &low, &reused};
+        for (TopK* topk : selections) {
+            vector<SearchResult> results = topk->take_sorted();
+            if (results.size() != want) {
+                fail(where + ": " + to_string(results.size()) + " results");
+                continue;
+            }
+            for (size_t r = 0; r < want; r++) {
+                if (results[r].distance != sorted[r] || dist[static_cast<size_t>(results[r].index)] != sorted[r]) {
+                    fail(where + ": rank " + to_string(r));
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Every uint8 and float16 kernel this CPU supports against the scalar
+// ones: uint8 distances are exact integers and must match bit for bit.
+static void test_quantized_kernels() {
+    struct U8Kernel {
+        const char* name;
+        U8L2SqrFn fn;
+    };
+    struct F16Kernel {
+        const char* name;
+        F16L2SqrFn fn;
+    };
+    vector<U8Kernel> u8;
+    vector<F16Kernel> f16;
+#ifdef SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) u8.push_back({"avx2", l2_sqr_u8_avx2});
+    if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw")) {
+        u8.push_back({"avx512-vnni", l2_sqr_u8_avx512vnni});
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) {
+        f16.push_back({"f16c", l2_sqr_f16_f16c});
+    }
+    if (__builtin_cpu_supports("avx512f")) f16.push_back({"avx512", l2_sqr_f16_avx512});
+#endif
+#ifdef SEARCH_NEON
+    u8.push_back({"neon", l2_sqr_u8_neon});
+    f16.push_back({"neon", l2_sqr_f16_neon});
+#endif
+
+    mt19937 rng(3);
+    uniform_int_distribution<int> byte(0, 255);
+    for (size_t dim : kDims) {
+        vector<uint8_t> a(dim + 1), b(dim + 1);
+        for (size_t i = 0; i < a.size(); i++) {
+            a[i] = static_cast<uint8_t>(byte(rng));
+            b[i] = static_cast<uint8_t>(byte(rng));
+        }
+        const uint32_t want_u8 = l2_sqr_u8_scalar(a.data() + 1, b.data() + 1, dim);
+        for (const U8Kernel& kernel : u8) {
+            if (kernel.fn(a.data() + 1, b.data() + 1, dim) != want_u8) {
+                fail(string("u8 ") + kernel.name + " dim " + to_string(dim));
+            }
+        }
+
+        vector<float> q = random_floats(rng, dim + 1), x = random_floats(rng, dim + 1);
+        vector<uint16_t> halves(dim + 1);
+        for (size_t i = 0; i < x.size(); i++) halves[i] = float_to_half(x[i]);
+        const float want_f16 = l2_sqr_f16_scalar(q.data() + 1, halves.data() + 1, dim);
+        for (const F16Kernel& kernel : f16) {
+            if (!close_to(kernel.fn(q.data() + 1, halves.data() + 1, dim), want_f16)) {
+                fail(string("f16 ") + kernel.name + " dim " + to_string(dim));
+            }
+        }
+    }
+}
+
+// Every half widens to a float that narrows back to the same half (NaNs
+// to some NaN), floats narrow to the nearest half, and floats_to_halves
+// (F16C where the CPU has it) agrees with float_to_half.
+static void test_half_round_trip() {
+    vector<float> floats;
+    for (uint32_t h = 0; h <= 0xffffu; h++) {
+        const uint16_t half = static_cast<uint16_t>(h);
+        const float f = half_to_float(half);
+        const bool nan = (half & 0x7c00u) == 0x7c00u && (half & 0x3ffu) != 0;
+        const uint16_t back = float_to_half(f);
+        if (nan ? !std::isnan(f) || (back & 0x7c00u) != 0x7c00u || (back & 0x3ffu) == 0 : back != half) {
+            fail("half " + to_string(h) + " does not round-trip");
+        }
+        if (!nan) floats.push_back(f);
+    }
+
+    mt19937 rng(4);
+    uniform_real_distribution<float> exponent(-26.0f, 17.0f);
+    for (int i = 0; i < 100000; i++) {
+        const float f = (i % 2 ? -1.0f : 1.0f) * exp2f(exponent(rng));
+        floats.push_back(f);
+        const uint16_t half = float_to_half(f);
+        if ((half & 0x7c00u) == 0x7c00u) continue;   // overflowed to infinity
+        const float err = fabs(f - half_to_float(half));
+        const uint16_t below = static_cast<uint16_t>(half - ((half & 0x7fffu) != 0));
+        const uint16_t above = static_cast<uint16_t>(half + 1);
+        if (err > fabs(f - half_to_float(below)) ||
+            ((above & 0x7c00u) != 0x7c00u && err > fabs(f - half_to_float(above)))) {
+            fail("float " + to_string(f) + " is not rounded to the nearest half");
+        }
+    }
+
+    vector<uint16_t> converted(floats.size());
+    floats_to_halves(floats.data(), converted.data(), floats.size());
+    for (size_t i = 0; i < floats.size(); i++) {
+        if (converted[i] != float_to_half(floats[i])) {
+            fail("floats_to_halves(" + to_string(floats[i]) + ")");
+            break;
+        }
+    }
+}
+
+// Searches running while one thread deletes rows, a segment at a time,
+// and the background compactor rewrites and drops segments under them,
+// until the compactor has caught up. The first three quarters of the rows
+// are deleted outright and every other row of the next three segments, so
+// those are rewritten with their survivors moved. Every result must be an
+// existing id with its true distance, and no id deleted before a search
+// started may appear. Afterwards only the rewritten segments and the
+// active one remain, and a search matches a brute force over the
+// survivors.
+static void test_search_during_compaction() {
+    const size_t dim = 16, n = 4096, segment_rows = 256;
+    const size_t emptied = 3 * n / 4, halved = 3 * segment_rows;
+    const size_t kept_segments = (n - emptied) / segment_rows;   // the last is never compacted
+    mt19937 rng(5);
+    const vector<float> data = random_floats(rng, n * dim);
+    SegmentedStore store(dim, segment_rows);
+    for (size_t i = 0; i < n; i++) store.insert(&data[i * dim]);
+
+    vector<int> order;
+    for (size_t i = 0; i < emptied; i++) order.push_back(static_cast<int>(i));
+    for (size_t i = emptied; i < emptied + halved; i += 2) order.push_back(static_cast<int>(i));
+    for (size_t s = 0; s < order.size(); s += segment_rows) {
+        shuffle(order.begin() + s, order.begin() + min(order.size(), s + segment_rows), rng);
+    }
+    const size_t deleted = order.size();
+    atomic<size_t> done(0);   // order[0, done) are deleted
+
+    store.start_background_compaction(chrono::milliseconds(1));
+    thread deleter([&] {
+        for (size_t i = 0; i < deleted; i++) {
+            store.remove(order[i]);
+            done.store(i + 1, memory_order_release);
+            if (i % 64 == 0) this_thread::sleep_for(chrono::microseconds(200));
+        }
+    });
+
+    SearchParams params;
+    params.squared = true;
+    params.num_threads = 2;
+    const int k = 100;
+    const vector<float> query = random_floats(rng, dim);
+    const auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+    vector<char> gone(n);
+    size_t searches = 0;
+    for (bool ok = true; ok && chrono::steady_clock::now() < deadline; searches++) {
+        const size_t before = done.load(memory_order_acquire);
+        if (before == deleted && store.num_segments() == kept_segments) break;
+        fill(gone.begin(), gone.end(), 0);
+        for (size_t i = 0; i < before; i++) gone[static_cast<size_t>(order[i])] = 1;
+
+        for (const SearchResult& r : brute_force_search(query.data(), store, k, params)) {
+            const size_t id = static_cast<size_t>(r.index);
+            if (r.index < 0 || id >= n || gone[id] ||
+                !close_to(r.distance, l2_sqr_scalar(query.data(), &data[id * dim], dim))) {
+                fail("search " + to_string(searches) + ": result #" + to_string(r.index));
+                ok = false;
+                break;
+            }
+        }
+    }
+    deleter.join();
+    store.stop_background_compaction();
+    if (searches == 0) fail("no search ran alongside the deletes");
+    if (store.num_segments() != kept_segments) {
+        fail("compaction left " + to_string(store.num_segments()) + " segments");
+    }
+
+    fill(gone.begin(), gone.end(), 0);
+    for (size_t i = 0; i < deleted; i++) gone[static_cast<size_t>(order[i])] = 1;
+    TopK topk(k);
+    for (size_t i = 0; i < n; i++) {
+        if (!gone[i]) topk.push(static_cast<int>(i), l2_sqr_scalar(query.data(), &data[i * dim], dim));
+    }
+    const vector<SearchResult> want = topk.take_sorted();
+    const vector<SearchResult> got = brute_force_search(query.data(), store, k, params);
+    if (got.size() != want.size()) fail("after compaction: " + to_string(got.size()) + " results");
+    for (size_t r = 0; r < got.size() && r < want.size(); r++) {
+        if (got[r].index != want[r].index) {
+            fail("after compaction: rank " + to_string(r));
+            break;
+        }
+    }
+}
+
+// One owner pushes and pops while thieves steal from a deque that starts
+// at capacity 4, so its ring grows while they read it. Every item must be
+// taken exactly once, by the owner or by one thief. The owner yields now
+// and then so that thieves get to run even on a single core.
+static void test_work_stealing_deque() {
+    const size_t items = 200000, thieves = 3;
+    vector<int> values(items);
+    vector<atomic<int>> taken(items);
+    for (size_t i = 0; i < items; i++) {
+        values[i] = static_cast<int>(i);
+        taken[i].store(0, memory_order_relaxed);
+    }
+    atomic<size_t> stolen(0);
+
+    WorkStealingDeque<int> deque(4);
+    atomic<bool> pushing(true);
+    vector<thread> threads;
+    for (size_t t = 0; t < thieves; t++) {
+        threads.emplace_back([&] {
+            for (;;) {
+                const bool last_pass = !pushing.load(memory_order_acquire);
+                while (int* item = deque.steal()) {
+                    taken[static_cast<size_t>(*item)].fetch_add(1, memory_order_relaxed);
+                    stolen.fetch_add(1, memory_order_relaxed);
+                }
+                if (last_pass && deque.empty()) return;
+                this_thread::yield();
+            }
+        });
+    }
+
+    // Bursts of pushes, each followed by a burst of pops of the same length
+    // distribution: about half the rounds drain the deque, racing the
+    // thieves for its last item.
+    mt19937 rng(6);
+    uniform_int_distribution<size_t> burst(1, 64);
+    for (size_t next = 0, round = 0; next < items; round++) {
+        const size_t end = min(items, next + burst(rng));
+        for (; next < end; next++) deque.push(&values[next]);
+        if (round % 8 == 0) this_thread::yield();
+        for (size_t pops = burst(rng); pops > 0; pops--) {
+            if (int* item = deque.pop()) taken[static_cast<size_t>(*item)].fetch_add(1, memory_order_relaxed);
+        }
+    }
+    while (int* item = deque.pop()) taken[static_cast<size_t>(*item)].fetch_add(1, memory_order_relaxed);
+    pushing.store(false, memory_order_release);
+    for (thread& t : threads) t.join();
+
+    for (size_t i = 0; i < items; i++) {
+        const int count = taken[i].load(memory_order_relaxed);
+        if (count != 1) {
+            fail("item " + to_string(i) + " taken " + to_string(count) + " times");
+            break;
+        }
+    }
+    if (stolen.load() == 0) fail("no item was stolen");
+}
+
+// scan_range_filtered and the filtered brute_force_search against a scan
+// of the allowed ids only, for filters that allow nothing, everything, a
+// sparse random 5%, and short runs separated by all-zero words, over
+// ranges that start and end inside a word and with a nonzero id_base.
+// Every disallowed row equals the query, so visiting one would put it
+// first in the results.
+static void test_id_filter() {
+    const size_t dim = 8, n = 1000;   // a partial last word
+    mt19937 rng(8);
+    const vector<float> query = random_floats(rng, dim);
+    const int out_of_range[] = {-1, static_cast<int>(n), 1 << 30};
+
+    vector<IdFilter> filters(4, IdFilter(n));
+    for (size_t id = 0; id < n; id++) filters[1].allow(id);
+    bernoulli_distribution sparse(0.05);
+    for (size_t id = 0; id < n; id++) {
+        if (sparse(rng)) filters[2].allow(id);
+    }
+    vector<int> runs;
+    for (int id = 130; id < 190; id++) runs.push_back(id);
+    for (int id = 700; id < 705; id++) runs.push_back(id);
+    runs.insert(runs.end(), out_of_range, out_of_range + 3);
+    filters[3] = IdFilter::from_ids(n, runs.data(), runs.size());
+    if (filters[3].count() != 65 || filters[3].allows(n) || !filters[3].allows(704)) fail("from_ids");
+
+    const size_t ranges[][2] = {{0, n}, {1, n - 1}, {63, 65}, {64, 128}, {100, 101}, {500, 500}, {129, 706}};
+    const size_t bases[] = {0, 197};
+    const int k = 20;
+    for (size_t f = 0; f < filters.size(); f++) {
+        const IdFilter& filter = filters[f];
+        VectorStore rows(dim, n);
+        for (size_t id = 0; id < n; id++) {
+            const vector<float> v = filter.allows(id) ? random_floats(rng, dim) : query;
+            copy(v.begin(), v.end(), rows.row(id));
+        }
+
+        for (size_t base : bases) {
+            // Row i of the store holds id base + i.
+            VectorStore shifted(dim, n - base);
+            for (size_t i = 0; i < n - base; i++) copy(rows.row(base + i), rows.row(base + i) + dim, shifted.row(i));
+
+            for (const auto& range : ranges) {
+                const size_t begin = min(range[0], n - base), end = min(range[1], n - base);
+                const string where = "filter " + to_string(f) + " base " + to_string(base) + " rows [" +
+                                     to_string(begin) + ", " + to_string(end) + ")";
+                TopK want(k), got(k);
+                for (size_t i = begin; i < end; i++) {
+                    if (filter.allows(base + i)) {
+                        want.push(static_cast<int>(base + i), l2_sqr_scalar(query.data(), shifted.row(i), dim));
+                    }
+                }
+                scan_range_filtered(query.data(), shifted, begin, end, got, filter, false, base);
+                const vector<SearchResult> w = want.take_sorted(), g = got.take_sorted();
+                if (g.size() != w.size()) {
+                    fail(where + ": " + to_string(g.size()) + " results, not " + to_string(w.size()));
+                    continue;
+                }
+                for (size_t r = 0; r < g.size(); r++) {
+                    if (g[r].index != w[r].index || !close_to(g[r].distance, w[r].distance)) {
+                        fail(where + ": rank " + to_string(r));
+                        break;
+                    }
+                }
+            }
+        }
+
+        SearchParams params;
+        params.squared = true;
+        params.num_threads = 3;
+        TopK want(k);
+        for (size_t id = 0; id < n; id++) {
+            if (filter.allows(id)) want.push(static_cast<int>(id), l2_sqr_scalar(query.data(), rows.row(id), dim));
+        }
+        const vector<SearchResult> w = want.take_sorted();
+        const vector<SearchResult> g = brute_force_search(query.data(), rows, k, filter, params);
+        bool same = g.size() == w.size();
+        for (size_t r = 0; same && r < g.size(); r++) same = g[r].index == w[r].index;
+        if (!same) fail("brute_force_search with filter " + to_string(f));
+    }
+}
+
+int main() {
+    struct Test {
+        const char* name;
+        void (*run)();
+    };
+    const Test tests[] = {
+        {"l2 kernels", test_l2_kernels},
+        {"fixed-dim kernels", test_fixed_dim_kernels},
+        {"topk", test_topk},
+        {"u8 and f16 kernels", test_quantized_kernels},
+        {"half round trip", test_half_round_trip},
+        {"search during compaction", test_search_during_compaction},
+        {"work-stealing deque", test_work_stealing_deque},
+        {"id filter", test_id_filter},
+    };
+
+    for (const Test& test : tests) {
+        const int before = failures;
+        test.run();
+        cout << (failures == before ? "ok    " : "FAIL  ") << test.name << endl;
+    }
+    if (failures > 0) {
+        cerr << failures << " check(s) failed" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+// Search result: index and distance
+struct SearchResult {
+    int index;
+    float distance;
+
+    bool operator>(const SearchResult& other) const {
+        return distance > other.distance;
+    }
+
+    bool operator<(const SearchResult& other) const {
+        return distance < other.distance;
+    }
+};
+
+// Fixed-capacity selection of the k smallest distances.
+//
+// Storage is allocated once at construction. threshold() is the distance a
+// candidate must beat to enter (infinity until k candidates have been seen),
+// so the common reject path in a scan is a single compare.
+//
+// Small k uses a binary max-heap whose root is replaced in place. From
+// kBufferedMinK on, candidates under the threshold are appended to a 2k
+// buffer instead, and nth_element trims it back to k whenever it fills;
+// that costs amortized O(1) per accepted candidate instead of O(log k).
+class TopK {
+public:
+    static const size_t kBufferedMinK = 256;
+
+    explicit TopK(size_t k = 0)
+        : k_(k), size_(0), buffered_(k >= kBufferedMinK),
+          items_(buffered_ ? 2 * k : k) {
+        reset_threshold();
+    }
+
+    size_t k() const { return k_; }
+    size_t size() const { return std::min(size_, k_); }
+    float threshold() const { return threshold_; }
+
+    void clear() {
+        size_ = 0;
+        reset_threshold();
+    }
+
+    // Empty the selection and change its capacity to k. Storage is only
+    // reallocated when it has to grow beyond anything held before.
+    void reset(size_t k) {
+        k_ = k;
+        buffered_ = k >= kBufferedMinK;
+        items_.resize(buffered_ ? 2 * k : k);
+        clear();
+    }
+
+    // Offer a candidate. Returns true if it was kept.
+    bool push(int index, float distance) {
+        if (!(distance < threshold_)) return false;
+        if (buffered_) {
+            items_[size_++] = {index, distance};
+            if (size_ == items_.size()) compact();
+        }
+        else if (size_ < k_) {
+            sift_up(index, distance);
+        }
+        else {
+            replace_top(index, distance);
+        }
+        return true;
+    }
+
+    // Offer every candidate held by other.
+    void merge(const TopK& other) {
+        for (size_t i = 0; i < other.size_; i++) {
+            push(other.items_[i].index, other.items_[i].distance);
+        }
+    }
+
+    // Closest-first results. Leaves the selection empty.
+    std::vector<SearchResult> take_sorted() {
+        size_t n = finish();
+        std::vector<SearchResult> results(items_.begin(), items_.begin() + n);
+        clear();
+        return results;
+    }
+
+    // Write up to k closest-first results to out and return how many were
+    // written. Leaves the selection empty.
+    size_t take_sorted(SearchResult* out) {
+        size_t n = finish();
+        std::copy(items_.begin(), items_.begin() + n, out);
+        clear();
+        return n;
+    }
+
+private:
+    void reset_threshold() {
+        threshold_ = k_ == 0 ? -std::numeric_limits<float>::infinity()
+                             : std::numeric_limits<float>::infinity();
+    }
+
+    void sift_up(int index, float distance) {
+        size_t i = size_++;
+        while (i > 0) {
+            size_t parent = (i - 1) / 2;
+            if (items_[parent].distance >= distance) break;
+            items_[i] = items_[parent];
+            i = parent;
+        }
+        items_[i] = {index, distance};
+        if (size_ == k_) threshold_ = items_[0].distance;
+    }
+
+    void replace_top(int index, float distance) {
+        size_t i = 0;
+        for (;;) {
+            size_t child = 2 * i + 1;
+            if (child >= size_) break;
+            if (child + 1 < size_ && items_[child + 1].distance > items_[child].distance) child++;
+            if (items_[child].distance <= distance) break;
+            items_[i] = items_[child];
+            i = child;
+        }
+        items_[i] = {index, distance};
+        threshold_ = items_[0].distance;
+    }
+
+    // Keep the k best buffered candidates and tighten the threshold.
+    void compact() {
+        std::nth_element(items_.begin(), items_.begin() + (k_ - 1), items_.begin() + size_);
+        size_ = k_;
+        threshold_ = items_[k_ - 1].distance;
+    }
+
+    // Sort the kept candidates ascending and return their count.
+    size_t finish() {
+        if (buffered_) {
+            if (size_ > k_) compact();
+            std::sort(items_.begin(), items_.begin() + size_);
+        }
+        else {
+            std::sort_heap(items_.begin(), items_.begin() + size_);
+        }
+        return size_;
+    }
+
+    size_t k_;
+    size_t size_;
+    bool buffered_;
+    float threshold_;
+    std::vector<SearchResult> items_;
+};
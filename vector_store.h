@@ -0,0 +1,269 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "profile.h"
+
+// Contiguous row-major storage for fixed-dimension float vectors.
+// All rows live in one 64-byte aligned buffer. Each row is padded to a
+// multiple of 16 floats (the stride) so every row starts on a cache line
+// and a scan over the store is a single sequential stream.
+//
+// A store can also be a view over memory it does not allocate (see
+// map_fvecs in mapped_file.h). Views keep their backing alive through
+// owner_, may use an arbitrary stride, and cannot grow.
+class VectorStore {
+public:
+    static const size_t kAlignment = 64;
+
+    VectorStore() : dim_(0), stride_(0), size_(0), capacity_(0), data_(nullptr) {}
+
+    VectorStore(size_t dim, size_t n)
+        : dim_(dim), stride_(padded_stride(dim)), size_(0), capacity_(0), data_(nullptr) {
+        reserve(n);
+        size_ = n;
+    }
+
+    // Wrap n rows of externally owned memory. owner is released with the view.
+    static VectorStore view(float* data, size_t dim, size_t stride, size_t n,
+                            std::shared_ptr<void> owner) {
+        VectorStore store;
+        store.dim_ = dim;
+        store.stride_ = stride;
+        store.size_ = n;
+        store.data_ = data;
+        store.owner_ = std::move(owner);
+        return store;
+    }
+
+    ~VectorStore() {
+        if (!owner_) std::free(data_);
+    }
+
+    VectorStore(const VectorStore&) = delete;
+    VectorStore& operator=(const VectorStore&) = delete;
+
+    VectorStore(VectorStore&& other) noexcept
+        : dim_(other.dim_), stride_(other.stride_), size_(other.size_),
+          capacity_(other.capacity_), data_(other.data_), owner_(std::move(other.owner_)) {
+        other.dim_ = other.stride_ = other.size_ = other.capacity_ = 0;
+        other.data_ = nullptr;
+    }
+
+    VectorStore& operator=(VectorStore&& other) noexcept {
+        if (this != &other) {
+            if (!owner_) std::free(data_);
+            dim_ = other.dim_;
+            stride_ = other.stride_;
+            size_ = other.size_;
+            capacity_ = other.capacity_;
+            data_ = other.data_;
+            owner_ = std::move(other.owner_);
+            other.dim_ = other.stride_ = other.size_ = other.capacity_ = 0;
+            other.data_ = nullptr;
+        }
+        return *this;
+    }
+
+    size_t size() const { return size_; }
+    size_t dim() const { return dim_; }
+    size_t stride() const { return stride_; }
+    bool empty() const { return size_ == 0; }
+    bool is_view() const { return static_cast<bool>(owner_); }
+
+    const float* data() const { return data_; }
+    const float* row(size_t i) const { return data_ + i * stride_; }
+    float* row(size_t i) { return data_ + i * stride_; }
+
+    // Grow the buffer to hold at least n rows without changing size().
+    void reserve(size_t n) {
+        if (n <= capacity_) return;
+        if (is_view()) throw std::logic_error("VectorStore: cannot grow a view");
+        size_t bytes = n * stride_ * sizeof(float);
+        void* p = nullptr;
+        if (posix_memalign(&p, kAlignment, bytes == 0 ? kAlignment : bytes) != 0) {
+            throw std::bad_alloc();
+        }
+        float* buf = static_cast<float*>(p);
+        if (data_) {
+            std::memcpy(buf, data_, size_ * stride_ * sizeof(float));
+            std::free(data_);
+        }
+        // Kernels read only the first dim() floats of a row, never the
+        // padding (views such as map_fvecs keep other data in that gap);
+        // it is zeroed so the buffer holds no uninitialized bytes.
+        std::memset(buf + size_ * stride_, 0, (n - size_) * stride_ * sizeof(float));
+        data_ = buf;
+        capacity_ = n;
+    }
+
+    // Append one vector of dim() floats.
+    void push_back(const float* v) {
+        if (size_ == capacity_) reserve(capacity_ == 0 ? 1024 : capacity_ * 2);
+        std::memcpy(row(size_), v, dim_ * sizeof(float));
+        size_++;
+    }
+
+    void shrink(size_t n) {
+        if (n < size_) size_ = n;
+    }
+
+    static size_t padded_stride(size_t dim) {
+        const size_t lanes = kAlignment / sizeof(float);
+        return (dim + lanes - 1) / lanes * lanes;
+    }
+
+private:
+    size_t dim_;
+    size_t stride_;
+    size_t size_;
+    size_t capacity_;
+    float* data_;
+    std::shared_ptr<void> owner_;
+};
+
+// Read [int32 dim][dim x T] records into a float store. The dimension is
+// taken from the first record and the file size is used to size the store
+// up front, so rows are read straight into their final slot (float files)
+// or through one row of scratch that is widened in place (other types).
+template <class T>
+inline VectorStore read_vecs_as_float(const std::string& filename, int max_vectors, const char* format) {
+    SEARCH_PROFILE_SCOPE(kTimerLoad);
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file) {
+        std::cerr << "Error: Cannot open file " << filename << std::endl;
+        return VectorStore();
+    }
+
+    std::streamoff file_size = file.tellg();
+    file.seekg(0);
+
+    int dim = 0;
+    file.read(reinterpret_cast<char*>(&dim), sizeof(int));
+    if (!file || dim <= 0) {
+        std::cerr << "Error: Invalid ." << format << " header in " << filename << std::endl;
+        return VectorStore();
+    }
+    file.seekg(0);
+
+    size_t record_bytes = sizeof(int) + static_cast<size_t>(dim) * sizeof(T);
+    size_t count = static_cast<size_t>(file_size) / record_bytes;
+    if (max_vectors > 0 && static_cast<size_t>(max_vectors) < count) {
+        count = static_cast<size_t>(max_vectors);
+    }
+
+    VectorStore store(static_cast<size_t>(dim), count);
+    std::vector<T> scratch(std::is_same<T, float>::value ? 0 : static_cast<size_t>(dim));
+    size_t loaded = 0;
+    for (; loaded < count; loaded++) {
+        int row_dim;
+        file.read(reinterpret_cast<char*>(&row_dim), sizeof(int));
+        if (!file) break;
+        if (row_dim != dim) {
+            std::cerr << "Error: Inconsistent dimension at vector " << loaded
+                      << " in " << filename << std::endl;
+            break;
+        }
+
+        float* row = store.row(loaded);
+        T* dst = scratch.empty() ? reinterpret_cast<T*>(row) : scratch.data();
+        file.read(reinterpret_cast<char*>(dst), dim * sizeof(T));
+        if (!file) break;
+        if (!scratch.empty()) std::copy(scratch.begin(), scratch.end(), row);
+    }
+
+    store.shrink(loaded);
+    return store;
+}
+
+// Read vectors from .fvecs binary file
+// Format: [dim (4 bytes)] [float values (dim × 4 bytes)] repeated
+inline VectorStore read_fvecs(const std::string& filename, int max_vectors = -1) {
+    return read_vecs_as_float<float>(filename, max_vectors, "fvecs");
+}
+
+// Read vectors from .bvecs binary file (the BIGANN base format)
+// Format: [dim (4 bytes)] [uint8 values (dim bytes)] repeated
+// Components are widened to float; use Uint8Store to keep them as bytes.
+inline VectorStore read_bvecs(const std::string& filename, int max_vectors = -1) {
+    return read_vecs_as_float<uint8_t>(filename, max_vectors, "bvecs");
+}
+
+// Pick the reader from the file extension (.bvecs, otherwise .fvecs).
+inline VectorStore read_vecs(const std::string& filename, int max_vectors = -1) {
+    const std::string ext = ".bvecs";
+    bool bytes = filename.size() >= ext.size() &&
+                 filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0;
+    return bytes ? read_bvecs(filename, max_vectors) : read_fvecs(filename, max_vectors);
+}
+
+// Dimension order by decreasing variance, estimated from up to sample_size
+// evenly spaced rows. Summing high-variance dimensions first makes partial
+// distances grow fastest, so early-abandon checks trigger sooner.
+inline std::vector<size_t> variance_dim_order(const VectorStore& store, size_t sample_size = 10000) {
+    const size_t dim = store.dim();
+    const size_t n = store.size();
+    const size_t step = std::max<size_t>(1, n / std::max<size_t>(1, sample_size));
+
+    std::vector<double> mean(dim, 0.0), sq(dim, 0.0);
+    size_t count = 0;
+    for (size_t i = 0; i < n; i += step, count++) {
+        const float* v = store.row(i);
+        for (size_t d = 0; d < dim; d++) {
+            mean[d] += v[d];
+            sq[d] += static_cast<double>(v[d]) * v[d];
+        }
+    }
+
+    std::vector<double> variance(dim, 0.0);
+    for (size_t d = 0; count > 0 && d < dim; d++) {
+        double m = mean[d] / count;
+        variance[d] = sq[d] / count - m * m;
+    }
+
+    std::vector<size_t> order(dim);
+    for (size_t d = 0; d < dim; d++) order[d] = d;
+    std::stable_sort(order.begin(), order.end(),
+                     [&variance](size_t a, size_t b) { return variance[a] > variance[b]; });
+    return order;
+}
+
+// Reorder the components of every row: new[d] = old[order[d]].
+// L2 distances are unchanged when database and queries share the order.
+// On a mapped view this writes into private (copy-on-write) pages.
+inline void permute_dims(VectorStore& store, const std::vector<size_t>& order) {
+    std::vector<float> tmp(store.dim());
+    for (size_t i = 0; i < store.size(); i++) {
+        float* v = store.row(i);
+        for (size_t d = 0; d < store.dim(); d++) tmp[d] = v[order[d]];
+        std::copy(tmp.begin(), tmp.end(), v);
+    }
+}
+
+// Scale every row to unit L2 norm (zero rows stay zero), so that cosine
+// similarity is a plain dot product. Done once at load time; on a mapped
+// view this writes into private (copy-on-write) pages.
+inline void normalize_rows(VectorStore& store) {
+    for (size_t i = 0; i < store.size(); i++) {
+        float* v = store.row(i);
+        double sum = 0.0;
+        for (size_t d = 0; d < store.dim(); d++) sum += double(v[d]) * v[d];
+        if (sum == 0.0) continue;
+        const float scale = static_cast<float>(1.0 / std::sqrt(sum));
+        for (size_t d = 0; d < store.dim(); d++) v[d] *= scale;
+    }
+}